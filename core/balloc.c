@@ -13,7 +13,7 @@ int nkfs_balloc_bm_clear(struct nkfs_sb *sb)
 	int err;
 
 	for (i = sb->bm_block; i < sb->bm_block + sb->bm_blocks; i++) {
-		clu = dio_clu_get(sb->ddev, i);
+		clu = dio_clu_get(sb->ddev, i, DIO_CLASS_META);
 		if (!clu) {
 			err = -EIO;
 			goto out;
@@ -24,17 +24,15 @@ int nkfs_balloc_bm_clear(struct nkfs_sb *sb)
 			dio_clu_put(clu);
 			goto out;
 		}
-
-		err = dio_clu_sync(clu);
-		if (err) {
-			dio_clu_put(clu);
-			goto out;
-		}
 		dio_clu_put(clu);
 	}
-	atomic64_set(&sb->used_blocks, 0);
 
-	err = 0;
+	/* Write whole bitmap by large merged bios */
+	err = dio_dev_sync(sb->ddev);
+	if (err)
+		goto out;
+
+	atomic64_set(&sb->used_blocks, 0);
 out:
 	return err;
 }
@@ -73,7 +71,7 @@ int nkfs_balloc_block_mark(struct nkfs_sb *sb, u64 block, int use)
 	if (err)
 		return err;
 
-	clu = dio_clu_get(sb->ddev, bm_block);
+	clu = dio_clu_get(sb->ddev, bm_block, DIO_CLASS_META);
 	if (!clu) {
 		err = -EIO;
 		goto out;
@@ -93,8 +91,8 @@ int nkfs_balloc_block_mark(struct nkfs_sb *sb, u64 block, int use)
 	}
 	dio_clu_read_unlock(clu);
 
-	dio_clu_set_dirty(clu);
-	err = dio_clu_sync(clu);
+	dio_clu_set_dirty_range(clu, long_off, sizeof(unsigned long));
+	err = dio_clu_commit(clu);
 	if (err) {
 		goto cleanup;
 	}
@@ -124,11 +122,11 @@ static int nkfs_balloc_block_find_set_free_bit(struct nkfs_sb *sb,
 	char *page;
 	unsigned long *addr;
 
-	NKFS_BUG_ON((clu->clu_size & (PAGE_SIZE - 1)));
+	NKFS_BUG_ON((clu->dev->clu_size & (PAGE_SIZE - 1)));
 
 	dio_clu_read_lock(clu);
 	i = 0;
-	for (pg_idx = 0; pg_idx < (clu->clu_size/PAGE_SIZE); pg_idx++) {
+	for (pg_idx = 0; pg_idx < (clu->dev->clu_size/PAGE_SIZE); pg_idx++) {
 		page = dio_clu_map(clu, i);
 		for (j = 0; j < PAGE_SIZE; j += sizeof(unsigned long),
 			i += sizeof(unsigned long)) {
@@ -148,8 +146,9 @@ static int nkfs_balloc_block_find_set_free_bit(struct nkfs_sb *sb,
 					!test_and_set_bit_le(bit, addr)) {
 
 					atomic64_inc(&sb->used_blocks);
-					dio_clu_set_dirty(clu);
-					err = dio_clu_sync(clu);
+					dio_clu_set_dirty_range(clu, i,
+						sizeof(unsigned long));
+					err = dio_clu_commit(clu);
 					if (err) {
 						return err;
 					}
@@ -177,7 +176,7 @@ int nkfs_balloc_block_alloc(struct nkfs_sb *sb, u64 *pblock)
 
 	*pblock = 0;
 	for (i = sb->bm_block; i < sb->bm_block + sb->bm_blocks; i++) {
-		clu = dio_clu_get(sb->ddev, i);
+		clu = dio_clu_get(sb->ddev, i, DIO_CLASS_META);
 		if (!clu) {
 			return -EIO;
 		}
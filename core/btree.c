@@ -2,112 +2,87 @@
 #include "dio.h"
 #include "helpers.h"
 #include "balloc.h"
+#include "trace.h"
 
 #include <crt/include/crt.h>
 #include <linux/mm.h>
+#include <linux/module.h>
+#include <asm/unaligned.h>
 
 static void nkfs_btree_nodes_remove(struct nkfs_btree *tree,
 	struct nkfs_btree_node *node);
 
+static void nkfs_btree_node_modify_end(struct nkfs_btree_node *node);
+
+static unsigned long nkfs_btree_nodes_max = NKFS_BTREE_NODES_MAX;
+module_param(nkfs_btree_nodes_max, ulong, 0644);
+MODULE_PARM_DESC(nkfs_btree_nodes_max,
+	"Count of in-memory btree nodes of all trees above which "
+	"unreferenced nodes are freed");
+
+/*
+ * Unreferenced nodes stay in nodes of their tree and on global LRU,
+ * the oldest are freed when count of nodes exceeds the budget. Lock
+ * order is tree->nodes_lock, then nkfs_btree_lru_lock.
+ */
+static DEFINE_SPINLOCK(nkfs_btree_lru_lock);
+static LIST_HEAD(nkfs_btree_lru);
+static unsigned long nkfs_btree_nr_lru;
+static atomic_long_t nkfs_btree_nr_nodes;
+static atomic_long_t nkfs_btree_hits;
+static atomic_long_t nkfs_btree_misses;
+
 static void __nkfs_btree_node_free(struct nkfs_btree_node *node)
 {
-	int i;
-
-	for (i = 0; i < ARRAY_SIZE(node->keys); i++) {
-		if (node->keys[i])
-			crt_free_page(node->keys[i]);
-	}
-
-	for (i = 0; i < ARRAY_SIZE(node->children); i++) {
-		if (node->children[i])
-			crt_free_page(node->children[i]);
-	}
-
-	for (i = 0; i < ARRAY_SIZE(node->values); i++) {
-		if (node->values[i])
-			crt_free_page(node->values[i]);
-	}
-
-	if (node->header)
-		crt_free_page(node->header);
-
+	if (node->modifying)
+		nkfs_btree_node_modify_end(node);
+	if (node->clu)
+		dio_clu_put(node->clu);
+	if (node->prefixes)
+		crt_kfree(node->prefixes);
 	crt_kfree(node);
+	atomic_long_dec(&nkfs_btree_nr_nodes);
 }
 
 struct nkfs_btree_key *nkfs_btree_node_key(struct nkfs_btree_node *node,
 					   int index)
 {
-	int pg_idx;
-	int pg_off;
-
-	NKFS_BUG_ON(index < 0);
-
-	pg_idx = (index*sizeof(struct nkfs_btree_key))/
-			sizeof(struct nkfs_btree_key_page);
-	pg_off = (index*sizeof(struct nkfs_btree_key)) &
-			(sizeof(struct nkfs_btree_key_page) - 1);
-
-	NKFS_BUG_ON(pg_idx >= ARRAY_SIZE(node->keys));
-	return (struct nkfs_btree_key *)(
-			(char *)page_address(node->keys[pg_idx]) + pg_off);
+	NKFS_BUG_ON(index < 0 || index >= ARRAY_SIZE(node->buf->keys));
+	return &node->buf->keys[index];
 }
 
 static struct nkfs_btree_child *nkfs_btree_node_child(
 					struct nkfs_btree_node *node, int index)
 {
-	int pg_idx;
-	int pg_off;
-
-	NKFS_BUG_ON(index < 0);
-
-	pg_idx = (index*sizeof(struct nkfs_btree_child))/
-			sizeof(struct nkfs_btree_child_page);
-	pg_off = (index*sizeof(struct nkfs_btree_child)) &
-			(sizeof(struct nkfs_btree_child_page) - 1);
-
-	NKFS_BUG_ON(pg_idx >= ARRAY_SIZE(node->children));
-	return (struct nkfs_btree_child *)(
-		(char *)page_address(node->children[pg_idx]) + pg_off);
+	NKFS_BUG_ON(index < 0 || index >= ARRAY_SIZE(node->buf->children));
+	return &node->buf->children[index];
 }
 
-struct nkfs_btree_value *nkfs_btree_node_value(struct nkfs_btree_node *node,
-					       int index)
+static struct nkfs_btree_value *nkfs_btree_node_value(
+					struct nkfs_btree_node *node, int index)
 {
-	int pg_idx;
-	int pg_off;
-
-	NKFS_BUG_ON(index < 0);
-
-	pg_idx = (index*sizeof(struct nkfs_btree_value))/
-			sizeof(struct nkfs_btree_value_page);
-	pg_off = (index*sizeof(struct nkfs_btree_value)) &
-			(sizeof(struct nkfs_btree_value_page) - 1);
-
-	NKFS_BUG_ON(pg_idx >= ARRAY_SIZE(node->values));
-	return (struct nkfs_btree_value *)(
-			(char *)page_address(node->values[pg_idx]) + pg_off);
+	NKFS_BUG_ON(index < 0 || index >= ARRAY_SIZE(node->buf->values));
+	return &node->buf->values[index];
 }
 
-static void nkfs_btree_node_zero_pages(struct nkfs_btree_node *node)
+static u64 *nkfs_btree_node_prefix(struct nkfs_btree_node *node, int index)
 {
-	int i;
-
-	memset(page_address(node->header), 0, PAGE_SIZE);
-
-	for (i = 0; i < ARRAY_SIZE(node->keys); i++)
-		memset(page_address(node->keys[i]), 0, PAGE_SIZE);
-
-	for (i = 0; i < ARRAY_SIZE(node->children); i++)
-		memset(page_address(node->children[i]), 0, PAGE_SIZE);
+	NKFS_BUG_ON(index < 0 || index >= NKFS_BTREE_KEYS_MAX);
+	return &node->prefixes[index];
+}
 
-	for (i = 0; i < ARRAY_SIZE(node->values); i++)
-		memset(page_address(node->values[i]), 0, PAGE_SIZE);
+static u64 nkfs_btree_key_prefix(struct nkfs_btree_key *key)
+{
+	return get_unaligned_be64(key->val);
 }
 
-static struct nkfs_btree_node *nkfs_btree_node_alloc(int zero_pages)
+/*
+ * Node is a view over buffer of its cluster, cluster stays pinned
+ * until node is freed. Reference of clu is passed to node.
+ */
+static struct nkfs_btree_node *nkfs_btree_node_alloc(struct dio_cluster *clu)
 {
 	struct nkfs_btree_node *node;
-	int i;
 
 	node = crt_kmalloc(sizeof(*node), GFP_NOIO);
 	if (!node) {
@@ -115,63 +90,31 @@ static struct nkfs_btree_node *nkfs_btree_node_alloc(int zero_pages)
 	}
 
 	memset(node, 0, sizeof(*node));
-
-	node->header = crt_alloc_page(GFP_KERNEL);
-	if (!node->header)
+	RB_CLEAR_NODE(&node->nodes_link);
+	INIT_LIST_HEAD(&node->lru);
+	init_rwsem(&node->latch);
+	seqcount_init(&node->seq);
+
+	node->prefixes = crt_kmalloc(NKFS_BTREE_KEYS_MAX * sizeof(u64),
+				     GFP_NOIO);
+	if (!node->prefixes)
 		goto fail;
 
-	for (i = 0; i < ARRAY_SIZE(node->keys); i++) {
-		node->keys[i] = crt_alloc_page(GFP_KERNEL);
-		if (!node->keys[i])
-			goto fail;
-	}
-
-	for (i = 0; i < ARRAY_SIZE(node->children); i++) {
-		node->children[i] = crt_alloc_page(GFP_KERNEL);
-		if (!node->children[i])
-			goto fail;
-	}
-
-	for (i = 0; i < ARRAY_SIZE(node->values); i++) {
-		node->values[i] = crt_alloc_page(GFP_KERNEL);
-		if (!node->values[i])
-			goto fail;
-	}
-
-	if (zero_pages)
-		nkfs_btree_node_zero_pages(node);
-
+	node->clu = clu;
+	node->buf = (struct nkfs_btree_node_buf *)dio_clu_map(clu, 0);
 	node->t = NKFS_BTREE_T;
 	node->sig1 = NKFS_BTREE_SIG1;
 	node->sig2 = NKFS_BTREE_SIG2;
 
 	atomic_set(&node->ref, 1);
+	atomic_long_inc(&nkfs_btree_nr_nodes);
 
 	return node;
 fail:
-	__nkfs_btree_node_free(node);
+	crt_kfree(node);
 	return NULL;
 }
 
-static void __nkfs_btree_node_release(struct nkfs_btree_node *node)
-{
-	nkfs_btree_nodes_remove(node->tree, node);
-	__nkfs_btree_node_free(node);
-}
-
-void nkfs_btree_node_ref(struct nkfs_btree_node *node)
-{
-	NKFS_BUG_ON(atomic_read(&node->ref) <= 0);
-	atomic_inc(&node->ref);
-}
-
-void nkfs_btree_node_deref(struct nkfs_btree_node *node)
-{
-	NKFS_BUG_ON(atomic_read(&node->ref) <= 0);
-	if (atomic_dec_and_test(&node->ref))
-		__nkfs_btree_node_release(node);
-}
-
 static struct nkfs_btree_node *__nkfs_btree_nodes_lookup(
 					struct nkfs_btree *tree, u64 block)
 {
@@ -194,6 +137,19 @@ static struct nkfs_btree_node *__nkfs_btree_nodes_lookup(
 	return found;
 }
 
+/* Called under nodes_lock, node could be unreferenced on LRU */
+static void __nkfs_btree_node_get(struct nkfs_btree_node *node)
+{
+	if (atomic_inc_return(&node->ref) != 1)
+		return;
+
+	spin_lock(&nkfs_btree_lru_lock);
+	NKFS_BUG_ON(list_empty(&node->lru));
+	list_del_init(&node->lru);
+	nkfs_btree_nr_lru--;
+	spin_unlock(&nkfs_btree_lru_lock);
+}
+
 static struct nkfs_btree_node *nkfs_btree_nodes_lookup(struct nkfs_btree *tree,
 	u64 block)
 {
@@ -202,12 +158,12 @@ static struct nkfs_btree_node *nkfs_btree_nodes_lookup(struct nkfs_btree *tree,
 	read_lock_irq(&tree->nodes_lock);
 	node = __nkfs_btree_nodes_lookup(tree, block);
 	if (node)
-		NKFS_BTREE_NODE_REF(node);
+		__nkfs_btree_node_get(node);
 	read_unlock_irq(&tree->nodes_lock);
 	return node;
 }
 
-static void nkfs_btree_nodes_remove(struct nkfs_btree *tree,
+static void __nkfs_btree_nodes_remove(struct nkfs_btree *tree,
 	struct nkfs_btree_node *node)
 {
 	struct nkfs_btree_node *found;
@@ -215,14 +171,132 @@ static void nkfs_btree_nodes_remove(struct nkfs_btree *tree,
 	if (!node->block)
 		return;
 
-	write_lock_irq(&tree->nodes_lock);
 	found = __nkfs_btree_nodes_lookup(tree, node->block);
 	if (found) {
 		NKFS_BUG_ON(found != node);
 		rb_erase(&found->nodes_link, &tree->nodes);
+		RB_CLEAR_NODE(&found->nodes_link);
 		tree->nodes_active--;
 	}
+}
+
+static void nkfs_btree_nodes_remove(struct nkfs_btree *tree,
+	struct nkfs_btree_node *node)
+{
+	write_lock_irq(&tree->nodes_lock);
+	__nkfs_btree_nodes_remove(tree, node);
+	write_unlock_irq(&tree->nodes_lock);
+}
+
+void nkfs_btree_node_ref(struct nkfs_btree_node *node)
+{
+	NKFS_BUG_ON(atomic_read(&node->ref) <= 0);
+	atomic_inc(&node->ref);
+}
+
+/*
+ * Free the oldest unreferenced nodes above the budget. Lock order is
+ * reversed here, so nodes_lock is only tried.
+ */
+static void nkfs_btree_lru_shrink(void)
+{
+	struct nkfs_btree_node *node, *tmp;
+	struct nkfs_btree *tree;
+	long nr_free;
+	LIST_HEAD(free_list);
+
+	nr_free = atomic_long_read(&nkfs_btree_nr_nodes) -
+		  READ_ONCE(nkfs_btree_nodes_max);
+	if (nr_free <= 0)
+		return;
+
+	spin_lock_irq(&nkfs_btree_lru_lock);
+	list_for_each_entry_safe(node, tmp, &nkfs_btree_lru, lru) {
+		if (nr_free <= 0)
+			break;
+		tree = node->tree;
+		if (!write_trylock(&tree->nodes_lock))
+			continue;
+
+		/* Unreferenced node is only got under nodes_lock */
+		NKFS_BUG_ON(atomic_read(&node->ref));
+		__nkfs_btree_nodes_remove(tree, node);
+		list_move(&node->lru, &free_list);
+		nkfs_btree_nr_lru--;
+		nr_free--;
+		write_unlock(&tree->nodes_lock);
+	}
+	spin_unlock_irq(&nkfs_btree_lru_lock);
+
+	list_for_each_entry_safe(node, tmp, &free_list, lru)
+		__nkfs_btree_node_free(node);
+}
+
+/*
+ * The last reference is dropped under nodes_lock, so concurrent
+ * nkfs_btree_nodes_lookup() can't find node being freed. Node of live
+ * tree stays cached on LRU.
+ */
+void nkfs_btree_node_deref(struct nkfs_btree_node *node)
+{
+	struct nkfs_btree *tree = node->tree;
+
+	NKFS_BUG_ON(atomic_read(&node->ref) <= 0);
+	if (atomic_add_unless(&node->ref, -1, 1))
+		return;
+
+	write_lock_irq(&tree->nodes_lock);
+	if (!atomic_dec_and_test(&node->ref)) {
+		write_unlock_irq(&tree->nodes_lock);
+		return;
+	}
+
+	if (!RB_EMPTY_NODE(&node->nodes_link) && !node->modifying &&
+	    !tree->releasing) {
+		spin_lock(&nkfs_btree_lru_lock);
+		list_add_tail(&node->lru, &nkfs_btree_lru);
+		nkfs_btree_nr_lru++;
+		spin_unlock(&nkfs_btree_lru_lock);
+		write_unlock_irq(&tree->nodes_lock);
+		nkfs_btree_lru_shrink();
+		return;
+	}
+
+	__nkfs_btree_nodes_remove(tree, node);
 	write_unlock_irq(&tree->nodes_lock);
+
+	__nkfs_btree_node_free(node);
+}
+
+/* Free cached nodes of tree being released */
+static void nkfs_btree_nodes_drop(struct nkfs_btree *tree)
+{
+	struct nkfs_btree_node *node, *tmp;
+	struct rb_node *n;
+	LIST_HEAD(free_list);
+
+	write_lock_irq(&tree->nodes_lock);
+	spin_lock(&nkfs_btree_lru_lock);
+	while ((n = rb_first(&tree->nodes))) {
+		node = rb_entry(n, struct nkfs_btree_node, nodes_link);
+		NKFS_BUG_ON(atomic_read(&node->ref));
+		__nkfs_btree_nodes_remove(tree, node);
+		list_move(&node->lru, &free_list);
+		nkfs_btree_nr_lru--;
+	}
+	spin_unlock(&nkfs_btree_lru_lock);
+	write_unlock_irq(&tree->nodes_lock);
+
+	list_for_each_entry_safe(node, tmp, &free_list, lru)
+		__nkfs_btree_node_free(node);
+}
+
+void nkfs_btree_cache_stats(struct nkfs_btree_cache_stats *stats)
+{
+	stats->nr_nodes = atomic_long_read(&nkfs_btree_nr_nodes);
+	stats->nr_cached = READ_ONCE(nkfs_btree_nr_lru);
+	stats->hits = atomic_long_read(&nkfs_btree_hits);
+	stats->misses = atomic_long_read(&nkfs_btree_misses);
 }
 
 static struct nkfs_btree_node *nkfs_btree_nodes_insert(struct nkfs_btree *tree,
@@ -253,181 +327,76 @@ static struct nkfs_btree_node *nkfs_btree_nodes_insert(struct nkfs_btree *tree,
 		tree->nodes_active++;
 		inserted = node;
 	}
-	NKFS_BTREE_NODE_REF(inserted);
+	__nkfs_btree_node_get(inserted);
 	write_unlock_irq(&tree->nodes_lock);
 	return inserted;
 }
 
-static void nkfs_btree_node_child_page_by_ondisk(
-	struct nkfs_btree_child_page	*dst,
-	struct nkfs_btree_child_page *src)
-{
-	int i;
-
-	for (i = 0; i < ARRAY_SIZE(src->children); i++)
-		dst->children[i].val = be64_to_cpu(src->children[i].val_be);
-}
-
-static void nkfs_btree_node_value_page_by_ondisk(
-	struct nkfs_btree_value_page	*dst,
-	struct nkfs_btree_value_page *src)
-{
-	int i;
-
-	for (i = 0; i < ARRAY_SIZE(src->values); i++)
-		dst->values[i].val = be64_to_cpu(src->values[i].val_be);
-}
-
-static void nkfs_btree_node_child_page_to_ondisk(
-	struct nkfs_btree_child_page	*dst,
-	struct nkfs_btree_child_page *src)
-{
-	int i;
-
-	for (i = 0; i < ARRAY_SIZE(src->children); i++)
-		dst->children[i].val_be = cpu_to_be64(src->children[i].val);
-}
-
-static void nkfs_btree_node_value_page_to_ondisk(
-	struct nkfs_btree_value_page	*dst,
-	struct nkfs_btree_value_page *src)
-{
-	int i;
-
-	for (i = 0; i < ARRAY_SIZE(src->values); i++)
-		dst->values[i].val_be = cpu_to_be64(src->values[i].val);
-}
-
-static void nkfs_btree_node_header_page_to_ondisk(
-	struct nkfs_btree_header_page *dst,
-	struct nkfs_btree_header_page *src)
-{
-	memcpy(dst, src, sizeof(*src));
-	dst->sig1 = cpu_to_be32(src->sig1);
-	dst->leaf = cpu_to_be32(src->leaf);
-	dst->nr_keys = cpu_to_be32(src->nr_keys);
-	dst->sig2 = cpu_to_be32(src->sig2);
-}
-
-static void nkfs_btree_node_header_page_by_ondisk(
-	struct nkfs_btree_header_page *dst,
-	struct nkfs_btree_header_page *src)
+static struct csum *nkfs_btree_node_map_sum(struct nkfs_btree_node *node)
 {
-	memcpy(dst, src, sizeof(*src));
-	dst->sig1 = be32_to_cpu(src->sig1);
-	dst->leaf = be32_to_cpu(src->leaf);
-	dst->nr_keys = be32_to_cpu(src->nr_keys);
-	dst->sig2 = be32_to_cpu(src->sig2);
+	return &node->buf->header.sum;
 }
 
-static void nkfs_btree_node_key_page_copy(
-	struct nkfs_btree_key_page *dst,
-	struct nkfs_btree_key_page *src)
-{
-	memcpy(dst, src, sizeof(*src));
-}
-
-static void nkfs_btree_node_by_ondisk(struct nkfs_btree_node *node,
-			struct dio_cluster *clu)
+/* Digest of header up to sum and of all entries, in on-disk order */
+static void nkfs_btree_node_calc_sum(struct nkfs_btree_node *node,
+	struct csum *sum)
 {
-	int i;
-
-	nkfs_btree_node_header_page_by_ondisk(
-		page_address(node->header),
-		(struct nkfs_btree_header_page *)dio_clu_map(clu,
-		(unsigned long)&((struct nkfs_btree_node_disk *)0)->header));
-
-	for (i = 0; i < ARRAY_SIZE(node->keys); i++) {
-		nkfs_btree_node_key_page_copy(
-		(struct nkfs_btree_key_page *)page_address(node->keys[i]),
-		(struct nkfs_btree_key_page *)dio_clu_map(clu,
-		(unsigned long)&((struct nkfs_btree_node_disk *)0)->keys[i]));
-	}
-
-	for (i = 0; i < ARRAY_SIZE(node->children); i++) {
-		nkfs_btree_node_child_page_by_ondisk(
-		(struct nkfs_btree_child_page *)page_address(node->children[i]),
-		(struct nkfs_btree_child_page *)dio_clu_map(clu,
-		(unsigned long)
-			&((struct nkfs_btree_node_disk *)0)->children[i]));
-	}
+	struct nkfs_btree_node_buf *buf = node->buf;
+	struct csum_ctx ctx;
 
-	for (i = 0; i < ARRAY_SIZE(node->values); i++) {
-		nkfs_btree_node_value_page_by_ondisk(
-		(struct nkfs_btree_value_page *)page_address(node->values[i]),
-		(struct nkfs_btree_value_page *)dio_clu_map(clu,
-		(unsigned long)&((struct nkfs_btree_node_disk *)0)->values[i]));
-	}
+	csum_reset(&ctx);
+	csum_update(&ctx, &buf->header,
+		offsetof(struct nkfs_btree_header_page, sum));
+	csum_update(&ctx, buf->key_pages,
+		sizeof(*buf) - offsetof(struct nkfs_btree_node_buf, key_pages));
+	csum_digest(&ctx, sum);
 }
 
-static void nkfs_btree_node_to_ondisk(struct nkfs_btree_node *node,
-			struct dio_cluster *clu)
+/*
+ * Called before every change of node buffers, nodes stay in modifying
+ * state until nkfs_btree_node_write(), so clusters aren't written back
+ * with half done change. Writeback of all nodes is waited for before
+ * seq of any node is opened, so lookups never wait for I/O.
+ */
+static void nkfs_btree_nodes_modify(struct nkfs_btree_node **nodes, int nr)
 {
 	int i;
 
-	nkfs_btree_node_header_page_to_ondisk(
-		(struct nkfs_btree_header_page *)dio_clu_map(clu,
-		(unsigned long)&((struct nkfs_btree_node_disk *)0)->header),
-		(struct nkfs_btree_header_page *)page_address(node->header));
-
-	for (i = 0; i < ARRAY_SIZE(node->keys); i++) {
-		nkfs_btree_node_key_page_copy(
-		(struct nkfs_btree_key_page *)dio_clu_map(clu,
-		(unsigned long)&((struct nkfs_btree_node_disk *)0)->keys[i]),
-		(struct nkfs_btree_key_page *)page_address(node->keys[i]));
+	for (i = 0; i < nr; i++) {
+		if (!nodes[i]->modifying)
+			dio_clu_modify_begin(nodes[i]->clu);
 	}
 
-	for (i = 0; i < ARRAY_SIZE(node->children); i++) {
-		nkfs_btree_node_child_page_to_ondisk(
-		(struct nkfs_btree_child_page *)dio_clu_map(clu,
-		(unsigned long)
-			&((struct nkfs_btree_node_disk *)0)->children[i]),
-		(struct nkfs_btree_child_page *)
-			page_address(node->children[i]));
-	}
-
-	for (i = 0; i < ARRAY_SIZE(node->values); i++) {
-		nkfs_btree_node_value_page_to_ondisk(
-		(struct nkfs_btree_value_page *)dio_clu_map(clu,
-		(unsigned long)&((struct nkfs_btree_node_disk *)0)->values[i]),
-		(struct nkfs_btree_value_page *)page_address(node->values[i]));
+	/* Writers are serialized by latch, see nkfs_btree_node_read_begin() */
+	for (i = 0; i < nr; i++) {
+		if (!nodes[i]->modifying) {
+			raw_write_seqcount_begin(&nodes[i]->seq);
+			nodes[i]->modifying = 1;
+		}
 	}
 }
 
-static struct csum *nkfs_btree_node_map_sum(struct nkfs_btree_node *node)
+static void nkfs_btree_node_modify(struct nkfs_btree_node *node)
 {
-	struct nkfs_btree_header_page *header;
-
-	header = page_address(node->header);
-	return &header->sum;
+	nkfs_btree_nodes_modify(&node, 1);
 }
 
-static void nkfs_btree_node_calc_sum(struct nkfs_btree_node *node,
-	struct csum *sum, int write)
+/* Store header and digest, cluster becomes dirty */
+static void nkfs_btree_node_modify_end(struct nkfs_btree_node *node)
 {
-	struct csum_ctx ctx;
-	struct nkfs_btree_header_page *header;
-	int i;
+	struct nkfs_btree_header_page *header = &node->buf->header;
 
-	header = page_address(node->header);
-	csum_reset(&ctx);
+	NKFS_BUG_ON(!node->modifying);
 
-	csum_update(&ctx, page_address(node->header),
-		offsetof(struct nkfs_btree_header_page, sum));
+	header->sig1 = cpu_to_be32(node->sig1);
+	header->sig2 = cpu_to_be32(node->sig2);
+	header->leaf = cpu_to_be32(node->leaf);
+	header->nr_keys = cpu_to_be32(node->nr_keys);
+	nkfs_btree_node_calc_sum(node, nkfs_btree_node_map_sum(node));
 
-	for (i = 0; i < ARRAY_SIZE(node->keys); i++) {
-		csum_update(&ctx, page_address(node->keys[i]), PAGE_SIZE);
-	}
-
-	for (i = 0; i < ARRAY_SIZE(node->children); i++) {
-		csum_update(&ctx, page_address(node->children[i]), PAGE_SIZE);
-	}
-
-	for (i = 0; i < ARRAY_SIZE(node->values); i++) {
-		csum_update(&ctx, page_address(node->values[i]), PAGE_SIZE);
-	}
-
-	csum_digest(&ctx, sum);
+	node->modifying = 0;
+	raw_write_seqcount_end(&node->seq);
+	dio_clu_modify_end(node->clu);
 }
 
 static struct nkfs_btree_node *nkfs_btree_node_read(struct nkfs_btree *tree,
@@ -437,43 +406,50 @@ static struct nkfs_btree_node *nkfs_btree_node_read(struct nkfs_btree *tree,
 	struct dio_cluster *clu;
 	struct csum sum;
 	struct nkfs_btree_header_page *header;
+	int i;
 
 	NKFS_BUG_ON(sizeof(struct nkfs_btree_node_disk) > tree->sb->bsize);
 	NKFS_BUG_ON(block == 0 || block >= tree->sb->nr_blocks);
 
 	node = nkfs_btree_nodes_lookup(tree, block);
-	if (node)
+	if (node) {
+		atomic_long_inc(&nkfs_btree_hits);
 		return node;
+	}
+	atomic_long_inc(&nkfs_btree_misses);
 
-	node = nkfs_btree_node_alloc(0);
-	if (!node)
+	clu = dio_clu_get(tree->sb->ddev, block, DIO_CLASS_META);
+	if (!clu)
 		return NULL;
 
+	node = nkfs_btree_node_alloc(clu);
+	if (!node) {
+		dio_clu_put(clu);
+		return NULL;
+	}
+
 	node->tree = tree;
 	node->block = block;
 
-	clu = dio_clu_get(tree->sb->ddev, node->block);
-	if (!clu) {
-		goto free_node;
-	}
-	nkfs_btree_node_by_ondisk(node, clu);
-
-	header = page_address(node->header);
-	node->sig1 = header->sig1;
-	node->sig2 = header->sig2;
-	node->leaf = header->leaf;
-	node->nr_keys = header->nr_keys;
+	header = &node->buf->header;
+	node->sig1 = be32_to_cpu(header->sig1);
+	node->sig2 = be32_to_cpu(header->sig2);
+	node->leaf = be32_to_cpu(header->leaf);
+	node->nr_keys = be32_to_cpu(header->nr_keys);
 	if (node->sig1 != NKFS_BTREE_SIG1
-		|| node->sig2 != NKFS_BTREE_SIG2) {
-		goto put_clu;
+		|| node->sig2 != NKFS_BTREE_SIG2
+		|| node->nr_keys > (2*node->t - 1)) {
+		goto free_node;
 	}
 
-	nkfs_btree_node_calc_sum(node, &sum, 0);
+	nkfs_btree_node_calc_sum(node, &sum);
 	if (0 != memcmp(&sum, nkfs_btree_node_map_sum(node), sizeof(sum))) {
-		goto put_clu;
+		goto free_node;
 	}
 
-	dio_clu_put(clu);
+	for (i = 0; i < node->nr_keys; i++)
+		*nkfs_btree_node_prefix(node, i) = nkfs_btree_key_prefix(
+					nkfs_btree_node_key(node, i));
 
 	inserted = nkfs_btree_nodes_insert(tree, node);
 	if (node != inserted) {
@@ -485,20 +461,18 @@ static struct nkfs_btree_node *nkfs_btree_node_read(struct nkfs_btree *tree,
 
 	return node;
 
-put_clu:
-	dio_clu_put(clu);
 free_node:
 	__nkfs_btree_node_free(node);
 
-	return NULL;
+	/*
+	 * Node could be read concurrently and changed by writer meanwhile,
+	 * then it is already in nodes of tree.
+	 */
+	return nkfs_btree_nodes_lookup(tree, block);
 }
 
-int nkfs_btree_node_write(struct nkfs_btree_node *node)
+static void nkfs_btree_node_finish(struct nkfs_btree_node *node)
 {
-	struct dio_cluster *clu;
-	struct nkfs_btree_header_page *header;
-	int err;
-
 	NKFS_BUG_ON(node->sig1 != NKFS_BTREE_SIG1 ||
 		    node->sig2 != NKFS_BTREE_SIG2);
 	NKFS_BUG_ON(!node->tree);
@@ -506,23 +480,111 @@ int nkfs_btree_node_write(struct nkfs_btree_node *node)
 		    node->tree->sb->bsize);
 	NKFS_BUG_ON(!node->block || node->block >= node->tree->sb->nr_blocks);
 
-	clu = dio_clu_get(node->tree->sb->ddev, node->block);
-	if (!clu) {
-		return -EIO;
+	/* Header could be changed without change of entries */
+	nkfs_btree_node_modify(node);
+	nkfs_btree_node_modify_end(node);
+}
+
+int nkfs_btree_node_write(struct nkfs_btree_node *node)
+{
+	nkfs_btree_node_finish(node);
+	return dio_clu_commit(node->clu);
+}
+
+/*
+ * Write nodes changed together. Changes of all nodes are finished
+ * before I/O, so lookups don't wait for it on any of them.
+ */
+static int nkfs_btree_nodes_write(struct nkfs_btree_node **nodes, int nr)
+{
+	struct dio_cluster *clus[3];
+	int i;
+
+	NKFS_BUG_ON(nr > ARRAY_SIZE(clus));
+	for (i = 0; i < nr; i++) {
+		nkfs_btree_node_finish(nodes[i]);
+		clus[i] = nodes[i]->clu;
 	}
 
-	header = page_address(node->header);
-	header->sig1 = node->sig1;
-	header->sig2 = node->sig2;
-	header->leaf = node->leaf;
-	header->nr_keys = node->nr_keys;
+	return dio_clus_commit(clus, nr);
+}
 
-	nkfs_btree_node_calc_sum(node, nkfs_btree_node_map_sum(node), 1);
-	nkfs_btree_node_to_ondisk(node, clu);
+void nkfs_btree_trans_init(struct nkfs_btree_trans *trans)
+{
+	memset(trans, 0, sizeof(*trans));
+}
 
-	dio_clu_set_dirty(clu);
-	err = dio_clu_sync(clu);
-	dio_clu_put(clu);
+static int nkfs_btree_trans_flush(struct nkfs_btree_trans *trans)
+{
+	struct dio_cluster *clus[NKFS_BTREE_TRANS_NODES];
+	int i, err;
+
+	for (i = 0; i < trans->nr_nodes; i++)
+		clus[i] = trans->nodes[i]->clu;
+
+	err = dio_clus_commit(clus, trans->nr_nodes);
+	for (i = 0; i < trans->nr_nodes; i++)
+		NKFS_BTREE_NODE_DEREF(trans->nodes[i]);
+	trans->nr_nodes = 0;
+
+	if (err && !trans->err)
+		trans->err = err;
+	return err;
+}
+
+/* Write nodes of transaction, returns the first error of its writes */
+int nkfs_btree_trans_commit(struct nkfs_btree_trans *trans)
+{
+	nkfs_btree_trans_flush(trans);
+	return trans->err;
+}
+
+/*
+ * Without transaction node is written at once, otherwise its change is
+ * finished and node is held by transaction, so repeated changes of
+ * node cost one write.
+ */
+static int nkfs_btree_node_dirty(struct nkfs_btree_node *node,
+				 struct nkfs_btree_trans *trans)
+{
+	int i, err;
+
+	if (!trans)
+		return nkfs_btree_node_write(node);
+
+	nkfs_btree_node_finish(node);
+	for (i = 0; i < trans->nr_nodes; i++) {
+		if (trans->nodes[i] == node)
+			return 0;
+	}
+
+	if (trans->nr_nodes == NKFS_BTREE_TRANS_NODES) {
+		err = nkfs_btree_trans_flush(trans);
+		if (err)
+			return err;
+	}
+
+	NKFS_BTREE_NODE_REF(node);
+	trans->nodes[trans->nr_nodes++] = node;
+	return 0;
+}
+
+static int nkfs_btree_nodes_dirty(struct nkfs_btree_node **nodes, int nr,
+				  struct nkfs_btree_trans *trans)
+{
+	int i, err = 0;
+
+	if (!trans)
+		return nkfs_btree_nodes_write(nodes, nr);
+
+	/* Finish all before any flush, see nkfs_btree_nodes_write() */
+	for (i = 0; i < nr; i++)
+		nkfs_btree_node_finish(nodes[i]);
+	for (i = 0; i < nr && !err; i++)
+		err = nkfs_btree_node_dirty(nodes[i], trans);
+	/* Nodes not held by trans are lost, commit must fail too */
+	if (err && !trans->err)
+		trans->err = err;
 	return err;
 }
 
@@ -533,18 +595,34 @@ static void nkfs_btree_node_delete(struct nkfs_btree_node *node)
 	node->block = 0;
 }
 
-void nkfs_btree_key_by_u64(u64 val, struct nkfs_btree_key *key)
+/*
+ * Big-endian since NKFS_IMAGE_VER_3, so adjacent numbers are adjacent
+ * keys. Trees of older images keep keys in host order.
+ */
+int nkfs_btree_u64_keys_ordered(struct nkfs_btree *tree)
+{
+	return tree->sb->version >= NKFS_IMAGE_VER_3;
+}
+
+void nkfs_btree_key_by_u64(struct nkfs_btree *tree, u64 val,
+			   struct nkfs_btree_key *key)
 {
 	NKFS_BUG_ON(sizeof(val) > sizeof(*key));
 	memset(key, 0, sizeof(*key));
-	memcpy(key, &val, sizeof(val));
+	if (nkfs_btree_u64_keys_ordered(tree))
+		put_unaligned_be64(val, key->val);
+	else
+		memcpy(key->val, &val, sizeof(val));
 }
 
-u64 nkfs_btree_key_to_u64(struct nkfs_btree_key *key)
+u64 nkfs_btree_key_to_u64(struct nkfs_btree *tree, struct nkfs_btree_key *key)
 {
 	u64 val;
 
-	memcpy(&val, key, sizeof(val));
+	if (nkfs_btree_u64_keys_ordered(tree))
+		return get_unaligned_be64(key->val);
+
+	memcpy(&val, key->val, sizeof(val));
 	return val;
 }
 
@@ -560,21 +638,52 @@ u64 nkfs_btree_value_to_u64(struct nkfs_btree_value *value)
 	return value->val;
 }
 
+/*
+ * Empty node on just allocated block, not written and not in nodes of
+ * tree yet. Old content of block isn't read.
+ */
+static struct nkfs_btree_node *nkfs_btree_node_new(struct nkfs_btree *tree)
+{
+	struct nkfs_btree_node *node;
+	struct dio_cluster *clu;
+	u64 block;
+	int err;
+
+	err = nkfs_balloc_block_alloc(tree->sb, &block);
+	if (err)
+		return NULL;
+
+	clu = dio_clu_get_new(tree->sb->ddev, block, DIO_CLASS_META);
+	if (!clu)
+		goto free_block;
+
+	node = nkfs_btree_node_alloc(clu);
+	if (!node) {
+		dio_clu_put(clu);
+		goto free_block;
+	}
+
+	node->tree = tree;
+	node->block = block;
+	nkfs_btree_node_modify(node);
+	memset(node->buf, 0, sizeof(*node->buf));
+	memset(node->prefixes, 0, NKFS_BTREE_KEYS_MAX * sizeof(u64));
+	return node;
+
+free_block:
+	nkfs_balloc_block_free(tree->sb, block);
+	return NULL;
+}
+
 static struct nkfs_btree_node *nkfs_btree_node_create(struct nkfs_btree *tree)
 {
 	struct nkfs_btree_node *node, *inserted;
 	int err;
 
-	node = nkfs_btree_node_alloc(1);
+	node = nkfs_btree_node_new(tree);
 	if (!node)
 		return NULL;
 
-	err = nkfs_balloc_block_alloc(tree->sb, &node->block);
-	if (err) {
-		__nkfs_btree_node_free(node);
-		return NULL;
-	}
-	node->tree = tree;
 	err = nkfs_btree_node_write(node);
 	if (err) {
 		nkfs_btree_node_delete(node);
@@ -629,10 +738,9 @@ u64 nkfs_btree_root_block(struct nkfs_btree *tree)
 	return block;
 }
 
-struct nkfs_btree *nkfs_btree_create(struct nkfs_sb *sb, u64 root_block)
+static struct nkfs_btree *nkfs_btree_alloc(struct nkfs_sb *sb)
 {
 	struct nkfs_btree *tree;
-	int err;
 
 	tree = crt_kmalloc(sizeof(*tree), GFP_NOIO);
 	if (!tree) {
@@ -646,6 +754,17 @@ struct nkfs_btree *nkfs_btree_create(struct nkfs_sb *sb, u64 root_block)
 	tree->nodes = RB_ROOT;
 	tree->sb = sb;
 	tree->sig1 = NKFS_BTREE_SIG1;
+	return tree;
+}
+
+struct nkfs_btree *nkfs_btree_create(struct nkfs_sb *sb, u64 root_block)
+{
+	struct nkfs_btree *tree;
+	int err;
+
+	tree = nkfs_btree_alloc(sb);
+	if (!tree)
+		return NULL;
 
 	if (root_block)
 		tree->root = nkfs_btree_node_read(tree, root_block);
@@ -681,6 +800,7 @@ static void nkfs_btree_release(struct nkfs_btree *tree)
 	if (tree->root)
 		NKFS_BTREE_NODE_DEREF(tree->root);
 
+	nkfs_btree_nodes_drop(tree);
 	NKFS_BUG_ON(tree->nodes_active);
 
 	crt_free(tree);
@@ -721,17 +841,17 @@ static void nkfs_btree_copy_child(
 	struct nkfs_btree_child *dst,
 	struct nkfs_btree_child *src)
 {
-	dst->val = src->val;
+	dst->val_be = src->val_be;
 }
 
 static void nkfs_btree_set_child_val(struct nkfs_btree_child *dst, u64 val)
 {
-	dst->val = val;
+	dst->val_be = cpu_to_be64(val);
 }
 
 static u64 nkfs_btree_get_child_val(struct nkfs_btree_child *src)
 {
-	return src->val;
+	return be64_to_cpu(src->val_be);
 }
 
 static int nkfs_btree_node_is_full(struct nkfs_btree_node *node)
@@ -739,20 +859,52 @@ static int nkfs_btree_node_is_full(struct nkfs_btree_node *node)
 	return ((2*NKFS_BTREE_T - 1) == node->nr_keys) ? 1 : 0;
 }
 
+/*
+ * Node entries are kept in on-disk byte order, helpers below convert
+ * host values and call nkfs_btree_node_modify() before any change.
+ * Every store of node key goes here to keep prefix of key in sync.
+ */
+static void nkfs_btree_node_set_key(struct nkfs_btree_node *dst,
+				    int dst_index,
+				    struct nkfs_btree_key *key)
+{
+	nkfs_btree_node_modify(dst);
+	nkfs_btree_copy_key(nkfs_btree_node_key(dst, dst_index), key);
+	*nkfs_btree_node_prefix(dst, dst_index) = nkfs_btree_key_prefix(key);
+}
+
+static void nkfs_btree_node_set_value(struct nkfs_btree_node *dst,
+				      int dst_index,
+				      struct nkfs_btree_value *value)
+{
+	nkfs_btree_node_modify(dst);
+	nkfs_btree_node_value(dst, dst_index)->val_be = cpu_to_be64(value->val);
+}
+
+static void nkfs_btree_node_get_value(struct nkfs_btree_node *src,
+				      int src_index,
+				      struct nkfs_btree_value *value)
+{
+	value->val = be64_to_cpu(nkfs_btree_node_value(src, src_index)->val_be);
+}
+
 static void nkfs_btree_node_copy_key_value(struct nkfs_btree_node *dst,
 					   int dst_index,
 					   struct nkfs_btree_key *key,
 					   struct nkfs_btree_value *value)
 {
-	nkfs_btree_copy_key(nkfs_btree_node_key(dst, dst_index), key);
-	nkfs_btree_copy_value(nkfs_btree_node_value(dst, dst_index), value);
+	nkfs_btree_node_set_key(dst, dst_index, key);
+	nkfs_btree_node_set_value(dst, dst_index, value);
 }
 
 static void nkfs_btree_node_copy_kv(struct nkfs_btree_node *dst, int dst_index,
 	struct nkfs_btree_node *src, int src_index)
 {
+	nkfs_btree_node_modify(dst);
 	nkfs_btree_copy_key(nkfs_btree_node_key(dst, dst_index),
 			nkfs_btree_node_key(src, src_index));
+	*nkfs_btree_node_prefix(dst, dst_index) =
+			*nkfs_btree_node_prefix(src, src_index);
 	nkfs_btree_copy_value(nkfs_btree_node_value(dst, dst_index),
 			nkfs_btree_node_value(src, src_index));
 }
@@ -762,14 +914,54 @@ static void nkfs_btree_node_copy_child(struct nkfs_btree_node *dst,
 				       struct nkfs_btree_node *src,
 				       int src_index)
 {
+	nkfs_btree_node_modify(dst);
 	nkfs_btree_copy_child(nkfs_btree_node_child(dst, dst_index),
 				nkfs_btree_node_child(src, src_index));
 }
 
+/* Copy nr key-values between different nodes */
+static void nkfs_btree_node_copy_kvs(struct nkfs_btree_node *dst,
+				     int dst_index,
+				     struct nkfs_btree_node *src,
+				     int src_index, int nr)
+{
+	NKFS_BUG_ON(dst == src || nr < 0);
+	NKFS_BUG_ON(dst_index + nr > NKFS_BTREE_KEYS_MAX ||
+		    src_index + nr > NKFS_BTREE_KEYS_MAX);
+
+	nkfs_btree_node_modify(dst);
+	memcpy(nkfs_btree_node_key(dst, dst_index),
+	       nkfs_btree_node_key(src, src_index),
+	       nr * sizeof(struct nkfs_btree_key));
+	memcpy(nkfs_btree_node_value(dst, dst_index),
+	       nkfs_btree_node_value(src, src_index),
+	       nr * sizeof(struct nkfs_btree_value));
+	memcpy(nkfs_btree_node_prefix(dst, dst_index),
+	       nkfs_btree_node_prefix(src, src_index),
+	       nr * sizeof(u64));
+}
+
+/* Copy nr children between different nodes */
+static void nkfs_btree_node_copy_children(struct nkfs_btree_node *dst,
+					  int dst_index,
+					  struct nkfs_btree_node *src,
+					  int src_index, int nr)
+{
+	NKFS_BUG_ON(dst == src || nr < 0);
+	NKFS_BUG_ON(dst_index + nr > NKFS_BTREE_CHILDREN_MAX ||
+		    src_index + nr > NKFS_BTREE_CHILDREN_MAX);
+
+	nkfs_btree_node_modify(dst);
+	memcpy(nkfs_btree_node_child(dst, dst_index),
+	       nkfs_btree_node_child(src, src_index),
+	       nr * sizeof(struct nkfs_btree_child));
+}
+
 static void nkfs_btree_node_set_child_val(struct nkfs_btree_node *dst,
 					  int dst_index,
 					  u64 val)
 {
+	nkfs_btree_node_modify(dst);
 	nkfs_btree_set_child_val(nkfs_btree_node_child(dst, dst_index), val);
 }
 
@@ -779,16 +971,46 @@ static u64 nkfs_btree_node_get_child_val(struct nkfs_btree_node *src,
 	return nkfs_btree_get_child_val(nkfs_btree_node_child(src, src_index));
 }
 
+/* Free slot at index of key-value arrays */
+static void nkfs_btree_node_shift_kv(struct nkfs_btree_node *node, int index)
+{
+	struct nkfs_btree_node_buf *buf = node->buf;
+	int nr = node->nr_keys - index;
+
+	NKFS_BUG_ON(index < 0 || node->nr_keys >= NKFS_BTREE_KEYS_MAX);
+	if (nr <= 0)
+		return;
+
+	nkfs_btree_node_modify(node);
+	memmove(&buf->keys[index + 1], &buf->keys[index],
+		nr * sizeof(buf->keys[0]));
+	memmove(&buf->values[index + 1], &buf->values[index],
+		nr * sizeof(buf->values[0]));
+	memmove(&node->prefixes[index + 1], &node->prefixes[index],
+		nr * sizeof(node->prefixes[0]));
+}
+
+/* Free slot at index of children array */
+static void nkfs_btree_node_shift_child(struct nkfs_btree_node *node,
+					int index)
+{
+	struct nkfs_btree_node_buf *buf = node->buf;
+	int nr = node->nr_keys + 1 - index;
+
+	NKFS_BUG_ON(index < 0 || node->nr_keys + 1 >= NKFS_BTREE_CHILDREN_MAX);
+	if (nr <= 0)
+		return;
+
+	nkfs_btree_node_modify(node);
+	memmove(&buf->children[index + 1], &buf->children[index],
+		nr * sizeof(buf->children[0]));
+}
+
 static void nkfs_btree_node_put_child_val(struct nkfs_btree_node *dst,
 					  int dst_index,
 					  u64 val)
 {
-	int i;
-
-	/* free space for dst_index */
-	for (i = dst->nr_keys; i >= dst_index; i--)
-		nkfs_btree_node_copy_child(dst, i + 1, dst, i);
-
+	nkfs_btree_node_shift_child(dst, dst_index);
 	nkfs_btree_node_set_child_val(dst, dst_index, val);
 }
 
@@ -797,12 +1019,7 @@ static void nkfs_btree_node_put_child(struct nkfs_btree_node *dst,
 				      struct nkfs_btree_node *src,
 				      int src_index)
 {
-	int i;
-
-	/* free space for dst_index */
-	for (i = dst->nr_keys; i >= dst_index; i--)
-		nkfs_btree_node_copy_child(dst, i + 1, dst, i);
-
+	nkfs_btree_node_shift_child(dst, dst_index);
 	nkfs_btree_node_copy_child(dst, dst_index, src, src_index);
 }
 
@@ -811,30 +1028,22 @@ static void nkfs_btree_node_put_key_value(struct nkfs_btree_node *dst,
 					  struct nkfs_btree_key *key,
 					  struct nkfs_btree_value *value)
 {
-	int i;
-
-	/* free space for dst_index */
-	for (i = dst->nr_keys - 1; i >= dst_index; i--)
-		nkfs_btree_node_copy_kv(dst, i + 1, dst, i);
-
+	nkfs_btree_node_shift_kv(dst, dst_index);
 	nkfs_btree_node_copy_key_value(dst, dst_index, key, value);
 }
 
 static void nkfs_btree_node_put_kv(struct nkfs_btree_node *dst, int dst_index,
 	struct nkfs_btree_node *src, int src_index)
 {
-	int i;
-
-	/* free space for dst_index */
-	for (i = dst->nr_keys - 1; i >= dst_index; i--)
-		nkfs_btree_node_copy_kv(dst, i + 1, dst, i);
-
+	nkfs_btree_node_shift_kv(dst, dst_index);
 	nkfs_btree_node_copy_kv(dst, dst_index, src, src_index);
 }
 
 static void nkfs_btree_node_zero_kv(struct nkfs_btree_node *dst, int dst_index)
 {
+	nkfs_btree_node_modify(dst);
 	nkfs_btree_zero_key(nkfs_btree_node_key(dst, dst_index));
+	*nkfs_btree_node_prefix(dst, dst_index) = 0;
 	nkfs_btree_zero_value(nkfs_btree_node_value(dst, dst_index));
 }
 
@@ -842,23 +1051,23 @@ static void nkfs_btree_node_split_child(struct nkfs_btree_node *node,
 		struct nkfs_btree_node *child,
 		int child_index, struct nkfs_btree_node *new)
 {
-	int i;
+	struct nkfs_btree_node *nodes[3] = { node, child, new };
 
 	NKFS_BUG_ON(child_index < 0 || child_index > node->nr_keys);
 	NKFS_BUG_ON(!child || !nkfs_btree_node_is_full(child));
 	NKFS_BUG_ON(!new);
 
+	/* Header fields change too, open seq of all nodes first */
+	nkfs_btree_nodes_modify(nodes, ARRAY_SIZE(nodes));
+
 	new->leaf = child->leaf;
 	/* copy T-1 keys from child to new */
-	for (i = 0; i < new->t - 1; i++)
-		nkfs_btree_node_copy_kv(new, i, child, i + new->t);
+	nkfs_btree_node_copy_kvs(new, 0, child, new->t, new->t - 1);
 	new->nr_keys = new->t - 1;
 
 	/* copy T children from child to new */
-	if (!child->leaf) {
-		for (i = 0; i < new->t; i++)
-			nkfs_btree_node_copy_child(new, i, child, i + new->t);
-	}
+	if (!child->leaf)
+		nkfs_btree_node_copy_children(new, 0, child, new->t, new->t);
 
 	/* shift node children to the right by one */
 	child->nr_keys = new->t - 1;
@@ -871,83 +1080,95 @@ static void nkfs_btree_node_split_child(struct nkfs_btree_node *node,
 	node->nr_keys++;
 }
 
-static int nkfs_btree_node_key_probably_inside(struct nkfs_btree_node *node,
-					       struct nkfs_btree_key *key)
+/*
+ * Compare key with key at index of node, key pages are touched only if
+ * prefixes are equal.
+ */
+static int nkfs_btree_node_cmp_key(struct nkfs_btree_node *node, int index,
+				   struct nkfs_btree_key *key, u64 prefix)
 {
-	if (0 == node->nr_keys)
-		return 0;
-	else if ((nkfs_btree_cmp_key(key,
-			nkfs_btree_node_key(node, node->nr_keys-1)) > 0)
-		|| (nkfs_btree_cmp_key(key, nkfs_btree_node_key(node, 0)) < 0))
-		return 0;
-	return 1;
+	u64 node_prefix = *nkfs_btree_node_prefix(node, index);
+
+	if (prefix < node_prefix)
+		return -1;
+	else if (prefix > node_prefix)
+		return 1;
+
+	return nkfs_btree_cmp_key(key, nkfs_btree_node_key(node, index));
 }
 
-static int nkfs_btree_node_has_key(struct nkfs_btree_node *node,
-	struct nkfs_btree_key *key)
+/*
+ * Returns index of first key of node not less than key and sets *pcmp
+ * to result of comparison of key with it, 1 if there is no such key.
+ */
+static int nkfs_btree_node_search(struct nkfs_btree_node *node,
+				  struct nkfs_btree_key *key, int *pcmp)
 {
+	u64 prefix = nkfs_btree_key_prefix(key);
 	u32 start = 0;
-	u32 end = node->nr_keys;
+	/* Lookups search without latch, so count of keys is read once */
+	u32 end = READ_ONCE(node->nr_keys);
 	u32 mid;
 	int cmp;
 
-	if (!nkfs_btree_node_key_probably_inside(node, key))
-		return -1;
+	*pcmp = 1;
+	if (0 == end)
+		return 0;
+
+	/* Appends and prepends are common, check bounds first */
+	cmp = nkfs_btree_node_cmp_key(node, end - 1, key, prefix);
+	if (cmp >= 0) {
+		*pcmp = cmp;
+		return (cmp) ? end : end - 1;
+	}
 
 	while (start < end) {
 		mid = (start + end) / 2;
 
-		cmp = nkfs_btree_cmp_key(key, nkfs_btree_node_key(node, mid));
-
-		if (!cmp)
+		cmp = nkfs_btree_node_cmp_key(node, mid, key, prefix);
+		if (!cmp) {
+			*pcmp = 0;
 			return mid;
-		else if (cmp < 0)
+		} else if (cmp < 0)
 			end = mid;
 		else
 			start = mid + 1;
 	}
 
-	return -1;
+	/* start < nr_keys as key is less than the last key */
+	*pcmp = -1;
+	return start;
 }
 
-static int nkfs_btree_node_find_key_index(struct nkfs_btree_node *node,
+static int nkfs_btree_node_has_key(struct nkfs_btree_node *node,
 	struct nkfs_btree_key *key)
 {
-	u32 start = 0;
-	u32 end = node->nr_keys;
-	u32 mid;
-	int cmp;
+	int index, cmp;
 
-	if (0 == node->nr_keys)
-		return 0;
-	else if (nkfs_btree_cmp_key(key, nkfs_btree_node_key(node, end-1)) > 0)
-		return end;
-	else if (nkfs_btree_cmp_key(key, nkfs_btree_node_key(node, start)) < 0)
-		return 0;
-
-	while (start < end) {
-		mid = (start + end) / 2;
-
-		cmp = nkfs_btree_cmp_key(key, nkfs_btree_node_key(node, mid));
+	index = nkfs_btree_node_search(node, key, &cmp);
+	return (cmp) ? -1 : index;
+}
 
-		if (!cmp)
-			return mid;
-		else if (cmp < 0)
-			end = mid;
-		else
-			start = mid + 1;
-	}
+static int nkfs_btree_node_find_key_index(struct nkfs_btree_node *node,
+	struct nkfs_btree_key *key)
+{
+	int cmp;
 
-	return end;
+	return nkfs_btree_node_search(node, key, &cmp);
 }
 
+/*
+ * Lock coupling: node is write latched by caller and child is latched
+ * before node is released. Full child is split while node is latched,
+ * so node isn't needed once child is known to be not full.
+ */
 static int nkfs_btree_node_insert_nonfull(
 	struct nkfs_btree_node *first,
 	struct nkfs_btree_key *key,
 	struct nkfs_btree_value *value,
-	int replace)
+	int replace, struct nkfs_btree_trans *trans)
 {
-	int i;
+	int i, rc;
 	struct nkfs_btree_node *node = first, *child;
 
 	while (1) {
@@ -955,18 +1176,11 @@ static int nkfs_btree_node_insert_nonfull(
 		i = nkfs_btree_node_has_key(node, key);
 		if (i >= 0) {
 			if (replace) {
-				nkfs_btree_copy_value(
-						nkfs_btree_node_value(node, i),
-						value);
-				nkfs_btree_node_write(node);
-				if (node != first)
-					NKFS_BTREE_NODE_DEREF(node);
-				return 0;
-			}
-
-			if (node != first)
-				NKFS_BTREE_NODE_DEREF(node);
-			return -EEXIST;
+				nkfs_btree_node_set_value(node, i, value);
+				rc = nkfs_btree_node_dirty(node, trans);
+			} else
+				rc = -EEXIST;
+			goto unlock;
 		}
 
 		if (node->leaf) {
@@ -976,156 +1190,398 @@ static int nkfs_btree_node_insert_nonfull(
 			i = nkfs_btree_node_find_key_index(node, key);
 			nkfs_btree_node_put_key_value(node, i, key, value);
 			node->nr_keys++;
-			nkfs_btree_node_write(node);
-			if (node != first)
-				NKFS_BTREE_NODE_DEREF(node);
-			return 0;
+			rc = nkfs_btree_node_dirty(node, trans);
+			goto unlock;
 		}
 
 		i = nkfs_btree_node_find_key_index(node, key);
 		child = nkfs_btree_node_read(node->tree,
 				nkfs_btree_node_get_child_val(node, i));
 		if (!child) {
-			if (node != first)
-				NKFS_BTREE_NODE_DEREF(node);
-			return -EIO;
+			rc = -EIO;
+			goto unlock;
 		}
+		down_write(&child->latch);
 
 		if (nkfs_btree_node_is_full(child)) {
-			struct nkfs_btree_node *new;
+			struct nkfs_btree_node *new, *split[3];
 
+			/* new isn't reachable until node is released */
 			new = nkfs_btree_node_create(node->tree);
 			if (!new) {
-				if (node != first)
-					NKFS_BTREE_NODE_DEREF(node);
+				up_write(&child->latch);
 				NKFS_BTREE_NODE_DEREF(child);
-				return -EIO;
+				rc = -EIO;
+				goto unlock;
 			}
 			nkfs_btree_node_split_child(node, child, i, new);
-			nkfs_btree_node_write(node);
-			nkfs_btree_node_write(child);
-			nkfs_btree_node_write(new);
+			/* Parent is finished last, after nodes it points to */
+			split[0] = new;
+			split[1] = child;
+			split[2] = node;
+			rc = nkfs_btree_nodes_dirty(split, ARRAY_SIZE(split),
+						    trans);
 
 			NKFS_BTREE_NODE_DEREF(new);
+			up_write(&child->latch);
 			NKFS_BTREE_NODE_DEREF(child);
+			if (rc)
+				goto unlock;
 			continue; /* restart */
 		}
 
+		up_write(&node->latch);
 		if (node != first)
 			NKFS_BTREE_NODE_DEREF(node);
 		node = child;
 	}
+
+unlock:
+	up_write(&node->latch);
+	if (node != first)
+		NKFS_BTREE_NODE_DEREF(node);
+	return rc;
 }
 
 static void nkfs_btree_node_copy(struct nkfs_btree_node *dst,
 				 struct nkfs_btree_node *src);
 
+/* Changed nodes are written at once if trans is NULL */
 int nkfs_btree_insert_key(struct nkfs_btree *tree, struct nkfs_btree_key *key,
 	struct nkfs_btree_value *value,
-	int replace)
+	int replace, struct nkfs_btree_trans *trans)
+{
+	struct nkfs_btree_node *root;
+	int rc;
+
+	if (tree->releasing)
+		return -EAGAIN;
+
+	/* Inserts run concurrently, each latching nodes on its path */
+	down_read(&tree->rw_lock);
+	if (tree->releasing) {
+		up_read(&tree->rw_lock);
+		return -EAGAIN;
+	}
+
+	root = tree->root;
+	down_write(&root->latch);
+	if (nkfs_btree_node_is_full(root)) {
+		struct nkfs_btree_node *new2, *clone, *split[3];
+
+		clone = nkfs_btree_node_create(tree);
+		if (clone == NULL) {
+			rc = -ENOMEM;
+			goto unlock_root;
+		}
+
+		new2 = nkfs_btree_node_create(tree);
+		if (new2 == NULL) {
+			nkfs_btree_node_delete(clone);
+			NKFS_BTREE_NODE_DEREF(clone);
+			rc = -ENOMEM;
+			goto unlock_root;
+		}
+
+		/* root block stays, root becomes parent of its clone */
+		nkfs_btree_node_copy(clone, root);
+
+		nkfs_btree_node_modify(root);
+		root->leaf = 0;
+		root->nr_keys = 0;
+		nkfs_btree_node_set_child_val(root, 0, clone->block);
+		nkfs_btree_node_split_child(root, clone, 0, new2);
+
+		split[0] = clone;
+		split[1] = new2;
+		split[2] = root;
+		rc = nkfs_btree_nodes_dirty(split, ARRAY_SIZE(split), trans);
+
+		NKFS_BTREE_NODE_DEREF(clone);
+		NKFS_BTREE_NODE_DEREF(new2);
+		if (rc)
+			goto unlock_root;
+	}
+
+	/* Releases root latch */
+	rc = nkfs_btree_node_insert_nonfull(root, key, value, replace, trans);
+	up_read(&tree->rw_lock);
+	return rc;
+
+unlock_root:
+	up_write(&root->latch);
+	up_read(&tree->rw_lock);
+	return rc;
+}
+
+/*
+ * Seq is odd while inserter holding node latch changes the node. Change
+ * could span allocation of new node, so lookup sleeps on the latch
+ * instead of spinning. Nodes not reachable yet are changed without
+ * latch, but they are finished before parent and it takes no I/O.
+ */
+static unsigned int nkfs_btree_node_read_begin(struct nkfs_btree_node *node)
+{
+	unsigned int seq;
+
+	while ((seq = raw_read_seqcount(&node->seq)) & 1) {
+		down_read(&node->latch);
+		up_read(&node->latch);
+		cpu_relax();
+	}
+
+	return seq;
+}
+
+/*
+ * Lookup doesn't latch nodes. Node is searched within its seq and child
+ * is entered only if node didn't change after seq of child is taken, so
+ * split of child can't be missed. Inserts never free nodes and deletes
+ * are excluded by tree rw_lock, so lookup just restarts from root.
+ */
+static int nkfs_btree_node_find_key(struct nkfs_btree_node *root,
+		struct nkfs_btree_key *key, struct nkfs_btree_value *value)
+{
+	struct nkfs_btree_node *node, *child;
+	unsigned int seq, child_seq;
+	u64 block;
+	int i, cmp;
+
+restart:
+	node = root;
+	NKFS_BTREE_NODE_REF(node);
+	seq = nkfs_btree_node_read_begin(node);
+	while (1) {
+		i = nkfs_btree_node_search(node, key, &cmp);
+		if (!cmp || node->leaf) {
+			if (!cmp)
+				nkfs_btree_node_get_value(node, i, value);
+			if (read_seqcount_retry(&node->seq, seq))
+				goto retry;
+			NKFS_BTREE_NODE_DEREF(node);
+			return (cmp) ? -ENOENT : 0;
+		}
+
+		block = nkfs_btree_node_get_child_val(node, i);
+		if (read_seqcount_retry(&node->seq, seq))
+			goto retry;
+
+		child = nkfs_btree_node_read(node->tree, block);
+		if (!child) {
+			NKFS_BTREE_NODE_DEREF(node);
+			return -EIO;
+		}
+
+		child_seq = nkfs_btree_node_read_begin(child);
+		if (read_seqcount_retry(&node->seq, seq)) {
+			NKFS_BTREE_NODE_DEREF(child);
+			goto retry;
+		}
+		NKFS_BTREE_NODE_DEREF(node);
+		node = child;
+		seq = child_seq;
+	}
+
+retry:
+	NKFS_BTREE_NODE_DEREF(node);
+	goto restart;
+}
+
+int nkfs_btree_find_key(struct nkfs_btree *tree,
+	struct nkfs_btree_key *key,
+	struct nkfs_btree_value *pvalue)
+{
+	int rc;
+
+	if (tree->releasing)
+		return -EAGAIN;
+
+	down_read(&tree->rw_lock);
+	if (tree->releasing) {
+		up_read(&tree->rw_lock);
+		return -EAGAIN;
+	}
+
+	rc = nkfs_btree_node_find_key(tree->root, key, pvalue);
+	up_read(&tree->rw_lock);
+
+	return rc;
+}
+
+static void nkfs_btree_cursor_drop(struct nkfs_btree_cursor *cur)
 {
-	int rc;
+	if (cur->leaf) {
+		NKFS_BTREE_NODE_DEREF(cur->leaf);
+		cur->leaf = NULL;
+	}
+	cur->valid = 0;
+}
 
-	if (tree->releasing)
-		return -EAGAIN;
+/*
+ * All children of parent of leaf are leaves, so start async read of the
+ * leaf following child in direction of walk.
+ */
+static void nkfs_btree_cursor_prefetch(struct nkfs_btree_cursor *cur,
+				       struct nkfs_btree_node *parent,
+				       int child_index, int forward)
+{
+	u64 block;
 
-	down_write(&tree->rw_lock);
-	if (tree->releasing) {
-		up_write(&tree->rw_lock);
-		return -EAGAIN;
-	}
+	child_index += (forward) ? 1 : -1;
+	if (child_index < 0 || child_index > READ_ONCE(parent->nr_keys))
+		return;
 
-	if (nkfs_btree_node_is_full(tree->root)) {
-		struct nkfs_btree_node *new, *new2, *root = tree->root, *clone;
+	block = nkfs_btree_node_get_child_val(parent, child_index);
+	dio_clus_readahead(cur->tree->sb->ddev, &block, 1, DIO_CLASS_META);
+}
+
+/*
+ * Position cursor at the first key not less (dir 0), the first key
+ * greater (dir 1) or the last key less (dir -1) than key. NULL key is
+ * below (dir 0) or above (dir -1) all keys. Nodes are read without
+ * latches like in nkfs_btree_node_find_key(), the entry is copied and
+ * only leaf holding it stays referenced.
+ */
+static int nkfs_btree_cursor_find(struct nkfs_btree_cursor *cur,
+				  struct nkfs_btree_key *key, int dir)
+{
+	struct nkfs_btree_node *node, *child, *found_node;
+	struct nkfs_btree_key found_key;
+	struct nkfs_btree_value found_value;
+	unsigned int seq, child_seq;
+	int i, cmp, nr_keys, index, found_index;
+	u64 block;
 
-		clone = nkfs_btree_node_create(tree);
-		if (clone == NULL) {
-			rc = -ENOMEM;
-			goto out;
+	nkfs_btree_cursor_drop(cur);
+restart:
+	found_node = NULL;
+	found_index = -1;
+	node = cur->tree->root;
+	NKFS_BTREE_NODE_REF(node);
+	seq = nkfs_btree_node_read_begin(node);
+	while (1) {
+		nr_keys = READ_ONCE(node->nr_keys);
+		if (key) {
+			i = nkfs_btree_node_search(node, key, &cmp);
+		} else {
+			i = (dir < 0) ? nr_keys : 0;
+			cmp = 1;
 		}
+		if (i > nr_keys)
+			goto retry;
 
-		new = nkfs_btree_node_alloc(1);
-		if (new == NULL) {
-			nkfs_btree_node_delete(clone);
-			NKFS_BTREE_NODE_DEREF(clone);
-			rc = -ENOMEM;
-			goto out;
+		index = -1;
+		if (!cmp && dir == 0) {
+			index = i;
+		} else {
+			if (!cmp && dir > 0)
+				i++;
+			if (dir >= 0 && i < nr_keys)
+				index = i;
+			else if (dir < 0 && i > 0)
+				index = i - 1;
 		}
-
-		new2 = nkfs_btree_node_create(tree);
-		if (new2 == NULL) {
-			nkfs_btree_node_delete(clone);
-			NKFS_BTREE_NODE_DEREF(clone);
-			__nkfs_btree_node_free(new);
-			rc = -ENOMEM;
-			goto out;
+		/* Deeper candidate is always closer to key */
+		if (index >= 0) {
+			nkfs_btree_copy_key(&found_key,
+				nkfs_btree_node_key(node, index));
+			nkfs_btree_node_get_value(node, index, &found_value);
+			found_node = node;
+			found_index = index;
 		}
 
-		nkfs_btree_node_copy(clone, root);
+		if (node->leaf || (!cmp && dir == 0)) {
+			if (read_seqcount_retry(&node->seq, seq))
+				goto retry;
+			break;
+		}
 
-		new->leaf = 0;
-		new->nr_keys = 0;
-		nkfs_btree_node_set_child_val(new, 0, clone->block);
-		nkfs_btree_node_split_child(new, clone, 0, new2);
+		block = nkfs_btree_node_get_child_val(node, i);
+		if (read_seqcount_retry(&node->seq, seq))
+			goto retry;
 
-		nkfs_btree_node_copy(root, new);
+		child = nkfs_btree_node_read(cur->tree, block);
+		if (!child) {
+			NKFS_BTREE_NODE_DEREF(node);
+			return -EIO;
+		}
 
-		nkfs_btree_node_write(clone);
-		nkfs_btree_node_write(new2);
-		nkfs_btree_node_write(root);
+		child_seq = nkfs_btree_node_read_begin(child);
+		if (read_seqcount_retry(&node->seq, seq)) {
+			NKFS_BTREE_NODE_DEREF(child);
+			goto retry;
+		}
+		if (child->leaf)
+			nkfs_btree_cursor_prefetch(cur, node, i, dir >= 0);
+		NKFS_BTREE_NODE_DEREF(node);
+		node = child;
+		seq = child_seq;
+	}
 
-		NKFS_BTREE_NODE_DEREF(clone);
-		NKFS_BTREE_NODE_DEREF(new2);
-		__nkfs_btree_node_free(new);
+	if (!found_node) {
+		NKFS_BTREE_NODE_DEREF(node);
+		return -ENOENT;
 	}
 
-	rc = nkfs_btree_node_insert_nonfull(tree->root, key, value, replace);
-out:
-	up_write(&tree->rw_lock);
-	return rc;
+	nkfs_btree_copy_key(&cur->key, &found_key);
+	cur->value = found_value;
+	cur->valid = 1;
+	/* Entry of leaf is followed without search, see cursor_step() */
+	if (found_node == node && node->leaf) {
+		cur->leaf = node;
+		cur->leaf_seq = seq;
+		cur->index = found_index;
+	} else
+		NKFS_BTREE_NODE_DEREF(node);
+	return 0;
+
+retry:
+	NKFS_BTREE_NODE_DEREF(node);
+	goto restart;
 }
 
-static
-struct nkfs_btree_node *nkfs_btree_node_find_key(struct nkfs_btree_node *first,
-		struct nkfs_btree_key *key, int *pindex)
+/*
+ * Move to adjacent entry of the same leaf if leaf didn't change since
+ * cursor was positioned. Returns 1 if moved.
+ */
+static int nkfs_btree_cursor_step(struct nkfs_btree_cursor *cur,
+				  int forward)
 {
+	struct nkfs_btree_node *leaf = cur->leaf;
+	struct nkfs_btree_key key;
+	struct nkfs_btree_value value;
+	unsigned int seq;
 	int i;
-	struct nkfs_btree_node *node = first, *prev;
 
-	while (1) {
-		if (node->nr_keys == 0) {
-			if (node != first)
-				NKFS_BTREE_NODE_DEREF(node);
-			return NULL;
-		}
+	if (!leaf)
+		return 0;
 
-		i = nkfs_btree_node_find_key_index(node, key);
-		if (i < node->nr_keys &&
-		    !nkfs_btree_cmp_key(key, nkfs_btree_node_key(node, i))) {
-			*pindex = i;
-			if (node == first)
-				NKFS_BTREE_NODE_REF(node);
-			return node;
-		} else if (node->leaf) {
-			if (node != first)
-				NKFS_BTREE_NODE_DEREF(node);
-			return NULL;
-		}
-		prev = node;
-		node = nkfs_btree_node_read(node->tree,
-				nkfs_btree_node_get_child_val(node, i));
-		NKFS_BUG_ON(!node);
-		if (prev != first)
-			NKFS_BTREE_NODE_DEREF(prev);
-	}
+	i = cur->index + ((forward) ? 1 : -1);
+	seq = nkfs_btree_node_read_begin(leaf);
+	if (seq != cur->leaf_seq || i < 0 || i >= READ_ONCE(leaf->nr_keys))
+		return 0;
+
+	nkfs_btree_copy_key(&key, nkfs_btree_node_key(leaf, i));
+	nkfs_btree_node_get_value(leaf, i, &value);
+	if (read_seqcount_retry(&leaf->seq, seq))
+		return 0;
+
+	nkfs_btree_copy_key(&cur->key, &key);
+	cur->value = value;
+	cur->index = i;
+	return 1;
 }
 
-int nkfs_btree_find_key(struct nkfs_btree *tree,
-	struct nkfs_btree_key *key,
-	struct nkfs_btree_value *pvalue)
+/*
+ * Cursor holds tree read lock until nkfs_btree_cursor_close(), so nodes
+ * aren't deleted meanwhile. Nodes aren't latched, cursor keeps a copy
+ * of the current entry and inserts run concurrently with the walk.
+ */
+int nkfs_btree_cursor_open(struct nkfs_btree_cursor *cur,
+			   struct nkfs_btree *tree)
 {
-	struct nkfs_btree_node *found;
-	int index;
+	memset(cur, 0, sizeof(*cur));
+	cur->tree = tree;
 
 	if (tree->releasing)
 		return -EAGAIN;
@@ -1136,42 +1592,137 @@ int nkfs_btree_find_key(struct nkfs_btree *tree,
 		return -EAGAIN;
 	}
 
-	found = nkfs_btree_node_find_key(tree->root, key, &index);
-	if (found == NULL) {
-		up_read(&tree->rw_lock);
+	return 0;
+}
+
+void nkfs_btree_cursor_close(struct nkfs_btree_cursor *cur)
+{
+	nkfs_btree_cursor_drop(cur);
+	up_read(&cur->tree->rw_lock);
+}
+
+/*
+ * Position cursor at the first key not less than key. Returns -ENOENT
+ * if there is no such key.
+ */
+int nkfs_btree_cursor_seek(struct nkfs_btree_cursor *cur,
+			   struct nkfs_btree_key *key)
+{
+	return nkfs_btree_cursor_find(cur, key, 0);
+}
+
+int nkfs_btree_cursor_first(struct nkfs_btree_cursor *cur)
+{
+	return nkfs_btree_cursor_find(cur, NULL, 0);
+}
+
+int nkfs_btree_cursor_last(struct nkfs_btree_cursor *cur)
+{
+	return nkfs_btree_cursor_find(cur, NULL, -1);
+}
+
+/*
+ * Next entry is taken from the same leaf if it didn't change, otherwise
+ * it is searched by the current key, so changes of tree made meanwhile
+ * are never missed.
+ */
+int nkfs_btree_cursor_next(struct nkfs_btree_cursor *cur)
+{
+	struct nkfs_btree_key key;
+
+	if (!cur->valid)
 		return -ENOENT;
-	}
 
-	nkfs_btree_copy_value(pvalue, nkfs_btree_node_value(found, index));
-	NKFS_BTREE_NODE_DEREF(found);
-	up_read(&tree->rw_lock);
+	if (nkfs_btree_cursor_step(cur, 1))
+		return 0;
+
+	nkfs_btree_copy_key(&key, &cur->key);
+	return nkfs_btree_cursor_find(cur, &key, 1);
+}
+
+int nkfs_btree_cursor_prev(struct nkfs_btree_cursor *cur)
+{
+	struct nkfs_btree_key key;
+
+	if (!cur->valid)
+		return -ENOENT;
+
+	if (nkfs_btree_cursor_step(cur, 0))
+		return 0;
+
+	nkfs_btree_copy_key(&key, &cur->key);
+	return nkfs_btree_cursor_find(cur, &key, -1);
+}
+
+int nkfs_btree_cursor_get(struct nkfs_btree_cursor *cur,
+			  struct nkfs_btree_key *key,
+			  struct nkfs_btree_value *value)
+{
+	if (!cur->valid)
+		return -ENOENT;
 
+	if (key)
+		nkfs_btree_copy_key(key, &cur->key);
+	if (value)
+		*value = cur->value;
 	return 0;
 }
 
+/*
+ * Copy up to max entries starting from current one and move cursor past
+ * them. Returns count of entries, 0 at the end of tree.
+ */
+int nkfs_btree_cursor_fetch(struct nkfs_btree_cursor *cur,
+			    struct nkfs_btree_key *keys,
+			    struct nkfs_btree_value *values, int max)
+{
+	int nr = 0, err;
+
+	while (nr < max && cur->valid) {
+		nkfs_btree_cursor_get(cur, (keys) ? &keys[nr] : NULL,
+				      (values) ? &values[nr] : NULL);
+		nr++;
+		err = nkfs_btree_cursor_next(cur);
+		if (err && err != -ENOENT)
+			return err;
+	}
+
+	return nr;
+}
+
 static void __nkfs_btree_node_delete_child_index(struct nkfs_btree_node *node,
 		int index)
 {
-	int i;
+	struct nkfs_btree_node_buf *buf = node->buf;
+	int nr = node->nr_keys - index;
 
+	NKFS_BUG_ON(index < 0 || index > node->nr_keys);
+	nkfs_btree_node_modify(node);
 	/* do shift to the left by one */
-	for (i = (index + 1); i < node->nr_keys + 1; i++)
-		node->children[i-1] = node->children[i];
+	memmove(&buf->children[index], &buf->children[index + 1],
+		nr * sizeof(buf->children[0]));
 	/* zero last slot */
-	node->children[i-1] = 0;
+	nkfs_btree_node_set_child_val(node, node->nr_keys, 0);
 }
 
 static void __nkfs_btree_node_delete_key_index(struct nkfs_btree_node *node,
 		int index)
 {
-	int i;
+	struct nkfs_btree_node_buf *buf = node->buf;
+	int nr = node->nr_keys - index - 1;
 
 	NKFS_BUG_ON(node->nr_keys < 1);
+	NKFS_BUG_ON(index < 0 || index >= node->nr_keys);
+	nkfs_btree_node_modify(node);
 	/* do shift to the left by one */
-	for (i = (index + 1); i < node->nr_keys; i++)
-		nkfs_btree_node_copy_kv(node, i-1, node, i);
+	memmove(&buf->keys[index], &buf->keys[index + 1],
+		nr * sizeof(buf->keys[0]));
+	memmove(&buf->values[index], &buf->values[index + 1],
+		nr * sizeof(buf->values[0]));
+	memmove(&node->prefixes[index], &node->prefixes[index + 1],
+		nr * sizeof(node->prefixes[0]));
 	/* zero last slot */
-	nkfs_btree_node_zero_kv(node, i-1);
+	nkfs_btree_node_zero_kv(node, node->nr_keys - 1);
 }
 
 static void nkfs_btree_node_leaf_delete_key(struct nkfs_btree_node *node,
@@ -1244,24 +1795,18 @@ nkfs_btree_node_find_right_most(struct nkfs_btree_node *node, int *pindex)
 }
 
 static void nkfs_btree_node_merge(struct nkfs_btree_node *dst,
-	struct nkfs_btree_node *src, struct nkfs_btree_key *key,
-	struct nkfs_btree_value *value)
+	struct nkfs_btree_node *src, struct nkfs_btree_node *parent,
+	int index)
 {
-	int i, pos;
+	int pos;
 
 	/* copy mid key and value */
-	nkfs_btree_copy_key(nkfs_btree_node_key(dst, dst->nr_keys), key);
-	nkfs_btree_copy_value(nkfs_btree_node_value(dst, dst->nr_keys), value);
+	nkfs_btree_node_copy_kv(dst, dst->nr_keys, parent, index);
 
 	pos = dst->nr_keys + 1;
-	for (i = 0; i < src->nr_keys; i++, pos++) {
-		/* copy key-values */
-		nkfs_btree_node_copy_kv(dst, pos, src, i);
-		/* copy children */
-		nkfs_btree_node_copy_child(dst, pos, src, i);
-	}
-	/* copy last child */
-	nkfs_btree_node_copy_child(dst, pos, src, i);
+	/* copy key-values and children with the last one */
+	nkfs_btree_node_copy_kvs(dst, pos, src, 0, src->nr_keys);
+	nkfs_btree_node_copy_children(dst, pos, src, 0, src->nr_keys + 1);
 	/* update keys num */
 	dst->nr_keys = dst->nr_keys + 1 + src->nr_keys;
 }
@@ -1269,13 +1814,8 @@ static void nkfs_btree_node_merge(struct nkfs_btree_node *dst,
 static void nkfs_btree_node_copy(struct nkfs_btree_node *dst,
 				 struct nkfs_btree_node *src)
 {
-	int i;
-
-	for (i = 0; i < src->nr_keys; i++) {
-		nkfs_btree_node_copy_kv(dst, i, src, i);
-		nkfs_btree_node_copy_child(dst, i, src, i);
-	}
-	nkfs_btree_node_copy_child(dst, i, src, i);
+	nkfs_btree_node_copy_kvs(dst, 0, src, 0, src->nr_keys);
+	nkfs_btree_node_copy_children(dst, 0, src, 0, src->nr_keys + 1);
 	dst->nr_keys = src->nr_keys;
 	dst->leaf = src->leaf;
 }
@@ -1334,9 +1874,7 @@ static struct nkfs_btree_node *nkfs_btree_node_child_merge(
 	 */
 
 	if (left) {
-		nkfs_btree_node_merge(sib, child,
-			nkfs_btree_node_key(node, child_index-1),
-			nkfs_btree_node_value(node, child_index-1));
+		nkfs_btree_node_merge(sib, child, node, child_index-1);
 		__nkfs_btree_node_delete_key_index(node, child_index-1);
 		__nkfs_btree_node_delete_child_index(node, child_index);
 		node->nr_keys--;
@@ -1345,9 +1883,7 @@ static struct nkfs_btree_node *nkfs_btree_node_child_merge(
 		nkfs_btree_node_delete(child);
 		merged = sib;
 	} else {
-		nkfs_btree_node_merge(child, sib,
-			nkfs_btree_node_key(node, child_index),
-			nkfs_btree_node_value(node, child_index));
+		nkfs_btree_node_merge(child, sib, node, child_index);
 		__nkfs_btree_node_delete_key_index(node, child_index);
 		__nkfs_btree_node_delete_child_index(node, child_index+1);
 		node->nr_keys--;
@@ -1506,8 +2042,7 @@ restart:
 			int key_index = pre_child->nr_keys;
 
 			nkfs_btree_node_merge(pre_child, suc_child,
-					nkfs_btree_node_key(node, index),
-					nkfs_btree_node_value(node, index));
+					node, index);
 			/* delete key from node */
 			__nkfs_btree_node_delete_key_index(node,
 						index);
@@ -1620,6 +2155,7 @@ static int nkfs_btree_enum_node(struct nkfs_btree_node *first,
 	return 0;
 }
 
+/* Caller excludes inserts by nkfs_btree_write_lock() */
 int nkfs_btree_enum_tree(struct nkfs_btree *tree, nkfs_btree_enum_clb_t clb,
 			 void *ctx)
 {
@@ -1653,10 +2189,11 @@ void nkfs_btree_stats(struct nkfs_btree *tree, struct nkfs_btree_info *info)
 	if (tree->releasing)
 		return;
 
-	down_read(&tree->rw_lock);
+	/* Walks below don't latch nodes, so exclude inserts */
+	down_write(&tree->rw_lock);
 	if (!tree->releasing)
 		nkfs_btree_node_stats(tree->root, info);
-	up_read(&tree->rw_lock);
+	up_write(&tree->rw_lock);
 }
 
 void nkfs_btree_log(struct nkfs_btree *tree, int llevel)
@@ -1664,10 +2201,10 @@ void nkfs_btree_log(struct nkfs_btree *tree, int llevel)
 	if (tree->releasing)
 		return;
 
-	down_read(&tree->rw_lock);
+	down_write(&tree->rw_lock);
 	if (!tree->releasing)
 		nkfs_btree_log_node(tree->root, 1, llevel);
-	up_read(&tree->rw_lock);
+	up_write(&tree->rw_lock);
 }
 
 static void nkfs_btree_erase_node(struct nkfs_btree_node *root,
@@ -1690,10 +2227,12 @@ static void nkfs_btree_erase_node(struct nkfs_btree_node *root,
 			}
 		}
 		if (key_erase_clb) {
+			struct nkfs_btree_value value;
+
 			for (i = 0; i < node->nr_keys; i++) {
+				nkfs_btree_node_get_value(node, i, &value);
 				key_erase_clb(nkfs_btree_node_key(node, i),
-					nkfs_btree_node_value(node, i),
-					ctx);
+					&value, ctx);
 			}
 		}
 	}
@@ -1742,8 +2281,12 @@ static int nkfs_btree_node_check(struct nkfs_btree_node *first, int root)
 			errs++;
 		}
 		prev_key = nkfs_btree_node_key(node, i);
+		if (*nkfs_btree_node_prefix(node, i) !=
+		    nkfs_btree_key_prefix(prev_key)) {
+			errs++;
+		}
 		if (!node->leaf) {
-			if (!node->children[i]) {
+			if (!nkfs_btree_node_get_child_val(node, i)) {
 				errs++;
 			}
 		}
@@ -1751,7 +2294,7 @@ static int nkfs_btree_node_check(struct nkfs_btree_node *first, int root)
 
 	if (!node->leaf) {
 		if (!root || (node->nr_keys > 0)) {
-			if (!node->children[i]) {
+			if (!nkfs_btree_node_get_child_val(node, i)) {
 				errs++;
 			}
 		}
@@ -1779,15 +2322,412 @@ int nkfs_btree_check(struct nkfs_btree *tree)
 	if (tree->releasing)
 		return -EAGAIN;
 
-	down_read(&tree->rw_lock);
+	down_write(&tree->rw_lock);
 	if (!tree->releasing) {
 		rc = nkfs_btree_node_check(tree->root, 1);
 	} else
 		rc = -EAGAIN;
-	up_read(&tree->rw_lock);
+	up_write(&tree->rw_lock);
 	return rc;
 }
 
+/*
+ * Node of loader is complete, queue it for write. Nodes are committed
+ * by NKFS_BTREE_LOAD_BATCH, adjacent blocks are merged by dio.
+ */
+static int nkfs_btree_load_write(struct nkfs_btree_loader *ld,
+				 struct nkfs_btree_node *node)
+{
+	struct dio_cluster *clus[NKFS_BTREE_LOAD_BATCH];
+	int i, err = 0;
+
+	if (node) {
+		nkfs_btree_node_modify(node);
+		nkfs_btree_node_modify_end(node);
+		ld->batch[ld->nr_batch++] = node;
+		if (ld->nr_batch < NKFS_BTREE_LOAD_BATCH)
+			return 0;
+	}
+
+	for (i = 0; i < ld->nr_batch; i++)
+		clus[i] = ld->batch[i]->clu;
+	if (ld->nr_batch)
+		err = dio_clus_commit(clus, ld->nr_batch);
+
+	for (i = 0; i < ld->nr_batch; i++) {
+		if (ld->batch[i] != ld->root)
+			NKFS_BTREE_NODE_DEREF(ld->batch[i]);
+	}
+	ld->nr_batch = 0;
+	return err;
+}
+
+static int nkfs_btree_load_new(struct nkfs_btree_loader *ld, int level)
+{
+	struct nkfs_btree_node *node;
+
+	NKFS_BUG_ON(level >= NKFS_BTREE_MAX_HEIGHT);
+	node = nkfs_btree_node_new(ld->tree);
+	if (!node)
+		return -ENOMEM;
+
+	node->leaf = (level == 0) ? 1 : 0;
+	ld->open[level] = node;
+	if (level >= ld->height)
+		ld->height = level + 1;
+	return 0;
+}
+
+/*
+ * Open node of level is full and becomes pending, previous pending node
+ * can't change anymore and is written.
+ */
+static int nkfs_btree_load_complete(struct nkfs_btree_loader *ld, int level)
+{
+	int err;
+
+	if (ld->pending[level]) {
+		err = nkfs_btree_load_write(ld, ld->pending[level]);
+		ld->pending[level] = NULL;
+		if (err)
+			return err;
+	}
+
+	ld->pending[level] = ld->open[level];
+	ld->open[level] = NULL;
+	return nkfs_btree_load_new(ld, level);
+}
+
+/*
+ * Nodes of every level are filled left to right. Key arriving to full
+ * node goes to the level above as separator, with the full node as its
+ * left child.
+ */
+static int nkfs_btree_load_insert(struct nkfs_btree_loader *ld,
+				  struct nkfs_btree_key *key,
+				  struct nkfs_btree_value *value)
+{
+	struct nkfs_btree_node *node;
+	u64 left = 0;
+	int level, err;
+
+	for (level = 0; ; level++) {
+		if (!ld->open[level]) {
+			err = nkfs_btree_load_new(ld, level);
+			if (err)
+				return err;
+		}
+
+		node = ld->open[level];
+		if (level)
+			nkfs_btree_node_set_child_val(node, node->nr_keys, left);
+
+		if (!nkfs_btree_node_is_full(node)) {
+			nkfs_btree_node_copy_key_value(node, node->nr_keys,
+						       key, value);
+			node->nr_keys++;
+			return 0;
+		}
+
+		left = node->block;
+		err = nkfs_btree_load_complete(ld, level);
+		if (err)
+			return err;
+	}
+}
+
+/*
+ * Right node has less than T-1 keys, its left sibling is full as it
+ * was completed. Share keys of both and separator in parent equally.
+ */
+static void nkfs_btree_load_rebalance(struct nkfs_btree_node *parent,
+				      struct nkfs_btree_node *left,
+				      struct nkfs_btree_node *right)
+{
+	struct nkfs_btree_node_buf *buf = right->buf;
+	int sep = parent->nr_keys - 1;
+	int nr_left = (left->nr_keys + right->nr_keys) / 2;
+	int move = left->nr_keys - nr_left;
+
+	NKFS_BUG_ON(move <= 0 || nr_left < left->t - 1);
+
+	/* free room at the beginning of right */
+	nkfs_btree_node_modify(right);
+	memmove(&buf->keys[move], &buf->keys[0],
+		right->nr_keys * sizeof(buf->keys[0]));
+	memmove(&buf->values[move], &buf->values[0],
+		right->nr_keys * sizeof(buf->values[0]));
+	memmove(&right->prefixes[move], &right->prefixes[0],
+		right->nr_keys * sizeof(right->prefixes[0]));
+	if (!right->leaf)
+		memmove(&buf->children[move], &buf->children[0],
+			(right->nr_keys + 1) * sizeof(buf->children[0]));
+
+	/* rotate keys from left via parent */
+	nkfs_btree_node_copy_kvs(right, 0, left, nr_left + 1, move - 1);
+	nkfs_btree_node_copy_kv(right, move - 1, parent, sep);
+	nkfs_btree_node_copy_kv(parent, sep, left, nr_left);
+	if (!right->leaf)
+		nkfs_btree_node_copy_children(right, 0, left, nr_left + 1,
+					      move);
+
+	left->nr_keys = nr_left;
+	right->nr_keys += move;
+}
+
+/*
+ * Bulk loader builds a new tree from key-values added in strictly
+ * ascending order: nodes are filled up bottom-up and every node is
+ * written once, see nkfs_btree_load_finish().
+ */
+int nkfs_btree_load_start(struct nkfs_btree_loader *ld, struct nkfs_sb *sb)
+{
+	int err;
+
+	memset(ld, 0, sizeof(*ld));
+	ld->tree = nkfs_btree_alloc(sb);
+	if (!ld->tree)
+		return -ENOMEM;
+
+	err = nkfs_btree_load_new(ld, 0);
+	if (err) {
+		nkfs_btree_deref(ld->tree);
+		ld->tree = NULL;
+	}
+	return err;
+}
+
+int nkfs_btree_load_add(struct nkfs_btree_loader *ld,
+			struct nkfs_btree_key *key,
+			struct nkfs_btree_value *value)
+{
+	if (ld->err)
+		return ld->err;
+
+	if (ld->nr_keys && nkfs_btree_cmp_key(key, &ld->last_key) <= 0)
+		return -EINVAL;
+
+	ld->err = nkfs_btree_load_insert(ld, key, value);
+	if (ld->err)
+		return ld->err;
+
+	nkfs_btree_copy_key(&ld->last_key, key);
+	ld->nr_keys++;
+	return 0;
+}
+
+/*
+ * Link the right edge of tree and fix its underfull nodes from the top:
+ * after parent is fixed the separator of node and its left sibling is
+ * the last key of parent. Then write remaining nodes.
+ */
+static int nkfs_btree_load_end(struct nkfs_btree_loader *ld)
+{
+	struct nkfs_btree_node *parent, *node;
+	int level, err = 0, err2;
+
+	for (level = 0; level < ld->height - 1; level++) {
+		parent = ld->open[level + 1];
+		nkfs_btree_node_set_child_val(parent, parent->nr_keys,
+					      ld->open[level]->block);
+	}
+
+	for (level = ld->height - 2; level >= 0; level--) {
+		parent = ld->open[level + 1];
+		node = ld->open[level];
+		if (node->nr_keys < node->t - 1) {
+			NKFS_BUG_ON(!ld->pending[level]);
+			nkfs_btree_load_rebalance(parent, ld->pending[level],
+						  node);
+		}
+	}
+
+	ld->root = ld->open[ld->height - 1];
+	for (level = 0; level < ld->height; level++) {
+		err2 = nkfs_btree_load_write(ld, ld->pending[level]);
+		if (!err)
+			err = err2;
+		ld->pending[level] = NULL;
+		err2 = nkfs_btree_load_write(ld, ld->open[level]);
+		if (!err)
+			err = err2;
+		ld->open[level] = NULL;
+	}
+
+	err2 = nkfs_btree_load_write(ld, NULL);
+	return (err) ? err : err2;
+}
+
+/*
+ * Free nodes of failed load. Their blocks were allocated by
+ * nkfs_btree_node_new() and aren't referenced by anything on disk,
+ * whether the node was written or not, so nkfs_btree_node_delete()
+ * returns them to balloc. Blocks of nodes already written and released
+ * by nkfs_btree_load_write() are lost.
+ */
+static void nkfs_btree_load_drop(struct nkfs_btree_loader *ld)
+{
+	struct nkfs_btree_node *node;
+	int i;
+
+	for (i = 0; i < 2 * NKFS_BTREE_MAX_HEIGHT + ld->nr_batch; i++) {
+		if (i < NKFS_BTREE_MAX_HEIGHT)
+			node = ld->open[i];
+		else if (i < 2 * NKFS_BTREE_MAX_HEIGHT)
+			node = ld->pending[i - NKFS_BTREE_MAX_HEIGHT];
+		else
+			node = ld->batch[i - 2 * NKFS_BTREE_MAX_HEIGHT];
+		if (!node)
+			continue;
+		nkfs_btree_node_delete(node);
+		__nkfs_btree_node_free(node);
+	}
+	memset(ld->open, 0, sizeof(ld->open));
+	memset(ld->pending, 0, sizeof(ld->pending));
+	ld->nr_batch = 0;
+}
+
+/*
+ * Returns tree built by loader or NULL if any add or write failed,
+ * loader can't be used after.
+ */
+struct nkfs_btree *nkfs_btree_load_finish(struct nkfs_btree_loader *ld)
+{
+	struct nkfs_btree *tree = ld->tree;
+	struct nkfs_btree_node *inserted;
+	int err;
+
+	if (ld->err) {
+		err = ld->err;
+		nkfs_btree_load_drop(ld);
+		goto fail;
+	}
+
+	err = nkfs_btree_load_end(ld);
+	if (err) {
+		if (ld->root)
+			__nkfs_btree_node_free(ld->root);
+		goto fail;
+	}
+
+	inserted = nkfs_btree_nodes_insert(tree, ld->root);
+	NKFS_BUG_ON(inserted != ld->root);
+	NKFS_BTREE_NODE_DEREF(inserted);
+	tree->root = ld->root;
+	return tree;
+
+fail:
+	nkfs_error(err, "btree load failed after %llu keys", ld->nr_keys);
+	nkfs_btree_deref(tree);
+	return NULL;
+}
+
+static void nkfs_btree_test_key(u64 val, struct nkfs_btree_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	put_unaligned_be64(val, key->val);
+}
+
+static int nkfs_btree_test_lookup(struct nkfs_btree *tree, int num_keys)
+{
+	struct nkfs_btree_cursor cur;
+	struct nkfs_btree_key key, found_key;
+	struct nkfs_btree_value value;
+	int i, err;
+
+	for (i = 0; i < num_keys; i++) {
+		nkfs_btree_test_key(i, &key);
+		err = nkfs_btree_find_key(tree, &key, &value);
+		if (err)
+			return err;
+		if (nkfs_btree_value_to_u64(&value) != i)
+			return -EINVAL;
+	}
+
+	nkfs_btree_test_key(num_keys, &key);
+	if (nkfs_btree_find_key(tree, &key, &value) != -ENOENT)
+		return -EINVAL;
+
+	err = nkfs_btree_cursor_open(&cur, tree);
+	if (err)
+		return err;
+
+	err = nkfs_btree_cursor_first(&cur);
+	for (i = 0; i < num_keys && !err; i++) {
+		nkfs_btree_test_key(i, &key);
+		nkfs_btree_cursor_get(&cur, &found_key, &value);
+		if (nkfs_btree_cmp_key(&found_key, &key) != 0 ||
+		    nkfs_btree_value_to_u64(&value) != i) {
+			err = -EINVAL;
+			break;
+		}
+		err = nkfs_btree_cursor_next(&cur);
+	}
+
+	if (err == -ENOENT && i == num_keys)
+		err = 0;
+	else if (!err)
+		err = -EINVAL;
+	nkfs_btree_cursor_close(&cur);
+	return err;
+}
+
+/*
+ * Bulk load of keys 0..num_keys-1 in a new tree of sb, then the tree is
+ * checked and every key is looked up by find and by cursor. Blocks of
+ * the tree are freed at the end.
+ */
+int nkfs_btree_load_test(struct nkfs_sb *sb, int num_keys)
+{
+	struct nkfs_btree_loader *ld;
+	struct nkfs_btree *tree;
+	struct nkfs_btree_key key;
+	struct nkfs_btree_value value;
+	int i, err;
+
+	ld = crt_kmalloc(sizeof(*ld), GFP_NOIO);
+	if (!ld)
+		return -ENOMEM;
+
+	err = nkfs_btree_load_start(ld, sb);
+	if (err)
+		goto free_ld;
+
+	for (i = 0; i < num_keys; i++) {
+		nkfs_btree_test_key(i, &key);
+		nkfs_btree_value_by_u64(i, &value);
+		err = nkfs_btree_load_add(ld, &key, &value);
+		if (err)
+			break;
+	}
+
+	tree = nkfs_btree_load_finish(ld);
+	if (!tree) {
+		if (!err)
+			err = -EIO;
+		goto free_ld;
+	}
+
+	if (nkfs_btree_check(tree)) {
+		err = -EINVAL;
+		nkfs_error(err, "btree load test tree check failed");
+		goto erase;
+	}
+
+	err = nkfs_btree_test_lookup(tree, num_keys);
+	if (err)
+		nkfs_error(err, "btree load test lookup failed");
+
+erase:
+	nkfs_btree_erase(tree, NULL, NULL);
+	nkfs_btree_deref(tree);
+free_ld:
+	crt_kfree(ld);
+	nkfs_info("btree load test keys %d err %d", num_keys, err);
+	return err;
+}
+
+/* Inserts latch nodes and run under read lock too */
 void nkfs_btree_read_lock(struct nkfs_btree *tree)
 {
 	down_read(&tree->rw_lock);
@@ -1815,5 +2755,6 @@ int nkfs_btree_init(void)
 
 void nkfs_btree_finit(void)
 {
-	return;
+	/* Cached nodes are freed with their trees */
+	NKFS_BUG_ON(!list_empty(&nkfs_btree_lru));
 }
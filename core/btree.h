@@ -4,12 +4,44 @@
 #include <linux/rbtree.h>
 #include <linux/atomic.h>
 #include <linux/rwsem.h>
+#include <linux/seqlock.h>
 
 #include <include/nkfs_image.h>
 
+#define NKFS_BTREE_KEYS_MAX	(NKFS_BTREE_KEY_PAGES*256)
+#define NKFS_BTREE_CHILDREN_MAX	(NKFS_BTREE_CHILD_PAGES*512)
+#define NKFS_BTREE_VALUES_MAX	(NKFS_BTREE_VALUE_PAGES*512)
+
+/*
+ * View of nkfs_btree_node_disk in dio cluster buffer: header and then
+ * arrays of keys, children and values, each contiguous, so shifts of
+ * entries are single memmove() calls. Entries are in on-disk byte order.
+ */
+struct nkfs_btree_node_buf {
+	struct nkfs_btree_header_page	header;
+	union {
+		struct nkfs_btree_key_page	key_pages[NKFS_BTREE_KEY_PAGES];
+		struct nkfs_btree_key		keys[NKFS_BTREE_KEYS_MAX];
+	};
+	union {
+		struct nkfs_btree_child_page
+				child_pages[NKFS_BTREE_CHILD_PAGES];
+		struct nkfs_btree_child		children[NKFS_BTREE_CHILDREN_MAX];
+	};
+	union {
+		struct nkfs_btree_value_page
+				value_pages[NKFS_BTREE_VALUE_PAGES];
+		struct nkfs_btree_value		values[NKFS_BTREE_VALUES_MAX];
+	};
+};
+
+_Static_assert(sizeof(struct nkfs_btree_node_buf) ==
+	sizeof(struct nkfs_btree_node_disk), "size is not correct");
+
 #pragma pack(push, 1)
 
 struct nkfs_btree;
+struct dio_cluster;
 
 struct nkfs_btree_node {
 	u32			sig1;
@@ -18,18 +50,41 @@ struct nkfs_btree_node {
 	struct nkfs_btree	*tree;
 	atomic_t		ref;
 	struct rb_node		nodes_link;
+	struct list_head	lru;	/* On LRU while unreferenced */
 	u32			leaf;
 	u32			nr_keys;
-	struct page		*header;
-	struct page		*keys[NKFS_BTREE_KEY_PAGES];
-	struct page		*values[NKFS_BTREE_VALUE_PAGES];
-	struct page		*children[NKFS_BTREE_CHILD_PAGES];
+	struct dio_cluster	*clu;	/* Pinned while node exists */
+	struct nkfs_btree_node_buf *buf;	/* Buffer of clu */
+	int			modifying;	/* Between modify and write */
+	/*
+	 * Taken top-down only, parent before child, see
+	 * nkfs_btree_insert_key(). Write latch is held over node change
+	 * and its write.
+	 */
+	struct rw_semaphore	latch;
+	/*
+	 * Odd while node is modified, lookups read nodes without latches
+	 * and retry if it changed, see nkfs_btree_node_find_key(). Writers
+	 * of reachable node hold latch, so readers wait for odd seq on the
+	 * latch and writer may sleep, see nkfs_btree_node_read_begin().
+	 */
+	seqcount_t		seq;
+	/*
+	 * Big-endian first 8 bytes of every key, so integer order of
+	 * prefixes is memcmp() order of keys. Keys of inodes tree are
+	 * random obj ids, so search reads keys only on equal prefixes.
+	 */
+	u64			*prefixes;
 	u32			sig2;
 };
 
 struct nkfs_btree {
 	struct nkfs_btree_node	*root;
 	struct nkfs_sb		*sb;
+	/*
+	 * Shared by lookups and inserts which latch nodes, exclusive for
+	 * deletes and whole tree walks.
+	 */
 	struct rw_semaphore	rw_lock;
 	rwlock_t		nodes_lock;
 	struct rb_root		nodes;
@@ -39,6 +94,69 @@ struct nkfs_btree {
 	u32			sig1;
 };
 
+/* Enough for 2^64 keys with NKFS_BTREE_T */
+#define NKFS_BTREE_MAX_HEIGHT	8
+
+/*
+ * Position in key order, see nkfs_btree_cursor_next(). Holds copy of
+ * the current entry and reference of its leaf, no latches.
+ */
+struct nkfs_btree_cursor {
+	struct nkfs_btree	*tree;
+	struct nkfs_btree_key	key;
+	struct nkfs_btree_value	value;
+	int			valid;
+	struct nkfs_btree_node	*leaf;	/* NULL if entry is in inner node */
+	unsigned int		leaf_seq;
+	int			index;	/* Of entry in leaf */
+};
+
+/* Count of loaded nodes committed together, see nkfs_btree_load_add() */
+#define NKFS_BTREE_LOAD_BATCH	16
+
+/*
+ * Builds new tree from key-values in ascending order. Every level has
+ * open node being filled and pending node, the last full one, which is
+ * kept until finish to rebalance right edge of tree.
+ */
+struct nkfs_btree_loader {
+	struct nkfs_btree	*tree;
+	struct nkfs_btree_node	*open[NKFS_BTREE_MAX_HEIGHT];
+	struct nkfs_btree_node	*pending[NKFS_BTREE_MAX_HEIGHT];
+	struct nkfs_btree_node	*batch[NKFS_BTREE_LOAD_BATCH];
+	struct nkfs_btree_node	*root;
+	int			height;
+	int			nr_batch;
+	struct nkfs_btree_key	last_key;
+	u64			nr_keys;
+	int			err;
+};
+
+/* Max count of nodes held by transaction, then they are written */
+#define NKFS_BTREE_TRANS_NODES	32
+
+/*
+ * Nodes changed by inserts of transaction, written together by
+ * nkfs_btree_trans_commit(). Nodes can belong to different trees of
+ * one device.
+ */
+struct nkfs_btree_trans {
+	struct nkfs_btree_node	*nodes[NKFS_BTREE_TRANS_NODES];
+	int			nr_nodes;
+	int			err;
+};
+
+/* Default budget of in-memory nodes of all trees, each pins a cluster */
+#define NKFS_BTREE_NODES_MAX	1024
+
+/* Node cache of all trees, see nkfs_btree_cache_stats() */
+struct nkfs_btree_cache_stats {
+	u64	nr_nodes;	/* Nodes in memory */
+	u64	nr_cached;	/* Unreferenced nodes on LRU */
+	u64	hits;
+	u64	misses;
+};
+
 struct nkfs_btree_info {
 	u64 nr_keys;
 	u64 nr_nodes;
@@ -54,7 +172,13 @@ void nkfs_btree_ref(struct nkfs_btree *tree);
 void nkfs_btree_deref(struct nkfs_btree *tree);
 
 int nkfs_btree_insert_key(struct nkfs_btree *tree, struct nkfs_btree_key *key,
-	struct nkfs_btree_value *value, int replace);
+	struct nkfs_btree_value *value, int replace,
+	struct nkfs_btree_trans *trans);
+
+void nkfs_btree_cache_stats(struct nkfs_btree_cache_stats *stats);
+
+void nkfs_btree_trans_init(struct nkfs_btree_trans *trans);
+int nkfs_btree_trans_commit(struct nkfs_btree_trans *trans);
 
 int nkfs_btree_find_key(struct nkfs_btree *tree,
 	struct nkfs_btree_key *key,
@@ -65,6 +189,30 @@ int nkfs_btree_delete_key(struct nkfs_btree *tree,
 
 void nkfs_btree_stop(struct nkfs_btree *tree);
 
+int nkfs_btree_cursor_open(struct nkfs_btree_cursor *cur,
+			   struct nkfs_btree *tree);
+void nkfs_btree_cursor_close(struct nkfs_btree_cursor *cur);
+
+int nkfs_btree_cursor_seek(struct nkfs_btree_cursor *cur,
+			   struct nkfs_btree_key *key);
+int nkfs_btree_cursor_first(struct nkfs_btree_cursor *cur);
+int nkfs_btree_cursor_last(struct nkfs_btree_cursor *cur);
+int nkfs_btree_cursor_next(struct nkfs_btree_cursor *cur);
+int nkfs_btree_cursor_prev(struct nkfs_btree_cursor *cur);
+
+int nkfs_btree_cursor_get(struct nkfs_btree_cursor *cur,
+			  struct nkfs_btree_key *key,
+			  struct nkfs_btree_value *value);
+int nkfs_btree_cursor_fetch(struct nkfs_btree_cursor *cur,
+			    struct nkfs_btree_key *keys,
+			    struct nkfs_btree_value *values, int max);
+
+int nkfs_btree_load_start(struct nkfs_btree_loader *ld, struct nkfs_sb *sb);
+int nkfs_btree_load_add(struct nkfs_btree_loader *ld,
+			struct nkfs_btree_key *key,
+			struct nkfs_btree_value *value);
+struct nkfs_btree *nkfs_btree_load_finish(struct nkfs_btree_loader *ld);
+
 void nkfs_btree_read_lock(struct nkfs_btree *tree);
 void nkfs_btree_read_unlock(struct nkfs_btree *tree);
 
@@ -82,8 +230,10 @@ void nkfs_btree_erase(struct nkfs_btree *tree,
 void nkfs_btree_value_by_u64(u64 val, struct nkfs_btree_value *value);
 u64 nkfs_btree_value_to_u64(struct nkfs_btree_value *value);
 
-void nkfs_btree_key_by_u64(u64 val, struct nkfs_btree_key *key);
-u64 nkfs_btree_key_to_u64(struct nkfs_btree_key *key);
+int nkfs_btree_u64_keys_ordered(struct nkfs_btree *tree);
+void nkfs_btree_key_by_u64(struct nkfs_btree *tree, u64 val,
+			   struct nkfs_btree_key *key);
+u64 nkfs_btree_key_to_u64(struct nkfs_btree *tree, struct nkfs_btree_key *key);
 
 char *nkfs_btree_key_hex(struct nkfs_btree_key *key);
 char *nkfs_btree_value_hex(struct nkfs_btree_value *value);
@@ -98,8 +248,6 @@ int nkfs_btree_node_delete_key(struct nkfs_btree_node *first,
 
 struct nkfs_btree_key *nkfs_btree_node_key(struct nkfs_btree_node *node,
 					   int index);
-struct nkfs_btree_value *nkfs_btree_node_value(struct nkfs_btree_node *node,
-					       int index);
 
 void nkfs_btree_log(struct nkfs_btree *tree, int llevel);
 
@@ -109,6 +257,8 @@ int nkfs_btree_check(struct nkfs_btree *tree);
 
 int nkfs_btree_test(int num_keys);
 
+int nkfs_btree_load_test(struct nkfs_sb *sb, int num_keys);
+
 int nkfs_btree_init(void);
 void nkfs_btree_finit(void);
 
@@ -85,6 +85,7 @@ struct nkfs_dev *nkfs_dev_lookup(char *dev_name)
 
 int nkfs_dev_query(char *dev_name, struct nkfs_dev_info *info)
 {
+	struct nkfs_btree_cache_stats btree_stats;
 	struct nkfs_dev *dev;
 	struct nkfs_sb *sb;
 
@@ -115,6 +116,21 @@ int nkfs_dev_query(char *dev_name, struct nkfs_dev_info *info)
 		info->minor = MINOR(dev->bdev->bd_dev);
 	}
 
+	if (dev->ddev) {
+		struct dio_dev_stats stats;
+
+		dio_dev_stats(dev->ddev, &stats);
+		info->cache_clus = stats.nr_clus;
+		info->cache_size = stats.buf_bytes;
+		info->cache_desc_size = stats.desc_bytes;
+	}
+
+	nkfs_btree_cache_stats(&btree_stats);
+	info->btree_nodes = btree_stats.nr_nodes;
+	info->btree_cached_nodes = btree_stats.nr_cached;
+	info->btree_node_hits = btree_stats.hits;
+	info->btree_node_misses = btree_stats.misses;
+
 	nkfs_dev_deref(dev);
 	return 0;
 }
@@ -136,7 +152,7 @@ static struct nkfs_dev *nkfs_dev_lookup_unlink(char *dev_name)
 	return NULL;
 }
 
-struct nkfs_dev *nkfs_dev_create(char *dev_name, int fmode)
+struct nkfs_dev *nkfs_dev_create(char *dev_name, int fmode, int poll)
 {
 	struct nkfs_dev *dev;
 	int len;
@@ -169,7 +185,7 @@ struct nkfs_dev *nkfs_dev_create(char *dev_name, int fmode)
 	dev->fmode = fmode;
 	dev->bsize = NKFS_BLOCK_SIZE;
 
-	dev->ddev = dio_dev_create(dev->bdev, dev->bsize, 64);
+	dev->ddev = dio_dev_create(dev->bdev, dev->bsize, poll);
 	if (!dev->ddev) {
 		blkdev_put(dev->bdev, dev->fmode);
 		dev->bdev = NULL;
@@ -211,12 +227,13 @@ static void nkfs_dev_stop(struct nkfs_dev *dev)
 	nkfs_sb_stop(dev->sb);
 }
 
-int nkfs_dev_add(char *dev_name, int format)
+int nkfs_dev_add(char *dev_name, int format, int poll)
 {
 	int err;
 	struct nkfs_dev *dev;
 
-	dev = nkfs_dev_create(dev_name, FMODE_READ|FMODE_WRITE|FMODE_EXCL);
+	dev = nkfs_dev_create(dev_name, FMODE_READ|FMODE_WRITE|FMODE_EXCL,
+			      poll);
 	if (!dev)
 		return -ENOMEM;
 
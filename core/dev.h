@@ -17,10 +17,10 @@ struct nkfs_dev {
 	char			dev_name[NKFS_NAME_MAX_SZ];
 };
 
-int nkfs_dev_add(char *dev_name, int format);
+int nkfs_dev_add(char *dev_name, int format, int poll);
 int nkfs_dev_remove(char *dev_name);
 int nkfs_dev_query(char *dev_name, struct nkfs_dev_info *info);
-struct nkfs_dev *nkfs_dev_create(char *dev_name, int fmode);
+struct nkfs_dev *nkfs_dev_create(char *dev_name, int fmode, int poll);
 
 void nkfs_dev_ref(struct nkfs_dev *dev);
 void nkfs_dev_deref(struct nkfs_dev *dev);
@@ -5,103 +5,289 @@
 #include <crt/include/crt.h>
 #include <linux/mm.h>
 #include <linux/bio.h>
+#include <linux/blkdev.h>
 #include <linux/sort.h>
+#include <linux/hash.h>
+#include <linux/module.h>
+#include <linux/shrinker.h>
+#include <linux/swap.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/llist.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
 
 static DEFINE_MUTEX(dio_dev_list_lock);
 static LIST_HEAD(dio_dev_list);
-
-#define DIO_TIMER_TIMEOUT_MSECS 1000
-
-static struct timer_list dio_timer;
-static struct workqueue_struct *dio_wq;
+static unsigned long dio_nr_devs;
+
+static unsigned long dio_cache_max_mb;
+module_param(dio_cache_max_mb, ulong, 0444);
+MODULE_PARM_DESC(dio_cache_max_mb,
+	"Hard cap of cluster cache size for all devices in MB "
+	"(0 - " __stringify(DIO_CACHE_RAM_PERCENT) "% of RAM)");
+
+static unsigned long dio_cache_min_mb = DIO_CACHE_MIN_MB;
+module_param(dio_cache_min_mb, ulong, 0444);
+MODULE_PARM_DESC(dio_cache_min_mb,
+	"Cluster cache size per device in MB kept under memory pressure");
+
+static bool dio_writeback;
+module_param(dio_writeback, bool, 0444);
+MODULE_PARM_DESC(dio_writeback,
+	"Leave dirty clusters to background flusher instead of writing "
+	"them at once");
+
+static unsigned int dio_dirty_ratio = DIO_DIRTY_RATIO;
+module_param(dio_dirty_ratio, uint, 0644);
+MODULE_PARM_DESC(dio_dirty_ratio,
+	"Percent of device cache that could be dirty before flusher "
+	"writes all of it");
+
+static unsigned int dio_dirty_expire_ms = DIO_DIRTY_EXPIRE_MS;
+module_param(dio_dirty_expire_ms, uint, 0644);
+MODULE_PARM_DESC(dio_dirty_expire_ms,
+	"Age of dirty cluster in ms after which flusher writes it");
+
+static unsigned int dio_flush_interval_ms = DIO_FLUSH_INTERVAL_MS;
+module_param(dio_flush_interval_ms, uint, 0644);
+MODULE_PARM_DESC(dio_flush_interval_ms, "Flusher wakeup period in ms");
+
+static unsigned int dio_commit_batch_us;
+module_param(dio_commit_batch_us, uint, 0644);
+MODULE_PARM_DESC(dio_commit_batch_us,
+	"Time in us group commit leader waits for more sync requests");
+
+static unsigned int dio_meta_percent = DIO_META_PERCENT;
+module_param(dio_meta_percent, uint, 0444);
+MODULE_PARM_DESC(dio_meta_percent,
+	"Percent of device cache reserved for metadata clusters");
+
+static LLIST_HEAD(dio_clus_free_list);
+static void dio_clus_free_work_func(struct work_struct *work);
+static void dio_clus_free_wait(void);
+static int dio_dev_flusher_routine(void *data);
+static void dio_dev_wait_ios(struct dio_dev *dev);
+static int dio_clu_write_back(struct dio_cluster *cluster);
+static DECLARE_WORK(dio_clus_free_work, dio_clus_free_work_func);
 
 static void dio_clu_ref(struct dio_cluster *cluster);
+static int dio_clu_tryref(struct dio_cluster *cluster);
 static void dio_clu_deref(struct dio_cluster *cluster);
 
-static void dio_pages_zero(struct dio_pages *pages)
+/*
+ * Digest cache of data cluster, allocated on first use, so metadata
+ * clusters don't pay for it. Protected by lock.
+ */
+struct dio_clu_sum {
+	spinlock_t		lock;
+	unsigned long		gen;		/* Bumped on every change */
+	unsigned long		sum_gen;	/* gen of cached sum */
+	struct csum		sum;
+	/* Running digest of [0, pos) fed by sequential writes */
+	struct csum_ctx		ctx;
+	unsigned long		pos;
+};
+
+#define DIO_CLU_SUM_INV	(~0UL)
+
+static struct kmem_cache *dio_clu_cachep;
+static struct kmem_cache *dio_sum_cachep;
+
+static unsigned long dio_clu_size(struct dio_cluster *cluster)
 {
-	memset(pages, 0, sizeof(*pages));
+	return cluster->dev->clu_size;
 }
 
-static void dio_pages_sum(struct dio_pages *pages, struct csum *sum)
+static int dio_clu_nr_pages(struct dio_cluster *cluster)
 {
-	struct csum_ctx ctx;
-	int i;
+	return cluster->dev->clu_size >> PAGE_SHIFT;
+}
+
+/*
+ * Page of cluster buffer for bio, the page array isn't stored.
+ */
+static struct page *dio_clu_page(struct dio_cluster *cluster, int i)
+{
+	char *addr = cluster->buf + i * PAGE_SIZE;
+
+	if (test_bit(DIO_CLU_VMAP, &cluster->flags))
+		return vmalloc_to_page(addr);
+
+	return virt_to_page(addr);
+}
+
+/*
+ * Digest cache of data cluster is kept in private of the first buffer
+ * page, it describes buffer contents and goes away with the buffer.
+ */
+static unsigned long *dio_clu_sum_slot(struct dio_cluster *cluster)
+{
+	return &dio_clu_page(cluster, 0)->private;
+}
+
+static struct dio_clu_sum *dio_clu_sum_peek(struct dio_cluster *cluster)
+{
+	return (struct dio_clu_sum *)READ_ONCE(*dio_clu_sum_slot(cluster));
+}
 
-	csum_reset(&ctx);
+static void dio_clu_sum_free(struct dio_cluster *cluster)
+{
+	struct dio_clu_sum *sum = dio_clu_sum_peek(cluster);
+
+	if (!sum)
+		return;
+
+	*dio_clu_sum_slot(cluster) = 0;
+	kmem_cache_free(dio_sum_cachep, sum);
+	atomic_long_dec(&cluster->dev->nr_sums);
+}
+
+/*
+ * Time of cluster is 32 bit, intervals measured by it are far below
+ * the wrap of jiffies.
+ */
+static u32 dio_clu_age(struct dio_cluster *cluster)
+{
+	return (u32)jiffies - cluster->time;
+}
+
+/*
+ * Feed bytes [start, end) of cluster buffer to the hasher. Bytes that
+ * fall into [buf_start, buf_end) are copied to buf in the same pass.
+ */
+static void dio_buf_hash(char *cbuf, struct csum_ctx *ctx,
+		unsigned long start, unsigned long end,
+		void *buf, unsigned long buf_start, unsigned long buf_end)
+{
+	unsigned long copy_start, copy_end;
 
-	for (i = 0; i < pages->nr_pages; i++)
-		csum_update(&ctx, page_address(pages->pages[i]), PAGE_SIZE);
+	copy_start = clamp(buf_start, start, end);
+	copy_end = clamp(buf_end, copy_start, end);
 
-	csum_digest(&ctx, sum);
+	csum_update(ctx, cbuf + start, copy_start - start);
+	if (copy_end > copy_start)
+		csum_copy_update(ctx, (char *)buf + (copy_start - buf_start),
+				 cbuf + copy_start,
+				 copy_end - copy_start);
+	csum_update(ctx, cbuf + copy_end, end - copy_end);
 }
 
+/*
+ * Copy between buf and cluster buffer, if ctx is set data is also
+ * hashed on the way.
+ */
 static void
-dio_pages_io(struct dio_pages *pages, void *buf,
-		unsigned long off, unsigned long len, int write)
-{
-	unsigned long read = 0, step;
-	unsigned long pg_off;
-	unsigned long pg_idx;
-
-	NKFS_BUG_ON((off + len) > (pages->nr_pages*PAGE_SIZE));
-
-	pg_idx = off >> PAGE_SHIFT;
-	pg_off = off & (PAGE_SIZE - 1);
-	while (read < len) {
-		NKFS_BUG_ON(pg_idx >= pages->nr_pages);
-		step = len - read;
-		if (step > (PAGE_SIZE - pg_off))
-			step = PAGE_SIZE - pg_off;
-
-		if (!write)
-			memcpy(
-			(char *)buf + read,
-			(char *)page_address(pages->pages[pg_idx]) + pg_off,
-			step);
+dio_buf_io(char *cbuf, void *buf,
+		unsigned long off, unsigned long len, int write,
+		struct csum_ctx *ctx)
+{
+	if (!write) {
+		if (ctx)
+			csum_copy_update(ctx, buf, cbuf + off, len);
 		else
-			memcpy(
-			(char *)page_address(pages->pages[pg_idx]) + pg_off,
-			(char *)buf + read,
-			step);
-
-		read += step;
-		pg_off = 0;
-		pg_idx += 1;
+			memcpy(buf, cbuf + off, len);
+	} else {
+		if (ctx)
+			csum_copy_update(ctx, cbuf + off, buf, len);
+		else
+			memcpy(cbuf + off, buf, len);
 	}
 }
 
-static int dio_pages_alloc(struct dio_pages *buf, int nr_pages)
+static void dio_pages_put(struct page **pages, int nr_pages)
+{
+	int i;
+
+	for (i = 0; i < nr_pages; i++)
+		crt_free_page(pages[i]);
+}
+
+/*
+ * Cluster buffer is a single virtually contiguous area. In order of
+ * preference it is:
+ * 1) physically contiguous high order block, bio segments of such
+ *    cluster are merged by block layer;
+ * 2) order-0 pages mapped by vmap() when memory is fragmented, then
+ *    DIO_CLU_VMAP is set;
+ * 3) high order block from dev->clu_pool reserve, mempool_alloc()
+ *    waits for a returned buffer instead of failing.
+ */
+static int dio_buf_alloc(struct dio_dev *dev, struct dio_cluster *cluster,
+			 int node)
 {
+	struct page *pages[DIO_CLU_MAX_PAGES];
+	int nr_pages = dev->clu_size >> PAGE_SHIFT;
+	struct page *page;
+	unsigned int noio_flags;
 	int i;
 
-	memset(buf, 0, sizeof(*buf));
-	if (nr_pages <= 0 || nr_pages > ARRAY_SIZE(buf->pages))
+	if (nr_pages <= 0 || nr_pages > ARRAY_SIZE(pages))
 		return -EINVAL;
 
-	for (i = 0; i < nr_pages; i++) {
-		buf->pages[i] = crt_alloc_page(GFP_KERNEL);
-		if (!buf->pages[i]) {
-			int j;
+	page = alloc_pages_node(node,
+				GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN,
+				dev->clu_order);
+	if (page)
+		goto contig;
 
-			for (j = 0; j < i; j++)
-				crt_free_page(buf->pages[j]);
-			dio_pages_zero(buf);
-			return -ENOMEM;
+	for (i = 0; i < nr_pages; i++) {
+		pages[i] = crt_alloc_page_node(GFP_NOIO | __GFP_NOWARN, node);
+		if (!pages[i]) {
+			dio_pages_put(pages, i);
+			goto pool;
 		}
 	}
-	buf->nr_pages = nr_pages;
+
+	noio_flags = memalloc_noio_save();
+	cluster->buf = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	memalloc_noio_restore(noio_flags);
+	if (!cluster->buf) {
+		dio_pages_put(pages, nr_pages);
+		goto pool;
+	}
+	set_bit(DIO_CLU_VMAP, &cluster->flags);
+	set_page_private(pages[0], 0);
+	return 0;
+
+pool:
+	page = mempool_alloc(dev->clu_pool, GFP_NOIO);
+contig:
+	cluster->buf = page_address(page);
+	set_page_private(page, 0);
 	return 0;
 }
 
-static void dio_pages_free(struct dio_pages *buf)
+/*
+ * Could be called from softirq (RCU callback), vmapped buffers
+ * are freed by dio_buf_free_vmapped().
+ */
+static void dio_buf_free(struct dio_cluster *cluster)
 {
-	int i;
+	NKFS_BUG_ON(test_bit(DIO_CLU_VMAP, &cluster->flags));
+
+	if (cluster->buf) {
+		dio_clu_sum_free(cluster);
+		mempool_free(virt_to_page(cluster->buf),
+			     cluster->dev->clu_pool);
+	}
+	cluster->buf = NULL;
+}
+
+static void dio_buf_free_vmapped(struct dio_cluster *cluster)
+{
+	struct page *pages[DIO_CLU_MAX_PAGES];
+	int i, nr_pages = dio_clu_nr_pages(cluster);
 
-	for (i = 0; i < buf->nr_pages; i++)
-		crt_free_page(buf->pages[i]);
+	NKFS_BUG_ON(!test_bit(DIO_CLU_VMAP, &cluster->flags));
 
-	dio_pages_zero(buf);
+	dio_clu_sum_free(cluster);
+	for (i = 0; i < nr_pages; i++)
+		pages[i] = dio_clu_page(cluster, i);
+	vunmap(cluster->buf);
+	dio_pages_put(pages, nr_pages);
+	cluster->buf = NULL;
 }
 
 static int dio_clu_pinned(struct dio_cluster *cluster)
@@ -119,111 +305,629 @@ static void dio_clu_unpin(struct dio_cluster *cluster)
 	atomic_dec(&cluster->pin_count);
 }
 
+/*
+ * Cluster with bio in flight (readahead or writeback) must stay
+ * in the tree, otherwise a new lookup would read stale data.
+ */
+static int dio_clu_io_busy(struct dio_cluster *cluster)
+{
+	if (test_bit(DIO_CLU_WB, &cluster->flags))
+		return 1;
+	if (test_bit(DIO_CLU_READ_START, &cluster->flags) &&
+	    test_bit(DIO_CLU_READING, &cluster->flags))
+		return 1;
+	return 0;
+}
+
+static unsigned long dio_mb_to_clus(unsigned long mb, unsigned long clu_size)
+{
+	return (mb << 20) / clu_size;
+}
+
+static unsigned long dio_dev_min_clus(struct dio_dev *dev)
+{
+	return max_t(unsigned long,
+		     dio_mb_to_clus(dio_cache_min_mb, dev->clu_size),
+		     DIO_DEV_MIN_CLUS);
+}
+
+static void dio_pool_set_max_clus(struct dio_pool *pool,
+				  unsigned long nr_max_clus)
+{
+	pool->nr_max_clus = max_t(unsigned long, nr_max_clus,
+				  DIO_DEV_MIN_CLUS);
+	pool->cold_target = clamp_t(unsigned long, pool->cold_target,
+				    max_t(unsigned long,
+					  pool->nr_max_clus / 16, 1),
+				    max_t(unsigned long,
+					  pool->nr_max_clus / 2, 1));
+}
+
+/*
+ * Metadata pool gets dio_meta_percent of device budget, data pool
+ * the rest. Pools are reclaimed independently, so bulk data never
+ * pushes metadata out.
+ */
+static void dio_dev_set_max_clus(struct dio_dev *dev,
+				 unsigned long nr_max_clus)
+{
+	unsigned long nr_meta;
+
+	spin_lock(&dev->clock_lock);
+	dev->nr_max_clus = max(nr_max_clus, dio_dev_min_clus(dev));
+	nr_meta = dev->nr_max_clus *
+		  min_t(unsigned int, dio_meta_percent, 100) / 100;
+	dio_pool_set_max_clus(&dev->pools[DIO_CLASS_META], nr_meta);
+	dio_pool_set_max_clus(&dev->pools[DIO_CLASS_DATA],
+			      dev->nr_max_clus - nr_meta);
+	spin_unlock(&dev->clock_lock);
+}
+
+/*
+ * Split cache budget equally between devices. Budget is either
+ * dio_cache_max_mb or DIO_CACHE_RAM_PERCENT of RAM, under memory
+ * pressure the shrinker takes clean clusters back down to
+ * dio_cache_min_mb per device.
+ */
+static void dio_devs_resize(void)
+{
+	struct dio_dev *dev;
+	unsigned long max_bytes;
+
+	if (dio_cache_max_mb)
+		max_bytes = dio_cache_max_mb << 20;
+	else
+		max_bytes = (totalram_pages / 100) * DIO_CACHE_RAM_PERCENT *
+			    PAGE_SIZE;
+
+	list_for_each_entry(dev, &dio_dev_list, list) {
+		dio_dev_set_max_clus(dev,
+			(max_bytes / dio_nr_devs) / dev->clu_size);
+	}
+}
+
+static void dio_pool_init(struct dio_pool *pool)
+{
+	int i;
+
+	INIT_LIST_HEAD(&pool->clock_cold);
+	INIT_LIST_HEAD(&pool->clock_hot);
+	INIT_LIST_HEAD(&pool->ghost_list);
+	for (i = 0; i < ARRAY_SIZE(pool->ghost_hash); i++)
+		INIT_HLIST_HEAD(&pool->ghost_hash[i]);
+	pool->nr_max_clus = DIO_DEV_MIN_CLUS;
+	pool->cold_target = max_t(unsigned long, pool->nr_max_clus / 4, 1);
+}
+
 static void dio_dev_init(struct dio_dev *dev,
-	struct block_device *bdev, unsigned long clu_size,
-	unsigned long nr_max_clus)
+	struct block_device *bdev, unsigned long clu_size)
 {
+	mempool_t *clu_pool = dev->clu_pool;
+	unsigned int clu_order = dev->clu_order;
+	int class, i;
+
 	memset(dev, 0, sizeof(*dev));
+	dev->clu_pool = clu_pool;
+	dev->clu_order = clu_order;
 	atomic_set(&dev->ref, 1);
-	spin_lock_init(&dev->clus_lock);
-	init_rwsem(&dev->age_rw_lock);
+	for (i = 0; i < DIO_NR_SHARDS; i++) {
+		spin_lock_init(&dev->shards[i].lock);
+		INIT_RADIX_TREE(&dev->shards[i].root, GFP_NOIO);
+	}
 
-	INIT_RADIX_TREE(&dev->clus_root, GFP_NOIO);
+	spin_lock_init(&dev->clock_lock);
+	for (class = 0; class < DIO_NR_CLASSES; class++)
+		dio_pool_init(&dev->pools[class]);
+	atomic_long_set(&dev->nr_sums, 0);
+	atomic_long_set(&dev->nr_dirty, 0);
+	init_waitqueue_head(&dev->flush_wait);
+	spin_lock_init(&dev->commit_lock);
+	spin_lock_init(&dev->io_lock);
+	init_waitqueue_head(&dev->io_wait);
+	INIT_LIST_HEAD(&dev->commit_list);
 
 	dev->nr_clus = 0;
-	dev->nr_max_clus = nr_max_clus;
 	dev->clu_size = clu_size;
+	dio_dev_set_max_clus(dev, dio_dev_min_clus(dev));
 	dev->bdev = bdev;
+	dev->node = bdev_get_queue(bdev)->node;
 
 	mutex_lock(&dio_dev_list_lock);
 	list_add_tail(&dev->list, &dio_dev_list);
+	dio_nr_devs++;
+	dio_devs_resize();
 	mutex_unlock(&dio_dev_list_lock);
 }
 
-struct dio_dev *dio_dev_create(struct block_device *bdev,
-	int clu_size, int nr_max_clus)
+static int dio_queue_pollable(struct request_queue *q)
+{
+#if DIO_BLK_POLL
+	return test_bit(QUEUE_FLAG_POLL, &q->queue_flags);
+#else
+	return 0;
+#endif
+}
+
+struct dio_dev *dio_dev_create(struct block_device *bdev, int clu_size,
+			      int poll)
 {
 	struct dio_dev *dev;
+	u64 nr_clus;
 
 	if (clu_size & (PAGE_SIZE - 1))
 		return NULL;
-	if (nr_max_clus == 0)
-		return NULL;
 	if (clu_size > (DIO_CLU_MAX_PAGES*PAGE_SIZE))
 		return NULL;
 
+	nr_clus = i_size_read(bdev->bd_inode);
+	do_div(nr_clus, clu_size);
+	if (nr_clus > (u64)DIO_CLU_MAX_INDEX + 1) {
+		nkfs_error(-EFBIG, "dev has %llu clusters, max %llu",
+			   nr_clus, (u64)DIO_CLU_MAX_INDEX + 1);
+		return NULL;
+	}
+
 	dev = crt_kmalloc(sizeof(*dev), GFP_NOIO);
 	if (!dev)
 		return NULL;
 
-	dio_dev_init(dev, bdev, clu_size, nr_max_clus);
+	dev->clu_order = get_order(clu_size);
+	dev->clu_pool = mempool_create_page_pool(DIO_CLU_POOL_MIN,
+						 dev->clu_order);
+	if (!dev->clu_pool) {
+		crt_kfree(dev);
+		return NULL;
+	}
+
+	dio_dev_init(dev, bdev, clu_size);
+
+	if (poll && !dio_queue_pollable(bdev_get_queue(bdev))) {
+		nkfs_info("dev 0x%p queue can't poll, using interrupts", dev);
+		poll = 0;
+	}
+	dev->poll = poll;
+
+	if (dio_writeback) {
+		dev->flusher = kthread_create(dio_dev_flusher_routine, dev,
+					      "nkfs_dio_flush");
+		if (IS_ERR(dev->flusher)) {
+			nkfs_error(PTR_ERR(dev->flusher),
+				   "Can't create flusher");
+			dev->flusher = NULL;
+			dio_dev_deref(dev);
+			return NULL;
+		}
+		wake_up_process(dev->flusher);
+	}
 
 	return dev;
 }
 
-static struct dio_cluster *dio_clu_alloc(struct dio_dev *dev)
+/*
+ * Metadata clusters are shared by all CPUs and live on the node of
+ * device controller, data clusters are placed on the node of the
+ * requesting CPU which copies them to or from network buffers.
+ */
+static int dio_clu_node(struct dio_dev *dev, int class)
+{
+	return (class == DIO_CLASS_META) ? dev->node : NUMA_NO_NODE;
+}
+
+static struct dio_cluster *dio_clu_alloc(struct dio_dev *dev, int class)
 {
 	struct dio_cluster *cluster;
-	u32 nr_pages;
+	int node = dio_clu_node(dev, class);
 	int err;
 
 	NKFS_BUG_ON(dev->clu_size & (PAGE_SIZE - 1));
 	NKFS_BUG_ON(dev->clu_size < PAGE_SIZE);
 	NKFS_BUG_ON(dev->clu_size > (DIO_CLU_MAX_PAGES * PAGE_SIZE));
 
-	nr_pages = dev->clu_size >> PAGE_SHIFT;
-	cluster = crt_kmalloc(sizeof(*cluster), GFP_NOIO);
+	cluster = kmem_cache_alloc_node(dio_clu_cachep, GFP_NOIO, node);
 	if (!cluster)
 		return NULL;
 
 	memset(cluster, 0, sizeof(*cluster));
-	init_rwsem(&cluster->sync_rw_lock);
-	init_rwsem(&cluster->rw_lock);
+	INIT_LIST_HEAD(&cluster->clock_list);
 
 	set_bit(DIO_CLU_INV, &cluster->flags);
-	err = dio_pages_alloc(&cluster->pages, nr_pages);
+	set_bit(DIO_CLU_READING, &cluster->flags);
+	cluster->dev = dev;
+	err = dio_buf_alloc(dev, cluster, node);
 	if (err) {
-		crt_kfree(cluster);
+		kmem_cache_free(dio_clu_cachep, cluster);
 		return NULL;
 	}
 
 	atomic_set(&cluster->pin_count, 0);
 	atomic_set(&cluster->ref, 1);
-	init_completion(&cluster->read_comp);
-	cluster->dev = dev;
-	cluster->clu_size = dev->clu_size;
+	atomic_set(&cluster->lock, 0);
+	cluster->time = jiffies;
 
 	return cluster;
 }
 
+/*
+ * Cluster replacement is a simplified CLOCK-Pro. Resident clusters
+ * live on cold and hot lists, each scanned by its own hand from head
+ * to tail. A new cluster starts cold. If it is referenced again
+ * before the cold hand reaches it, it is promoted to hot. Otherwise
+ * it is evicted and its index is remembered on the ghost list. A miss
+ * on a ghost index means the cold share is too small: the cluster
+ * comes back hot and cold_target grows. A ghost index that expires
+ * without a hit shrinks cold_target. One-shot streams therefore pass
+ * through the cold list and do not push out hot metadata clusters.
+ *
+ * Lists and counters are protected by dev->clock_lock. The reference
+ * bit is set without any lock on cache hits.
+ */
+
+static unsigned long dio_clock_hot_target(struct dio_pool *pool)
+{
+	return pool->nr_max_clus - min(pool->cold_target, pool->nr_max_clus);
+}
+
+static void dio_clock_cold_target_adjust(struct dio_pool *pool, int inc)
+{
+	if (inc) {
+		if (pool->cold_target < pool->nr_max_clus / 2)
+			pool->cold_target++;
+	} else {
+		if (pool->cold_target > max_t(unsigned long,
+					      pool->nr_max_clus / 16, 1))
+			pool->cold_target--;
+	}
+}
+
+static struct hlist_head *dio_ghost_head(struct dio_pool *pool, u64 index)
+{
+	return &pool->ghost_hash[hash_64(index, DIO_GHOST_HASH_BITS)];
+}
+
+static struct dio_ghost *dio_ghost_lookup(struct dio_pool *pool, u64 index)
+{
+	struct dio_ghost *ghost;
+
+	hlist_for_each_entry(ghost, dio_ghost_head(pool, index), hash_link) {
+		if (ghost->index == index)
+			return ghost;
+	}
+	return NULL;
+}
+
+static void dio_ghost_del(struct dio_pool *pool, struct dio_ghost *ghost)
+{
+	hlist_del(&ghost->hash_link);
+	list_del(&ghost->list);
+	pool->nr_ghost--;
+}
+
+static void dio_ghost_add(struct dio_pool *pool, u64 index)
+{
+	struct dio_ghost *ghost;
+
+	if (pool->nr_ghost >= min_t(unsigned long, pool->nr_max_clus,
+				    DIO_GHOST_MAX)) {
+		/* Oldest ghost expired without being accessed */
+		ghost = list_first_entry(&pool->ghost_list, struct dio_ghost,
+					 list);
+		dio_ghost_del(pool, ghost);
+		dio_clock_cold_target_adjust(pool, 0);
+	} else {
+		ghost = crt_kmalloc(sizeof(*ghost), GFP_ATOMIC);
+		if (!ghost)
+			return;
+	}
+
+	ghost->index = index;
+	hlist_add_head(&ghost->hash_link, dio_ghost_head(pool, index));
+	list_add_tail(&ghost->list, &pool->ghost_list);
+	pool->nr_ghost++;
+}
+
+static void dio_ghosts_free(struct dio_dev *dev)
+{
+	struct dio_ghost *ghost, *next;
+	struct dio_pool *pool;
+	int class;
+
+	spin_lock(&dev->clock_lock);
+	for (class = 0; class < DIO_NR_CLASSES; class++) {
+		pool = &dev->pools[class];
+		list_for_each_entry_safe(ghost, next, &pool->ghost_list,
+					 list) {
+			dio_ghost_del(pool, ghost);
+			crt_kfree(ghost);
+		}
+	}
+	spin_unlock(&dev->clock_lock);
+}
+
+static void dio_clock_insert(struct dio_dev *dev, struct dio_cluster *cluster)
+{
+	struct dio_pool *pool = &dev->pools[cluster->class];
+	struct dio_ghost *ghost;
+
+	pool->nr_clus++;
+
+	ghost = dio_ghost_lookup(pool, cluster->index);
+	if (ghost) {
+		dio_ghost_del(pool, ghost);
+		crt_kfree(ghost);
+		dio_clock_cold_target_adjust(pool, 1);
+		set_bit(DIO_CLU_HOT, &cluster->flags);
+		list_add_tail(&cluster->clock_list, &pool->clock_hot);
+		pool->nr_hot++;
+	} else {
+		list_add_tail(&cluster->clock_list, &pool->clock_cold);
+		pool->nr_cold++;
+	}
+}
+
+static void dio_clock_remove(struct dio_dev *dev, struct dio_cluster *cluster)
+{
+	struct dio_pool *pool = &dev->pools[cluster->class];
+
+	if (list_empty(&cluster->clock_list))
+		return;
+
+	pool->nr_clus--;
+	list_del_init(&cluster->clock_list);
+	if (test_and_clear_bit(DIO_CLU_HOT, &cluster->flags))
+		pool->nr_hot--;
+	else
+		pool->nr_cold--;
+}
+
+/*
+ * Called on every cache hit.
+ */
+static void dio_clu_accessed(struct dio_cluster *cluster)
+{
+	/* First real access of cluster populated by readahead */
+	if (test_bit(DIO_CLU_RA, &cluster->flags) &&
+	    test_and_clear_bit(DIO_CLU_RA, &cluster->flags)) {
+		/* Time of dirty cluster is kept for expiration */
+		if (!test_bit(DIO_CLU_DIRTY, &cluster->flags))
+			cluster->time = jiffies;
+		return;
+	}
+
+	if (test_bit(DIO_CLU_REF, &cluster->flags))
+		return;
+
+	/* Ignore correlated references, e.g. page by page reads */
+	if (dio_clu_age(cluster) < DIO_CLU_CORREL_JIFFIES)
+		return;
+
+	set_bit(DIO_CLU_REF, &cluster->flags);
+}
+
+static int dio_clu_evictable(struct dio_cluster *cluster)
+{
+	return !dio_clu_pinned(cluster) && !dio_clu_io_busy(cluster) &&
+	       !test_bit(DIO_CLU_DIRTY, &cluster->flags);
+}
+
+/*
+ * Hot hand: give referenced hot cluster another round,
+ * demote unreferenced one to the cold list tail.
+ */
+static void dio_clock_hot_hand(struct dio_pool *pool)
+{
+	struct dio_cluster *cluster;
+
+	if (list_empty(&pool->clock_hot))
+		return;
+
+	cluster = list_first_entry(&pool->clock_hot, struct dio_cluster,
+				   clock_list);
+	if (test_and_clear_bit(DIO_CLU_REF, &cluster->flags)) {
+		list_move_tail(&cluster->clock_list, &pool->clock_hot);
+	} else {
+		clear_bit(DIO_CLU_HOT, &cluster->flags);
+		list_move_tail(&cluster->clock_list, &pool->clock_cold);
+		pool->nr_hot--;
+		pool->nr_cold++;
+	}
+}
+
+static struct dio_shard *dio_dev_shard(struct dio_dev *dev, u64 index)
+{
+	return &dev->shards[(index >> DIO_SHARD_SHIFT) &
+			    (DIO_NR_SHARDS - 1)];
+}
+
+/*
+ * Delete unpinned cluster from the tree, called with shard lock held.
+ * Lockless lookup pins cluster and then checks DIO_CLU_REMOVED, here
+ * the bit is set and then pin count is checked again, so either lookup
+ * retries or the cluster stays in the tree.
+ */
+static int __dio_clu_tree_del(struct dio_dev *dev, struct dio_cluster *cluster)
+{
+	struct dio_shard *shard = dio_dev_shard(dev, cluster->index);
+
+	if (dio_clu_pinned(cluster) ||
+	    radix_tree_lookup(&shard->root, cluster->index) != cluster)
+		return 0;
+
+	set_bit(DIO_CLU_REMOVED, &cluster->flags);
+	smp_mb__after_atomic();
+	if (dio_clu_pinned(cluster)) {
+		clear_bit(DIO_CLU_REMOVED, &cluster->flags);
+		return 0;
+	}
+
+	radix_tree_delete(&shard->root, cluster->index);
+	dev->nr_clus--;
+	return 1;
+}
+
+static int dio_clu_tree_del(struct dio_dev *dev, struct dio_cluster *cluster)
+{
+	struct dio_shard *shard = dio_dev_shard(dev, cluster->index);
+	int deleted;
+
+	spin_lock_irq(&shard->lock);
+	deleted = __dio_clu_tree_del(dev, cluster);
+	spin_unlock_irq(&shard->lock);
+
+	return deleted;
+}
+
+/*
+ * Incremental reclaim of pool down to nr_target clusters, bounded by
+ * nr_scan steps of hands. Returns count of evicted clusters.
+ */
+static unsigned long dio_clock_reclaim(struct dio_dev *dev,
+	struct dio_pool *pool, unsigned long nr_target, unsigned long nr_scan)
+{
+	struct dio_cluster *cluster, *next;
+	LIST_HEAD(evicted);
+	unsigned long nr_evicted = 0;
+
+	spin_lock(&dev->clock_lock);
+	while (pool->nr_clus > nr_target && nr_scan-- > 0) {
+		if (pool->nr_hot > dio_clock_hot_target(pool) ||
+		    list_empty(&pool->clock_cold)) {
+			dio_clock_hot_hand(pool);
+			if (list_empty(&pool->clock_cold))
+				continue;
+		}
+
+		cluster = list_first_entry(&pool->clock_cold,
+					   struct dio_cluster, clock_list);
+		if (!dio_clu_evictable(cluster)) {
+			list_move_tail(&cluster->clock_list, &pool->clock_cold);
+			continue;
+		}
+
+		if (test_and_clear_bit(DIO_CLU_REF, &cluster->flags)) {
+			/* Re-referenced during its test period */
+			set_bit(DIO_CLU_HOT, &cluster->flags);
+			list_move_tail(&cluster->clock_list, &pool->clock_hot);
+			pool->nr_cold--;
+			pool->nr_hot++;
+			continue;
+		}
+
+		if (!dio_clu_tree_del(dev, cluster)) {
+			list_move_tail(&cluster->clock_list, &pool->clock_cold);
+			continue;
+		}
+
+		dio_clock_remove(dev, cluster);
+		dio_ghost_add(pool, cluster->index);
+		list_add_tail(&cluster->clock_list, &evicted);
+		nr_evicted++;
+	}
+	spin_unlock(&dev->clock_lock);
+
+	list_for_each_entry_safe(cluster, next, &evicted, clock_list) {
+		list_del_init(&cluster->clock_list);
+		/* Dirtied after the check, write it while it is referenced */
+		if (test_bit(DIO_CLU_DIRTY, &cluster->flags))
+			dio_clu_write_back(cluster);
+		dio_clu_deref(cluster); /* was in tree */
+		dio_clu_deref(cluster); /* by alloc */
+	}
+
+	return nr_evicted;
+}
+
+/*
+ * Reclaim device clusters down to nr_target in total. Data pool goes
+ * first, so metadata is the last to go under memory pressure.
+ */
+static unsigned long dio_dev_reclaim(struct dio_dev *dev,
+	unsigned long nr_target, unsigned long nr_scan)
+{
+	static const int order[] = { DIO_CLASS_DATA, DIO_CLASS_META };
+	struct dio_pool *pool;
+	unsigned long nr_evicted = 0, excess;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(order); i++) {
+		if (dev->nr_clus <= nr_target)
+			break;
+
+		pool = &dev->pools[order[i]];
+		excess = min(dev->nr_clus - nr_target, pool->nr_clus);
+		nr_evicted += dio_clock_reclaim(dev, pool,
+						pool->nr_clus - excess,
+						nr_scan);
+	}
+
+	return nr_evicted;
+}
+
+/*
+ * Cluster is requested with class different from the one it was
+ * cached with, e.g. freed data block reused for btree node. Move it
+ * to the pool of the new class.
+ */
+static void dio_clu_reclass(struct dio_dev *dev, struct dio_cluster *cluster,
+			    int class)
+{
+	spin_lock(&dev->clock_lock);
+	if (!list_empty(&cluster->clock_list) && cluster->class != class) {
+		dio_clock_remove(dev, cluster);
+		cluster->class = class;
+		dio_clock_insert(dev, cluster);
+	}
+	spin_unlock(&dev->clock_lock);
+}
+
 static struct
-dio_cluster *dio_clu_lookup_create(struct dio_dev *dev, unsigned long index)
+dio_cluster *dio_clu_lookup_create(struct dio_dev *dev, unsigned long index,
+				   int class, int ra)
 {
+	struct dio_shard *shard = dio_dev_shard(dev, index);
 	struct dio_cluster *cluster;
+	struct dio_pool *pool;
 
+	/* Fast path: no shared locks, cluster memory is freed by RCU */
 	rcu_read_lock();
-	cluster = radix_tree_lookup(&dev->clus_root, index);
+	cluster = radix_tree_lookup(&shard->root, index);
+	if (cluster && !dio_clu_tryref(cluster))
+		cluster = NULL;
+	rcu_read_unlock();
+
 	if (cluster) {
-		dio_clu_ref(cluster);
 		dio_clu_pin(cluster);
+		smp_mb__after_atomic();
+		if (test_bit(DIO_CLU_REMOVED, &cluster->flags)) {
+			/* Lost the race with eviction, go slow path */
+			dio_clu_put(cluster);
+			cluster = NULL;
+		}
 	}
-	rcu_read_unlock();
 
-	if (!cluster) {
+	if (cluster) {
+		if (unlikely(cluster->class != class))
+			dio_clu_reclass(dev, cluster, class);
+		if (!ra)
+			dio_clu_accessed(cluster);
+	} else {
 		struct dio_cluster *new;
 
-		new = dio_clu_alloc(dev);
+		new = dio_clu_alloc(dev, class);
 		if (!new)
 			return NULL;
 		new->index = index;
+		new->class = class;
+		if (ra)
+			set_bit(DIO_CLU_RA, &new->flags);
 		if (radix_tree_preload(GFP_NOIO)) {
 			dio_clu_deref(new);
 			return NULL;
 		}
 
-		spin_lock_irq(&dev->clus_lock);
-		if (radix_tree_insert(&dev->clus_root, new->index, new)) {
-			cluster = radix_tree_lookup(&dev->clus_root, index);
+		spin_lock(&dev->clock_lock);
+		spin_lock_irq(&shard->lock);
+		if (radix_tree_insert(&shard->root, new->index, new)) {
+			cluster = radix_tree_lookup(&shard->root, index);
 		} else {
 			dio_clu_ref(new);
 			cluster = new;
@@ -234,18 +938,19 @@ dio_cluster *dio_clu_lookup_create(struct dio_dev *dev, unsigned long index)
 			dio_clu_ref(cluster);
 			dio_clu_pin(cluster);
 		}
-		spin_unlock_irq(&dev->clus_lock);
+		spin_unlock_irq(&shard->lock);
+		if (cluster == new)
+			dio_clock_insert(dev, new);
+		spin_unlock(&dev->clock_lock);
 
 		radix_tree_preload_end();
 
+		pool = &dev->pools[class];
 		if (cluster != new)
 			dio_clu_deref(new);
-	}
-
-	if (cluster) {
-		down_read(&dev->age_rw_lock);
-		cluster->age |= (1ull << 63);
-		up_read(&dev->age_rw_lock);
+		else if (pool->nr_clus > pool->nr_max_clus)
+			dio_clock_reclaim(dev, pool, pool->nr_max_clus,
+					  DIO_CLOCK_SCAN_MAX);
 	}
 
 	return cluster;
@@ -254,32 +959,31 @@ dio_cluster *dio_clu_lookup_create(struct dio_dev *dev, unsigned long index)
 static struct
 dio_cluster *dio_clu_remove(struct dio_dev *dev, unsigned long index)
 {
+	struct dio_shard *shard = dio_dev_shard(dev, index);
 	struct dio_cluster *cluster;
 
 	rcu_read_lock();
-	cluster = radix_tree_lookup(&dev->clus_root, index);
+	cluster = radix_tree_lookup(&shard->root, index);
 	if (cluster && dio_clu_pinned(cluster))
 		cluster = NULL;
 	rcu_read_unlock();
 	if (!cluster)
 		return NULL;
 
-	spin_lock_irq(&dev->clus_lock);
-	cluster = radix_tree_lookup(&dev->clus_root, index);
-	if (cluster && !dio_clu_pinned(cluster)) {
-		cluster = radix_tree_delete(&dev->clus_root, index);
-		if (cluster) {
-			NKFS_BUG_ON(cluster->index != index);
-			dev->nr_clus--;
-		}
-	} else
+	spin_lock(&dev->clock_lock);
+	spin_lock_irq(&shard->lock);
+	cluster = radix_tree_lookup(&shard->root, index);
+	if (cluster && !__dio_clu_tree_del(dev, cluster))
 		cluster = NULL;
-	spin_unlock_irq(&dev->clus_lock);
+	spin_unlock_irq(&shard->lock);
+	if (cluster)
+		dio_clock_remove(dev, cluster);
+	spin_unlock(&dev->clock_lock);
 
 	return cluster;
 }
 
-static void dio_clus_release(struct dio_dev *dev)
+static void dio_shard_release(struct dio_dev *dev, struct dio_shard *shard)
 {
 	struct dio_cluster *batch[16];
 	int nr_found, index;
@@ -287,11 +991,12 @@ static void dio_clus_release(struct dio_dev *dev)
 
 	for (;;) {
 		rcu_read_lock();
-		nr_found = radix_tree_gang_lookup(&dev->clus_root,
+		nr_found = radix_tree_gang_lookup(&shard->root,
 				(void **)batch, 0, ARRAY_SIZE(batch));
 		for (index = 0; index < nr_found; index++) {
 			cluster = batch[index];
-			dio_clu_ref(cluster);
+			if (!dio_clu_tryref(cluster))
+				batch[index] = NULL;
 		}
 		rcu_read_unlock();
 		if (nr_found == 0)
@@ -299,6 +1004,8 @@ static void dio_clus_release(struct dio_dev *dev)
 
 		for (index = 0; index < nr_found; index++) {
 			cluster = batch[index];
+			if (!cluster)
+				continue;
 			atomic_set(&cluster->pin_count, 0);
 			removed = dio_clu_remove(dev, cluster->index);
 			NKFS_BUG_ON(removed != cluster);
@@ -308,11 +1015,20 @@ static void dio_clus_release(struct dio_dev *dev)
 			dio_clu_deref(cluster); /* by batch */
 		}
 	}
+}
+
+static void dio_clus_release(struct dio_dev *dev)
+{
+	int i;
+
+	dio_dev_sync(dev);
+	for (i = 0; i < DIO_NR_SHARDS; i++)
+		dio_shard_release(dev, &dev->shards[i]);
 
 	NKFS_BUG_ON(dev->nr_clus);
 }
 
-static void dio_clus_dump(struct dio_dev *dev)
+static void dio_shard_dump(struct dio_shard *shard)
 {
 	struct dio_cluster *batch[16];
 	int nr_found;
@@ -321,13 +1037,14 @@ static void dio_clus_dump(struct dio_dev *dev)
 
 	for (;;) {
 		rcu_read_lock();
-		nr_found = radix_tree_gang_lookup(&dev->clus_root,
+		nr_found = radix_tree_gang_lookup(&shard->root,
 				(void **)batch, first_index, ARRAY_SIZE(batch));
 		for (index = 0; index < nr_found; index++) {
 			node = batch[index];
-			dio_clu_ref(node);
 			if (node->index >= first_index)
 				first_index = node->index + 1;
+			if (!dio_clu_tryref(node))
+				batch[index] = NULL;
 		}
 		rcu_read_unlock();
 		if (nr_found == 0)
@@ -335,162 +1052,301 @@ static void dio_clus_dump(struct dio_dev *dev)
 
 		for (index = 0; index < nr_found; index++) {
 			node = batch[index];
-			dio_clu_deref(node);
+			if (node)
+				dio_clu_deref(node);
 		}
 	}
 }
 
+static void dio_clus_dump(struct dio_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < DIO_NR_SHARDS; i++)
+		dio_shard_dump(&dev->shards[i]);
+}
+
 static void dio_dev_release(struct dio_dev *dev)
 {
+	if (dev->flusher)
+		kthread_stop(dev->flusher);
 
 	mutex_lock(&dio_dev_list_lock);
 	list_del(&dev->list);
+	dio_nr_devs--;
+	if (dio_nr_devs)
+		dio_devs_resize();
 	mutex_unlock(&dio_dev_list_lock);
 
+	dio_dev_wait_ios(dev);
 	dio_clus_dump(dev);
 	dio_clus_release(dev);
+	/* Writes of release hold clusters until their ios are freed */
+	dio_dev_wait_ios(dev);
+	dio_ghosts_free(dev);
+	/* Clusters freed by RCU return buffers to dev->clu_pool */
+	dio_clus_free_wait();
+	mempool_destroy(dev->clu_pool);
 	crt_kfree(dev);
 }
 
-static int dio_clu_age_cmp(const void *a, const void *b)
+static struct dio_cluster *__dio_clu_get(struct dio_dev *dev, u64 index,
+				       int class, int ra)
 {
-	struct dio_cluster *node_a = *((struct dio_cluster **)a);
-	struct dio_cluster *node_b = *((struct dio_cluster **)b);
+	NKFS_BUG_ON(class < 0 || class >= DIO_NR_CLASSES);
+	if (index > DIO_CLU_MAX_INDEX)
+		return NULL;
 
-	if (node_a->age > node_b->age)
-		return 1;
-	else if (node_a->age < node_b->age)
-		return -1;
-	else
-		return 0;
+	return dio_clu_lookup_create(dev, index, class, ra);
 }
 
-static void dio_clu_ptr_swap(void *a, void *b, int size)
+void dio_clu_put(struct dio_cluster *cluster)
 {
-	struct dio_cluster **node_a = a;
-	struct dio_cluster **node_b = b;
-	struct dio_cluster *tmp;
-
-	tmp = *node_a;
-	*node_a = *node_b;
-	*node_b = tmp;
+	dio_clu_unpin(cluster);
+	dio_clu_deref(cluster);
 }
 
-static int dio_clus_lru_frees(struct dio_dev *dev)
+/*
+ * Last deref of clusters could free their buffers to dev->clu_pool, so
+ * device is released only after all its ios, wake up is done under
+ * io_lock for the same reason.
+ */
+static void dio_io_release(struct dio_io *io)
 {
-	struct dio_cluster *batch[16];
-	int nr_found;
-	unsigned long index, first_index = 0;
-	struct dio_cluster *node, *removed;
-	struct dio_cluster **nodes;
-	struct page *page;
-	int nr_nodes = 0;
-	int nodes_limit = PAGE_SIZE/sizeof(struct dio_cluster *);
+	struct dio_dev *dev = io->dev;
+	unsigned long irq_flags;
+	int i;
 
-	if (dev->nr_clus <= dev->nr_max_clus)
-		return 0;
+	if (io->bio)
+		bio_put(io->bio);
 
-	page = crt_alloc_page(GFP_KERNEL);
-	if (!page) {
-		return -ENOMEM;
+	for (i = 0; i < io->nr_clus; i++)
+		dio_clu_deref(io->clus[i]);
+
+	crt_kfree(io);
+
+	if (dev) {
+		spin_lock_irqsave(&dev->io_lock, irq_flags);
+		NKFS_BUG_ON(dev->nr_ios == 0);
+		if (--dev->nr_ios == 0)
+			wake_up(&dev->io_wait);
+		spin_unlock_irqrestore(&dev->io_lock, irq_flags);
 	}
+}
 
-	nodes = page_address(page);
+static int dio_dev_ios_done(struct dio_dev *dev)
+{
+	int done;
 
-	while (nr_nodes < nodes_limit) {
+	spin_lock_irq(&dev->io_lock);
+	done = (dev->nr_ios == 0) ? 1 : 0;
+	spin_unlock_irq(&dev->io_lock);
+	return done;
+}
 
-		rcu_read_lock();
-		nr_found = radix_tree_gang_lookup(&dev->clus_root,
-				(void **)batch, first_index,
-				ARRAY_SIZE(batch));
-		for (index = 0; index < nr_found; index++) {
-			node = batch[index];
-			dio_clu_ref(node);
-			if (node->index >= first_index)
-				first_index = node->index + 1;
-		}
-		rcu_read_unlock();
+/* Wait for ios still in flight, such as readahead nobody waits for */
+static void dio_dev_wait_ios(struct dio_dev *dev)
+{
+	wait_event(dev->io_wait, dio_dev_ios_done(dev));
+}
 
-		if (nr_found == 0)
-			break;
+static void dio_io_deref(struct dio_io *io)
+{
+	if (atomic_dec_and_test(&io->ref))
+		dio_io_release(io);
+}
 
-		for (index = 0; index < nr_found; index++) {
-			node = batch[index];
-			if (!dio_clu_pinned(node) && (nr_nodes < nodes_limit))
-				nodes[nr_nodes++] = node;
-			else
-				dio_clu_deref(node);
-		}
+static void dio_clu_tag(struct dio_cluster *cluster, unsigned int tag, int set)
+{
+	struct dio_shard *shard = dio_dev_shard(cluster->dev, cluster->index);
+	unsigned long irq_flags;
+
+	/*
+	 * Cluster could be already removed from the tree (shrink or
+	 * release), so tag only the entry that is still the same cluster.
+	 */
+	spin_lock_irqsave(&shard->lock, irq_flags);
+	if (radix_tree_lookup(&shard->root, cluster->index) == cluster) {
+		if (set)
+			radix_tree_tag_set(&shard->root, cluster->index, tag);
+		else
+			radix_tree_tag_clear(&shard->root, cluster->index,
+					     tag);
 	}
+	spin_unlock_irqrestore(&shard->lock, irq_flags);
+}
 
-	/* Lock clus->age modification */
-	down_write(&dev->age_rw_lock);
-	sort(nodes, nr_nodes, sizeof(struct dio_cluster *),
-			dio_clu_age_cmp, dio_clu_ptr_swap);
+static int dio_dev_over_dirty(struct dio_dev *dev)
+{
+	return atomic_long_read(&dev->nr_dirty) * 100 >
+	       dev->nr_max_clus * READ_ONCE(dio_dirty_ratio);
+}
 
-	for (index = 0; index < nr_nodes; index++) {
-		node = nodes[index];
-		if (dev->nr_clus > dev->nr_max_clus) {
-			removed = dio_clu_remove(dev, node->index);
-			if (removed) {
-				NKFS_BUG_ON(removed != node);
-				dio_clu_sync(node);
-				dio_clu_deref(node);
-				dio_clu_deref(node);
-			}
-		}
+/*
+ * Mask of cluster pages covered by byte range [off, off + len).
+ */
+static unsigned long dio_clu_pages_mask(struct dio_cluster *cluster,
+					unsigned long off, unsigned long len)
+{
+	NKFS_BUG_ON((off + len) > dio_clu_size(cluster));
+
+	if (!len)
+		return 0;
+
+	return GENMASK((off + len - 1) >> PAGE_SHIFT, off >> PAGE_SHIFT);
+}
+
+static unsigned long dio_clu_pages_all(struct dio_cluster *cluster)
+{
+	return dio_clu_pages_mask(cluster, 0, dio_clu_size(cluster));
+}
+
+/*
+ * Writers and dio_clu_start_wb() are serialized by DIO_CLU_SYNC bit
+ * lock, so writeback never starts in the middle of a write.
+ */
+static void dio_clu_sync_lock(struct dio_cluster *cluster)
+{
+	wait_on_bit_lock(&cluster->flags, DIO_CLU_SYNC, TASK_UNINTERRUPTIBLE);
+}
+
+static void dio_clu_sync_unlock(struct dio_cluster *cluster)
+{
+	clear_bit_unlock(DIO_CLU_SYNC, &cluster->flags);
+	smp_mb__after_atomic();
+	wake_up_bit(&cluster->flags, DIO_CLU_SYNC);
+}
+
+/*
+ * Take mask of dirty pages out of cluster->flags.
+ */
+static unsigned long dio_clu_take_dirty_pages(struct dio_cluster *cluster)
+{
+	unsigned long old, new;
+
+	do {
+		old = READ_ONCE(cluster->flags);
+		new = old & ~DIO_CLU_PAGES_MASK;
+	} while (cmpxchg(&cluster->flags, old, new) != old);
+
+	return (old & DIO_CLU_PAGES_MASK) >> DIO_CLU_PAGE_SHIFT;
+}
+
+/*
+ * Mark pages of cluster dirty. Page bits are set before DIO_CLU_DIRTY,
+ * so dio_clu_start_wb() never sees dirty cluster without dirty pages.
+ */
+static void dio_clu_mark_dirty(struct dio_cluster *cluster,
+			       unsigned long pages)
+{
+	struct dio_dev *dev = cluster->dev;
+	unsigned long bit;
+
+	for_each_set_bit(bit, &pages, DIO_CLU_MAX_PAGES) {
+		if (!test_bit(DIO_CLU_PAGE_SHIFT + bit, &cluster->flags))
+			set_bit(DIO_CLU_PAGE_SHIFT + bit, &cluster->flags);
 	}
-	up_write(&dev->age_rw_lock);
 
-	for (index = 0; index < nr_nodes; index++) {
-		node = nodes[index];
-		dio_clu_deref(node);
+	if (!test_and_set_bit(DIO_CLU_DIRTY, &cluster->flags)) {
+		cluster->time = jiffies;
+		atomic_long_inc(&dev->nr_dirty);
+		dio_clu_tag(cluster, DIO_TAG_DIRTY, 1);
+		if (dev->flusher && dio_dev_over_dirty(dev))
+			wake_up(&dev->flush_wait);
 	}
-	crt_free_page(page);
-	return 0;
 }
 
-static void dio_clus_shrink(struct dio_dev *dev)
+/*
+ * Move dirty cluster under writeback. Return 1 if cluster should be
+ * written by caller, 0 if cluster is clean, -EBUSY if cluster is
+ * dirty but in the middle of modification, see dio_clu_modify_begin().
+ */
+static int dio_clu_start_wb(struct dio_cluster *cluster)
 {
-	for (;;) {
-		if (dev->nr_clus > dev->nr_max_clus)
-			dio_clus_lru_frees(dev);
-		else
-			break;
+	int started = 0;
+
+	wait_on_bit(&cluster->flags, DIO_CLU_WB, TASK_UNINTERRUPTIBLE);
+
+	dio_clu_sync_lock(cluster);
+	if (!test_bit(DIO_CLU_DIRTY, &cluster->flags))
+		goto out;
+
+	if (test_bit(DIO_CLU_MODIFY, &cluster->flags)) {
+		started = -EBUSY;
+		goto out;
 	}
+
+	if (test_and_set_bit_lock(DIO_CLU_WB, &cluster->flags))
+		goto out;
+
+	clear_bit(DIO_CLU_DIRTY, &cluster->flags);
+	cluster->wb_pages = dio_clu_take_dirty_pages(cluster);
+	if (!cluster->wb_pages)
+		cluster->wb_pages = dio_clu_pages_all(cluster);
+	atomic_long_dec(&cluster->dev->nr_dirty);
+	dio_clu_tag(cluster, DIO_TAG_DIRTY, 0);
+	started = 1;
+out:
+	dio_clu_sync_unlock(cluster);
+	return started;
 }
 
-static struct dio_cluster *__dio_clu_get(struct dio_dev *dev, u64 index)
+static void dio_clu_end_wb(struct dio_cluster *cluster, int err)
 {
-	return dio_clu_lookup_create(dev, index);
+	if (err)
+		dio_clu_mark_dirty(cluster, cluster->wb_pages);
+
+	clear_bit_unlock(DIO_CLU_WB, &cluster->flags);
+	smp_mb__after_atomic();
+	wake_up_bit(&cluster->flags, DIO_CLU_WB);
 }
 
-void dio_clu_put(struct dio_cluster *cluster)
+static void dio_clu_end_read(struct dio_cluster *cluster, int err)
 {
-	dio_clu_unpin(cluster);
-	dio_clu_deref(cluster);
+	if (!err) {
+		NKFS_BUG_ON(test_bit(DIO_CLU_READ, &cluster->flags));
+		set_bit(DIO_CLU_READ, &cluster->flags);
+	}
+	/* Error is kept in s8 */
+	cluster->err = (err < -127) ? -EIO : err;
+	clear_bit_unlock(DIO_CLU_READING, &cluster->flags);
+	smp_mb__after_atomic();
+	wake_up_bit(&cluster->flags, DIO_CLU_READING);
 }
 
-static void dio_io_release(struct dio_io *io)
+/*
+ * Read of cluster could not be submitted (no memory for io or bio),
+ * so drop READ_START and leave READING set: the next dio_clu_get()
+ * starts the read again instead of returning a stale error.
+ */
+static void dio_clu_cancel_read(struct dio_cluster *cluster)
 {
-	if (io->bio)
-		bio_put(io->bio);
-
-	if (io->cluster)
-		dio_clu_deref(io->cluster);
+	NKFS_BUG_ON(test_bit(DIO_CLU_READ, &cluster->flags));
+	NKFS_BUG_ON(!test_bit(DIO_CLU_READING, &cluster->flags));
 
-	crt_kfree(io);
+	cluster->err = 0;
+	clear_bit_unlock(DIO_CLU_READ_START, &cluster->flags);
+	smp_mb__after_atomic();
+	wake_up_bit(&cluster->flags, DIO_CLU_READING);
 }
 
-static void dio_io_deref(struct dio_io *io)
+/*
+ * Wait until read of cluster is completed or cancelled, returns
+ * 0 in the latter case.
+ */
+static int dio_clu_wait_read_end(struct dio_cluster *cluster)
 {
-	if (atomic_dec_and_test(&io->ref))
-		dio_io_release(io);
+	wait_event(*bit_waitqueue(&cluster->flags, DIO_CLU_READING),
+		   !test_bit(DIO_CLU_READING, &cluster->flags) ||
+		   !test_bit(DIO_CLU_READ_START, &cluster->flags));
+
+	return !test_bit(DIO_CLU_READING, &cluster->flags);
 }
 
 static void __dio_io_end_bio(struct bio *bio, int err)
 {
 	struct dio_io *io = bio->bi_private;
+	int i;
 
 	NKFS_BUG_ON(io->bio != bio);
 
@@ -501,11 +1357,11 @@ static void __dio_io_end_bio(struct bio *bio, int err)
 	trace_dio_io_end_bio(io);
 
 	if (!(io->rw & REQ_WRITE)) { /*it was read */
-		if (!err) {
-			NKFS_BUG_ON(test_bit(DIO_CLU_READ,
-				    &io->cluster->flags));
-			set_bit(DIO_CLU_READ, &io->cluster->flags);
-		}
+		for (i = 0; i < io->nr_clus; i++)
+			dio_clu_end_read(io->clus[i], err);
+	} else {
+		for (i = 0; i < io->nr_clus; i++)
+			dio_clu_end_wb(io->clus[i], err);
 	}
 
 	if (test_bit(DIO_IO_WAIT, &io->flags))
@@ -526,26 +1382,63 @@ static void dio_io_end_bio(struct bio *bio, int err)
 }
 #endif
 
-static struct bio *dio_io_alloc_bio(struct dio_io *io)
+/*
+ * Pages [*first, *last] of cluster transferred by io. Reads take whole
+ * cluster, writes take the span of pages dirtied since last writeback.
+ */
+static void dio_io_clu_span(struct dio_cluster *cluster, int write,
+			    int *first, int *last)
+{
+	if (!write) {
+		*first = 0;
+		*last = dio_clu_nr_pages(cluster) - 1;
+		return;
+	}
+
+	NKFS_BUG_ON(!cluster->wb_pages);
+	*first = __ffs(cluster->wb_pages);
+	*last = __fls(cluster->wb_pages);
+}
+
+static struct bio *dio_io_alloc_bio(struct dio_io *io, int write)
 {
+	struct dio_cluster *cluster;
 	struct bio *bio;
-	int i;
+	int i, j, nr_pages, vcnt, first, last;
+
+	NKFS_BUG_ON(io->nr_clus <= 0);
 
-	bio = bio_alloc(GFP_NOIO, io->cluster->pages.nr_pages);
+	nr_pages = 0;
+	for (i = 0; i < io->nr_clus; i++) {
+		dio_io_clu_span(io->clus[i], write, &first, &last);
+		nr_pages += last - first + 1;
+	}
+
+	bio = bio_alloc(GFP_NOIO, nr_pages);
 	if (!bio)
 		return NULL;
 
-	BIO_BI_SECTOR(bio) = io->cluster->index*(io->cluster->clu_size >> 9);
-	bio->bi_bdev = io->cluster->dev->bdev;
-
-	for (i = 0; i < io->cluster->pages.nr_pages; i++) {
-		bio->bi_io_vec[i].bv_page = io->cluster->pages.pages[i];
-		bio->bi_io_vec[i].bv_len = PAGE_SIZE;
-		bio->bi_io_vec[i].bv_offset = 0;
+	cluster = io->clus[0];
+	dio_io_clu_span(cluster, write, &first, &last);
+	BIO_BI_SECTOR(bio) = cluster->index*(dio_clu_size(cluster) >> 9) +
+			     first*(PAGE_SIZE >> 9);
+	bio->bi_bdev = cluster->dev->bdev;
+
+	vcnt = 0;
+	for (i = 0; i < io->nr_clus; i++) {
+		cluster = io->clus[i];
+		NKFS_BUG_ON(i && cluster->index != io->clus[i-1]->index + 1);
+		dio_io_clu_span(cluster, write, &first, &last);
+		for (j = first; j <= last; j++) {
+			bio->bi_io_vec[vcnt].bv_page = dio_clu_page(cluster, j);
+			bio->bi_io_vec[vcnt].bv_len = PAGE_SIZE;
+			bio->bi_io_vec[vcnt].bv_offset = 0;
+			vcnt++;
+		}
 	}
 
-	bio->bi_vcnt = io->cluster->pages.nr_pages;
-	BIO_BI_SIZE(bio) = io->cluster->pages.nr_pages*PAGE_SIZE;
+	bio->bi_vcnt = vcnt;
+	BIO_BI_SIZE(bio) = vcnt*PAGE_SIZE;
 
 	bio->bi_end_io = dio_io_end_bio;
 	bio->bi_private = io;
@@ -554,7 +1447,7 @@ static struct bio *dio_io_alloc_bio(struct dio_io *io)
 	return bio;
 }
 
-struct dio_io *dio_io_alloc(struct dio_cluster *cluster)
+static struct dio_io *dio_io_alloc(void)
 {
 	struct dio_io *io;
 
@@ -567,108 +1460,722 @@ struct dio_io *dio_io_alloc(struct dio_cluster *cluster)
 	INIT_LIST_HEAD(&io->list);
 	init_completion(&io->comp);
 
-	dio_clu_ref(cluster);
-	io->cluster = cluster;
+	return io;
+}
 
-	io->bio = dio_io_alloc_bio(io);
-	if (!io->bio) {
-		dio_io_deref(io);
-		return NULL;
+static void dio_io_add_clu(struct dio_io *io, struct dio_cluster *cluster)
+{
+	struct dio_dev *dev = cluster->dev;
+	unsigned long irq_flags;
+
+	NKFS_BUG_ON(io->nr_clus >= ARRAY_SIZE(io->clus));
+
+	if (!io->dev) {
+		io->dev = dev;
+		spin_lock_irqsave(&dev->io_lock, irq_flags);
+		dev->nr_ios++;
+		spin_unlock_irqrestore(&dev->io_lock, irq_flags);
 	}
+	NKFS_BUG_ON(io->dev != dev);
 
-	return io;
+	dio_clu_ref(cluster);
+	io->clus[io->nr_clus++] = cluster;
+}
+
+/*
+ * Only synchronous metadata I/O of small size is worth spinning a CPU
+ * for, data and background writeback complete by interrupt.
+ */
+static int dio_io_pollable(struct dio_io *io)
+{
+	int i;
+
+	if (!io->clus[0]->dev->poll)
+		return 0;
+
+	for (i = 0; i < io->nr_clus; i++)
+		if (io->clus[i]->class != DIO_CLASS_META)
+			return 0;
+
+	return 1;
 }
 
-static void dio_submit(unsigned long rw, struct dio_io *io)
+/*
+ * Returns cookie to poll for if io was marked with DIO_IO_POLL,
+ * BLK_QC_T_NONE otherwise. io could be released by completion already.
+ */
+static blk_qc_t dio_submit(unsigned long rw, struct dio_io *io)
 {
+	int poll = test_bit(DIO_IO_POLL, &io->flags);
+	blk_qc_t cookie;
+
 	io->rw |= rw;
+#if DIO_BLK_POLL
+	if (poll)
+		io->rw |= REQ_HIPRI;
 
+	trace_dio_submit(io);
+	cookie = submit_bio(io->rw, io->bio);
+#else
+	/* DIO_IO_POLL isn't set as dev->poll is off */
+	NKFS_BUG_ON(poll);
 	trace_dio_submit(io);
 	submit_bio(io->rw, io->bio);
+	cookie = BLK_QC_T_NONE;
+#endif
+	return poll ? cookie : BLK_QC_T_NONE;
+}
+
+/*
+ * Reap completions from device queue in caller context instead of
+ * sleeping for interrupt. blk_poll() gives up once CPU is needed by
+ * someone else, then caller falls back to sleeping.
+ */
+static bool dio_poll(struct dio_dev *dev, blk_qc_t cookie)
+{
+#if DIO_BLK_POLL
+	return blk_qc_t_valid(cookie) &&
+	       blk_poll(bdev_get_queue(dev->bdev), cookie);
+#else
+	return false;
+#endif
+}
+
+static void dio_poll_wait(struct dio_dev *dev, blk_qc_t cookie,
+			  struct completion *comp)
+{
+	while (!completion_done(comp) && dio_poll(dev, cookie))
+		;
+
+	wait_for_completion(comp);
+}
+
+static void dio_ra_submit(struct dio_io *io)
+{
+	int i;
+
+	if (!io->nr_clus) {
+		dio_io_deref(io);
+		return;
+	}
+
+	io->bio = dio_io_alloc_bio(io, 0);
+	if (!io->bio) {
+		for (i = 0; i < io->nr_clus; i++)
+			dio_clu_cancel_read(io->clus[i]);
+		dio_io_deref(io);
+		return;
+	}
+
+	/* io is released by dio_io_end_bio() */
+	dio_submit(READ, io);
 }
 
 static int dio_clu_wait_read(struct dio_cluster *cluster)
 {
+	blk_qc_t cookie = BLK_QC_T_NONE;
 	struct dio_io *io;
-	int err;
 
+retry:
 	if (!test_and_set_bit(DIO_CLU_READ_START, &cluster->flags)) {
-		io = dio_io_alloc(cluster);
+		io = dio_io_alloc();
+		if (!io) {
+			dio_clu_cancel_read(cluster);
+			return -ENOMEM;
+		}
+
+		dio_io_add_clu(io, cluster);
+		io->bio = dio_io_alloc_bio(io, 0);
+		if (!io->bio) {
+			dio_io_deref(io);
+			dio_clu_cancel_read(cluster);
+			return -ENOMEM;
+		}
+
+		if (dio_io_pollable(io))
+			set_bit(DIO_IO_POLL, &io->flags);
+		cookie = dio_submit(READ, io);
+	}
+
+	while (test_bit(DIO_CLU_READING, &cluster->flags) &&
+	       dio_poll(cluster->dev, cookie))
+		;
+	/* Read started by someone else was cancelled, start it here */
+	if (!dio_clu_wait_read_end(cluster))
+		goto retry;
+	return cluster->err;
+}
+
+static int dio_u64_cmp(const void *a, const void *b)
+{
+	u64 val_a = *((u64 *)a);
+	u64 val_b = *((u64 *)b);
+
+	if (val_a > val_b)
+		return 1;
+	else if (val_a < val_b)
+		return -1;
+	else
+		return 0;
+}
+
+/*
+ * Start asynchronous read of clusters that are not cached yet.
+ * Indexes are sorted in place and adjacent clusters are read by
+ * a single bio. Nothing is waited for, a later dio_clu_get() of
+ * the same index just waits for the read in flight.
+ */
+void dio_clus_readahead(struct dio_dev *dev, u64 *indexes, int nr,
+			int class)
+{
+	struct dio_cluster *cluster;
+	struct dio_io *io = NULL;
+	struct blk_plug plug;
+	int i;
+
+	if (nr <= 0)
+		return;
+
+	sort(indexes, nr, sizeof(u64), dio_u64_cmp, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++) {
+		if (i && indexes[i] == indexes[i-1])
+			continue;
+
+		if (io && (io->nr_clus == DIO_IO_MAX_CLUS ||
+			   io->clus[io->nr_clus - 1]->index + 1 != indexes[i])) {
+			dio_ra_submit(io);
+			io = NULL;
+		}
+
 		if (!io) {
+			io = dio_io_alloc();
+			if (!io)
+				break;
+		}
+
+		cluster = __dio_clu_get(dev, indexes[i], class, 1);
+		if (!cluster)
+			break;
+
+		if (!test_and_set_bit(DIO_CLU_READ_START, &cluster->flags))
+			dio_io_add_clu(io, cluster);
+		dio_clu_put(cluster);
+	}
+
+	if (io)
+		dio_ra_submit(io);
+	blk_finish_plug(&plug);
+}
+
+/*
+ * Collect indexes of cached clusters of the class, hot ones first.
+ * Used to save cache content for warm-up after restart.
+ */
+int dio_dev_cached_indexes(struct dio_dev *dev, int class, u64 *indexes,
+			   int max)
+{
+	struct dio_pool *pool = &dev->pools[class];
+	struct dio_cluster *cluster;
+	int nr = 0;
+
+	spin_lock(&dev->clock_lock);
+	list_for_each_entry(cluster, &pool->clock_hot, clock_list) {
+		if (nr >= max)
+			goto unlock;
+		indexes[nr++] = cluster->index;
+	}
+	list_for_each_entry(cluster, &pool->clock_cold, clock_list) {
+		if (nr >= max)
+			goto unlock;
+		indexes[nr++] = cluster->index;
+	}
+unlock:
+	spin_unlock(&dev->clock_lock);
+	return nr;
+}
+
+/*
+ * Memory taken by cached clusters, descriptor overhead is counted by
+ * slab object sizes.
+ */
+void dio_dev_stats(struct dio_dev *dev, struct dio_dev_stats *stats)
+{
+	unsigned long nr_clus = READ_ONCE(dev->nr_clus);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->nr_clus = nr_clus;
+	stats->buf_bytes = (u64)nr_clus * dev->clu_size;
+	stats->desc_bytes = (u64)nr_clus * kmem_cache_size(dio_clu_cachep) +
+			    (u64)atomic_long_read(&dev->nr_sums) *
+			    kmem_cache_size(dio_sum_cachep);
+}
+
+void dio_batch_start(struct dio_batch *batch, struct dio_dev *dev,
+	struct dio_cluster **clus, int max_clus)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->dev = dev;
+	batch->clus = clus;
+	batch->max_clus = max_clus;
+}
+
+/*
+ * Get clusters into the batch and start reads of ones not cached yet,
+ * nothing is waited for. Indexes are sorted in place, adjacent
+ * clusters are read by single bio. All reads are submitted on return,
+ * as following dio_clu_get() of a cluster waits for its read.
+ */
+int dio_batch_add(struct dio_batch *batch, u64 *indexes, int nr,
+		  int class)
+{
+	struct dio_cluster *cluster;
+	struct dio_io *io = NULL;
+	struct blk_plug plug;
+	int i, err = 0;
+
+	sort(indexes, nr, sizeof(u64), dio_u64_cmp, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++) {
+		if (i && indexes[i] == indexes[i-1])
+			continue;
+		if (batch->nr_clus >= batch->max_clus) {
+			err = -ENOSPC;
+			break;
+		}
+
+		cluster = __dio_clu_get(batch->dev, indexes[i], class, 0);
+		if (!cluster) {
 			err = -ENOMEM;
-			goto read_comp;
+			break;
 		}
+		batch->clus[batch->nr_clus++] = cluster;
 
-		set_bit(DIO_IO_WAIT, &io->flags);
-		dio_submit(READ, io);
-		wait_for_completion(&io->comp);
-		err = io->err;
-		NKFS_BUG_ON(!err && !test_bit(DIO_CLU_READ, &cluster->flags));
-		dio_io_deref(io);
-read_comp:
-		cluster->err = err;
-		complete(&cluster->read_comp);
-	} else {
-		err = cluster->err;
-		wait_for_completion(&cluster->read_comp);
+		if (test_and_set_bit(DIO_CLU_READ_START, &cluster->flags))
+			continue;
+
+		if (io && (io->nr_clus == DIO_IO_MAX_CLUS ||
+			   io->clus[io->nr_clus - 1]->index + 1 !=
+			   cluster->index)) {
+			dio_ra_submit(io);
+			io = NULL;
+		}
+
+		if (!io) {
+			io = dio_io_alloc();
+			if (!io) {
+				dio_clu_cancel_read(cluster);
+				err = -ENOMEM;
+				break;
+			}
+		}
+		dio_io_add_clu(io, cluster);
 	}
 
+	if (io)
+		dio_ra_submit(io);
+	blk_finish_plug(&plug);
 	return err;
 }
 
+/*
+ * Drop clusters of the batch, reads in flight are not waited for.
+ */
+void dio_batch_end(struct dio_batch *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->nr_clus; i++)
+		dio_clu_put(batch->clus[i]);
+	batch->nr_clus = 0;
+}
+
+/*
+ * Writeback context: collects clusters in ascending index order, merges
+ * adjacent ones into a single bio and keeps at most DIO_WB_MAX_IOS bios
+ * in flight.
+ */
+struct dio_wb {
+	struct dio_dev		*dev;
+	struct dio_io		*io;
+	struct list_head	ios;
+	int			nr_ios;
+	int			max_clus;
+	int			err;
+	int			poll;	/* Caller waits for writes */
+	struct blk_plug		plug;
+};
+
+static void dio_wb_start(struct dio_wb *wb, struct dio_dev *dev)
+{
+	unsigned int max_sectors;
+
+	memset(wb, 0, sizeof(*wb));
+	wb->dev = dev;
+	INIT_LIST_HEAD(&wb->ios);
+
+	max_sectors = queue_max_sectors(bdev_get_queue(dev->bdev));
+	wb->max_clus = min_t(unsigned long, DIO_IO_MAX_CLUS,
+			     max_sectors / (dev->clu_size >> 9));
+	if (wb->max_clus == 0)
+		wb->max_clus = 1;
+
+	blk_start_plug(&wb->plug);
+}
+
+static void dio_wb_set_err(struct dio_wb *wb, int err)
+{
+	if (err && !wb->err)
+		wb->err = err;
+}
+
+static void dio_wb_wait_io(struct dio_wb *wb)
+{
+	struct dio_io *io;
+
+	io = list_first_entry(&wb->ios, struct dio_io, list);
+	list_del_init(&io->list);
+	wb->nr_ios--;
+
+	dio_poll_wait(wb->dev, io->cookie, &io->comp);
+	dio_wb_set_err(wb, io->err);
+	dio_io_deref(io);
+}
+
+static void dio_wb_submit(struct dio_wb *wb)
+{
+	struct dio_io *io = wb->io;
+	int i;
+
+	if (!io)
+		return;
+	wb->io = NULL;
+
+	io->bio = dio_io_alloc_bio(io, 1);
+	if (!io->bio) {
+		for (i = 0; i < io->nr_clus; i++)
+			dio_clu_end_wb(io->clus[i], -ENOMEM);
+		dio_wb_set_err(wb, -ENOMEM);
+		dio_io_deref(io);
+		return;
+	}
+
+	if (wb->nr_ios >= DIO_WB_MAX_IOS)
+		dio_wb_wait_io(wb);
+
+	set_bit(DIO_IO_WAIT, &io->flags);
+	if (wb->poll && dio_io_pollable(io))
+		set_bit(DIO_IO_POLL, &io->flags);
+	list_add_tail(&io->list, &wb->ios);
+	wb->nr_ios++;
+	io->cookie = dio_submit(WRITE, io);
+}
+
+/*
+ * Written spans of two clusters are adjacent on disk only if the first
+ * one ends at its last page and the second one starts at page 0.
+ */
+static int dio_wb_mergeable(struct dio_cluster *prev,
+			    struct dio_cluster *cluster)
+{
+	int first, last;
+
+	if (prev->index + 1 != cluster->index)
+		return 0;
+
+	dio_io_clu_span(prev, 1, &first, &last);
+	if (last != dio_clu_nr_pages(prev) - 1)
+		return 0;
+
+	dio_io_clu_span(cluster, 1, &first, &last);
+	return first == 0;
+}
+
+/*
+ * Add cluster already moved under writeback by dio_clu_start_wb().
+ */
+static void dio_wb_add(struct dio_wb *wb, struct dio_cluster *cluster)
+{
+	struct dio_io *io = wb->io;
+
+	if (io && (io->nr_clus >= wb->max_clus ||
+		   !dio_wb_mergeable(io->clus[io->nr_clus - 1], cluster)))
+		dio_wb_submit(wb);
+
+	if (!wb->io) {
+		wb->io = dio_io_alloc();
+		if (!wb->io) {
+			dio_clu_end_wb(cluster, -ENOMEM);
+			dio_wb_set_err(wb, -ENOMEM);
+			return;
+		}
+	}
+
+	dio_io_add_clu(wb->io, cluster);
+}
+
+static int dio_wb_finish(struct dio_wb *wb)
+{
+	dio_wb_submit(wb);
+	blk_finish_plug(&wb->plug);
+
+	while (wb->nr_ios)
+		dio_wb_wait_io(wb);
+
+	return wb->err;
+}
+
+/*
+ * Cluster content lock. cluster->lock is count of readers or -1 if
+ * write locked, sleepers wait on hashed bit waitqueue keyed by
+ * DIO_CLU_LOCK_WAIT, so the lock costs 4 bytes of descriptor.
+ */
+static wait_queue_head_t *dio_clu_lock_wq(struct dio_cluster *cluster)
+{
+	return bit_waitqueue(&cluster->flags, DIO_CLU_LOCK_WAIT);
+}
+
+static void dio_clu_lock_wake(struct dio_cluster *cluster)
+{
+	/* Pairs with the barrier of prepare_to_wait() */
+	smp_mb();
+	wake_up_bit(&cluster->flags, DIO_CLU_LOCK_WAIT);
+}
+
 void dio_clu_write_lock(struct dio_cluster *cluster)
 {
-	down_write(&cluster->rw_lock);
+	might_sleep();
+	wait_event(*dio_clu_lock_wq(cluster),
+		   atomic_cmpxchg(&cluster->lock, 0, -1) == 0);
 }
 
 void dio_clu_write_unlock(struct dio_cluster *cluster)
 {
-	up_write(&cluster->rw_lock);
+	NKFS_BUG_ON(atomic_read(&cluster->lock) != -1);
+	atomic_set(&cluster->lock, 0);
+	dio_clu_lock_wake(cluster);
 }
 
 void dio_clu_read_lock(struct dio_cluster *cluster)
 {
-	down_read(&cluster->rw_lock);
+	might_sleep();
+	wait_event(*dio_clu_lock_wq(cluster),
+		   atomic_add_unless(&cluster->lock, 1, -1));
+}
+
+void dio_clu_read_unlock(struct dio_cluster *cluster)
+{
+	NKFS_BUG_ON(atomic_read(&cluster->lock) <= 0);
+	if (atomic_dec_return(&cluster->lock) == 0)
+		dio_clu_lock_wake(cluster);
+}
+
+int dio_clu_read(struct dio_cluster *cluster,
+	void *buf, unsigned long len, unsigned long off)
+{
+	int err;
+
+	NKFS_BUG_ON((off + len) > dio_clu_size(cluster));
+
+	if (!test_bit(DIO_CLU_READ, &cluster->flags)) {
+		err = dio_clu_wait_read(cluster);
+		if (err)
+			goto out;
+	}
+
+	dio_clu_read_lock(cluster);
+	dio_buf_io(cluster->buf, buf, off, len, 0, NULL);
+	dio_clu_read_unlock(cluster);
+
+	err = 0;
+out:
+	return err;
+}
+
+/*
+ * Digest cache of cluster, allocated for data clusters only. Returns
+ * NULL if there is none, then digest is just not cached.
+ */
+static struct dio_clu_sum *dio_clu_sum_get(struct dio_cluster *cluster)
+{
+	struct dio_clu_sum *sum, *old;
+
+	sum = dio_clu_sum_peek(cluster);
+	if (sum || cluster->class != DIO_CLASS_DATA)
+		return sum;
+
+	sum = kmem_cache_alloc_node(dio_sum_cachep, GFP_NOIO | __GFP_NOWARN,
+				    dio_clu_node(cluster->dev, cluster->class));
+	if (!sum)
+		return NULL;
+
+	memset(sum, 0, sizeof(*sum));
+	spin_lock_init(&sum->lock);
+	sum->gen = 1;
+	sum->pos = DIO_CLU_SUM_INV;
+
+	old = (struct dio_clu_sum *)cmpxchg(dio_clu_sum_slot(cluster), 0UL,
+					     (unsigned long)sum);
+	if (old) {
+		kmem_cache_free(dio_sum_cachep, sum);
+		sum = old;
+	} else {
+		atomic_long_inc(&cluster->dev->nr_sums);
+	}
+
+	return sum;
 }
 
-void dio_clu_read_unlock(struct dio_cluster *cluster)
-{
-	up_read(&cluster->rw_lock);
+static int dio_clu_sum_cached(struct dio_cluster *cluster, struct csum *csum)
+{
+	struct dio_clu_sum *sum = dio_clu_sum_peek(cluster);
+	int cached;
+
+	if (!sum)
+		return 0;
+
+	spin_lock(&sum->lock);
+	cached = (sum->sum_gen == sum->gen);
+	if (cached)
+		*csum = sum->sum;
+	spin_unlock(&sum->lock);
+
+	return cached;
+}
+
+static void dio_clu_sum_cache(struct dio_clu_sum *sum, struct csum *csum,
+			      unsigned long gen)
+{
+	spin_lock(&sum->lock);
+	if (sum->gen == gen) {
+		sum->sum = *csum;
+		sum->sum_gen = gen;
+	}
+	spin_unlock(&sum->lock);
+}
+
+/*
+ * Modification outside of dio_clu_write() (e.g. through dio_clu_map()),
+ * drop cached digest and running write digest.
+ */
+static void dio_clu_sum_inv(struct dio_cluster *cluster)
+{
+	struct dio_clu_sum *sum = dio_clu_sum_peek(cluster);
+
+	if (!sum)
+		return;
+
+	spin_lock(&sum->lock);
+	sum->gen++;
+	sum->pos = DIO_CLU_SUM_INV;
+	spin_unlock(&sum->lock);
+}
+
+/*
+ * Digest of whole cluster. Rehashes only what isn't covered by cached
+ * digest or by running digest of sequential writes.
+ * Called with cluster read locked.
+ */
+static void __dio_clu_sum(struct dio_cluster *cluster, struct csum *csum,
+			  void *buf, unsigned long len, unsigned long off)
+{
+	struct dio_clu_sum *sum = dio_clu_sum_get(cluster);
+	struct csum_ctx ctx;
+	unsigned long gen = 0, pos = 0;
+
+	if (sum) {
+		spin_lock(&sum->lock);
+		gen = sum->gen;
+		pos = sum->pos;
+		if (pos != DIO_CLU_SUM_INV && !(buf && off < pos))
+			memcpy(&ctx, &sum->ctx, sizeof(ctx));
+		else
+			pos = 0;
+		spin_unlock(&sum->lock);
+	}
+
+	if (pos == 0)
+		csum_reset(&ctx);
+	dio_buf_hash(cluster->buf, &ctx, pos, dio_clu_size(cluster),
+		     buf, off, off + len);
+	csum_digest(&ctx, csum);
+
+	if (sum)
+		dio_clu_sum_cache(sum, csum, gen);
 }
 
-int dio_clu_read(struct dio_cluster *cluster,
-	void *buf, unsigned long len, unsigned long off)
+/*
+ * Read data and get digest of whole cluster. Data is copied out while
+ * it is hashed, if digest is cached just copy.
+ */
+int dio_clu_read_sum(struct dio_cluster *cluster,
+	void *buf, unsigned long len, unsigned long off, struct csum *sum)
 {
 	int err;
 
-	NKFS_BUG_ON((off + len) > cluster->clu_size);
+	NKFS_BUG_ON((off + len) > dio_clu_size(cluster));
 
 	if (!test_bit(DIO_CLU_READ, &cluster->flags)) {
 		err = dio_clu_wait_read(cluster);
 		if (err)
-			goto out;
+			return err;
 	}
 
-	down_read(&cluster->rw_lock);
-	dio_pages_io(&cluster->pages, buf, off, len, 0);
-	up_read(&cluster->rw_lock);
+	dio_clu_read_lock(cluster);
+	if (dio_clu_sum_cached(cluster, sum))
+		dio_buf_io(cluster->buf, buf, off, len, 0, NULL);
+	else
+		__dio_clu_sum(cluster, sum, buf, len, off);
+	dio_clu_read_unlock(cluster);
 
-	err = 0;
-out:
-	return err;
+	return 0;
+}
+
+struct dio_cluster *dio_clu_get(struct dio_dev *dev, u64 index, int class)
+{
+	struct dio_cluster *clu;
+
+	clu  = __dio_clu_get(dev, index, class, 0);
+	if (!clu)
+		return NULL;
+
+	if (!test_bit(DIO_CLU_READ, &clu->flags)) {
+		int err;
+
+		err = dio_clu_wait_read(clu);
+		if (err) {
+			dio_clu_put(clu);
+			clu = NULL;
+		}
+	}
+
+	return clu;
 }
 
-struct dio_cluster *dio_clu_get(struct dio_dev *dev, u64 index)
+/*
+ * Get cluster which is going to be overwritten completely, e.g. just
+ * allocated block. If cluster isn't cached it is zeroed instead of
+ * read from disk.
+ */
+struct dio_cluster *dio_clu_get_new(struct dio_dev *dev, u64 index,
+				    int class)
 {
 	struct dio_cluster *clu;
 
-	clu  = __dio_clu_get(dev, index);
+	clu = __dio_clu_get(dev, index, class, 0);
 	if (!clu)
 		return NULL;
 
 	if (!test_bit(DIO_CLU_READ, &clu->flags)) {
 		int err;
 
+		if (!test_and_set_bit(DIO_CLU_READ_START, &clu->flags)) {
+			memset(clu->buf, 0, dio_clu_size(clu));
+			dio_clu_end_read(clu, 0);
+		}
+
 		err = dio_clu_wait_read(clu);
 		if (err) {
 			dio_clu_put(clu);
@@ -681,14 +2188,77 @@ struct dio_cluster *dio_clu_get(struct dio_dev *dev, u64 index)
 
 char *dio_clu_map(struct dio_cluster *cluster, unsigned long off)
 {
-	unsigned long pg_idx;
-	unsigned long pg_off;
+	NKFS_BUG_ON(off > dio_clu_size(cluster));
+	return cluster->buf + off;
+}
+
+/*
+ * Cluster buffer mapped by dio_clu_map() is modified in place between
+ * dio_clu_modify_begin() and dio_clu_modify_end(). Writeback doesn't
+ * start meanwhile, so half modified buffer never reaches the disk, and
+ * commits of the cluster wait for dio_clu_modify_end(). Modifier must
+ * not sync the cluster before dio_clu_modify_end().
+ */
+void dio_clu_modify_begin(struct dio_cluster *cluster)
+{
+	NKFS_BUG_ON(!test_bit(DIO_CLU_READ, &cluster->flags));
+
+	dio_clu_sync_lock(cluster);
+	/* Don't modify pages while they are under write bio */
+	wait_on_bit(&cluster->flags, DIO_CLU_WB, TASK_UNINTERRUPTIBLE);
+	NKFS_BUG_ON(test_and_set_bit(DIO_CLU_MODIFY, &cluster->flags));
+	dio_clu_sync_unlock(cluster);
+}
+
+/* Whole cluster becomes dirty */
+void dio_clu_modify_end(struct dio_cluster *cluster)
+{
+	dio_clu_sum_inv(cluster);
+
+	dio_clu_sync_lock(cluster);
+	NKFS_BUG_ON(!test_bit(DIO_CLU_MODIFY, &cluster->flags));
+	dio_clu_mark_dirty(cluster, dio_clu_pages_all(cluster));
+	clear_bit_unlock(DIO_CLU_MODIFY, &cluster->flags);
+	dio_clu_sync_unlock(cluster);
+	/* Commits wait for the end of modification */
+	smp_mb__after_atomic();
+	wake_up_bit(&cluster->flags, DIO_CLU_MODIFY);
+}
+
+/*
+ * Copy buf into cluster, writes from offset 0 on keep running digest
+ * of data cluster.
+ */
+static void dio_clu_write_buf(struct dio_cluster *cluster,
+	void *buf, unsigned long len, unsigned long off)
+{
+	struct dio_clu_sum *sum;
+
+	sum = (off == 0) ? dio_clu_sum_get(cluster) : dio_clu_sum_peek(cluster);
+	if (!sum) {
+		dio_buf_io(cluster->buf, buf, off, len, 1, NULL);
+		return;
+	}
 
-	NKFS_BUG_ON(off > cluster->clu_size);
-	pg_idx = off >> PAGE_SHIFT;
-	pg_off = off & (PAGE_SIZE - 1);
-	NKFS_BUG_ON(pg_idx >= cluster->pages.nr_pages);
-	return ((char *)page_address(cluster->pages.pages[pg_idx]) + pg_off);
+	spin_lock(&sum->lock);
+	sum->gen++;
+	if (off == 0) {
+		csum_reset(&sum->ctx);
+		sum->pos = 0;
+	}
+	if (sum->pos == off) {
+		/* Sequential write, keep digest running */
+		spin_unlock(&sum->lock);
+		dio_buf_io(cluster->buf, buf, off, len, 1, &sum->ctx);
+		spin_lock(&sum->lock);
+		if (sum->pos == off)
+			sum->pos = off + len;
+		spin_unlock(&sum->lock);
+	} else {
+		sum->pos = DIO_CLU_SUM_INV;
+		spin_unlock(&sum->lock);
+		dio_buf_io(cluster->buf, buf, off, len, 1, NULL);
+	}
 }
 
 int dio_clu_write(struct dio_cluster *cluster,
@@ -696,9 +2266,9 @@ int dio_clu_write(struct dio_cluster *cluster,
 {
 	int err;
 
-	down_read(&cluster->sync_rw_lock);
+	dio_clu_sync_lock(cluster);
 
-	NKFS_BUG_ON((off + len) > cluster->clu_size);
+	NKFS_BUG_ON((off + len) > dio_clu_size(cluster));
 	if (!test_bit(DIO_CLU_READ, &cluster->flags)) {
 		err = dio_clu_wait_read(cluster);
 		if (err)
@@ -707,15 +2277,18 @@ int dio_clu_write(struct dio_cluster *cluster,
 
 	NKFS_BUG_ON(!test_bit(DIO_CLU_READ, &cluster->flags));
 
-	down_write(&cluster->rw_lock);
-	set_bit(DIO_CLU_DIRTY, &cluster->flags);
-	dio_pages_io(&cluster->pages, buf, off, len, 1);
-	up_write(&cluster->rw_lock);
+	/* Don't modify pages while they are under write bio */
+	wait_on_bit(&cluster->flags, DIO_CLU_WB, TASK_UNINTERRUPTIBLE);
+
+	dio_clu_write_lock(cluster);
+	dio_clu_write_buf(cluster, buf, len, off);
+	dio_clu_mark_dirty(cluster, dio_clu_pages_mask(cluster, off, len));
+	dio_clu_write_unlock(cluster);
 
 	err = 0;
 
 out:
-	up_read(&cluster->sync_rw_lock);
+	dio_clu_sync_unlock(cluster);
 
 	return err;
 }
@@ -733,7 +2306,7 @@ int dio_clu_zero(struct dio_cluster *cluster)
 
 	memset(page_address(page), 0, PAGE_SIZE);
 	off = 0;
-	for (i = 0; i < cluster->pages.nr_pages; i++) {
+	for (i = 0; i < dio_clu_nr_pages(cluster); i++) {
 		err = dio_clu_write(cluster, page_address(page),
 			PAGE_SIZE, off);
 		if (err)
@@ -749,211 +2322,598 @@ out:
 
 void dio_clu_set_dirty(struct dio_cluster *cluster)
 {
-	down_read(&cluster->sync_rw_lock);
-	set_bit(DIO_CLU_DIRTY, &cluster->flags);
-	up_read(&cluster->sync_rw_lock);
+	dio_clu_set_dirty_range(cluster, 0, dio_clu_size(cluster));
 }
 
-int dio_clu_sync(struct dio_cluster *cluster)
+/*
+ * Only pages covering [off, off + len) are written back.
+ */
+void dio_clu_set_dirty_range(struct dio_cluster *cluster,
+	unsigned long off, unsigned long len)
 {
-	int err;
-	struct dio_io *io;
+	dio_clu_sum_inv(cluster);
 
-	trace_dio_clu_sync(cluster);
+	dio_clu_sync_lock(cluster);
+	dio_clu_mark_dirty(cluster, dio_clu_pages_mask(cluster, off, len));
+	dio_clu_sync_unlock(cluster);
+}
 
-	if (!test_bit(DIO_CLU_DIRTY, &cluster->flags))
+static int dio_clu_cmp(const void *a, const void *b)
+{
+	struct dio_cluster *clu_a = *((struct dio_cluster **)a);
+	struct dio_cluster *clu_b = *((struct dio_cluster **)b);
+
+	if (clu_a->index > clu_b->index)
+		return 1;
+	else if (clu_a->index < clu_b->index)
+		return -1;
+	else
 		return 0;
+}
 
-	down_write(&cluster->sync_rw_lock);
-	if (!test_bit(DIO_CLU_DIRTY, &cluster->flags)) {
-		err = 0;
-		goto out;
-	}
+static void dio_clu_ptr_swap(void *a, void *b, int size)
+{
+	struct dio_cluster **node_a = a;
+	struct dio_cluster **node_b = b;
+	struct dio_cluster *tmp;
 
-	io = dio_io_alloc(cluster);
-	if (!io) {
-		err = -ENOMEM;
-		goto out;
-	}
+	tmp = *node_a;
+	*node_a = *node_b;
+	*node_b = tmp;
+}
 
-	set_bit(DIO_IO_WAIT, &io->flags);
-	dio_submit(WRITE, io);
-	wait_for_completion(&io->comp);
+/*
+ * Group commit request, lives on the stack of dio_clus_sync() caller.
+ */
+struct dio_commit {
+	struct list_head	list;
+	struct dio_cluster	**clus;
+	int			nr_clus;
+	struct completion	comp;
+	int			done;
+	int			err;
+};
+
+/*
+ * Clusters of all requests of the batch sorted, so every cluster is
+ * started once and adjacent ones of different requests are merged.
+ * Returns number of clusters, array is allocated only if it isn't 0.
+ */
+static int dio_commit_batch_clus(struct list_head *batch,
+				 struct dio_cluster ***pclus)
+{
+	struct dio_commit *commit;
+	struct dio_cluster **clus;
+	int nr_clus = 0;
+
+	*pclus = NULL;
+	list_for_each_entry(commit, batch, list)
+		nr_clus += commit->nr_clus;
+	if (!nr_clus)
+		return 0;
 
-	err = io->err;
-	if (!err)
-		clear_bit(DIO_CLU_DIRTY, &cluster->flags);
+	clus = crt_kmalloc(nr_clus * sizeof(clus[0]), GFP_NOIO);
+	if (!clus)
+		return -ENOMEM;
 
-	dio_io_deref(io);
-out:
-	up_write(&cluster->sync_rw_lock);
+	nr_clus = 0;
+	list_for_each_entry(commit, batch, list) {
+		memcpy(&clus[nr_clus], commit->clus,
+		       commit->nr_clus * sizeof(clus[0]));
+		nr_clus += commit->nr_clus;
+	}
+
+	sort(clus, nr_clus, sizeof(struct dio_cluster *),
+	     dio_clu_cmp, dio_clu_ptr_swap);
+	*pclus = clus;
+	return nr_clus;
+}
+
+/*
+ * Write cluster without group commit and flush of device cache, so
+ * reclaim doesn't wait for other committers. Cluster taken out of the
+ * tree isn't pinned, so it can't be under modification.
+ */
+static int dio_clu_write_back(struct dio_cluster *cluster)
+{
+	struct dio_wb wb;
+	int err;
 
+	dio_wb_start(&wb, cluster->dev);
+	if (dio_clu_start_wb(cluster) > 0)
+		dio_wb_add(&wb, cluster);
+	err = dio_wb_finish(&wb);
 	if (err)
-		nkfs_error(err, "Can't sync cluster %llu", cluster->index);
+		nkfs_error(err, "Can't write back cluster %llu",
+			   (unsigned long long)cluster->index);
 
 	return err;
 }
 
-static void dio_clu_free(struct dio_cluster *cluster)
+/*
+ * Write cluster at durability point. Cluster modified by someone else
+ * is written once modification ends, as changes made before could
+ * already be acknowledged. Modifier could wait for writeback of
+ * clusters held by unsubmitted write, so it is submitted first.
+ */
+static void dio_wb_add_dirty(struct dio_wb *wb, struct dio_cluster *cluster)
 {
-	dio_pages_free(&cluster->pages);
-	crt_kfree(cluster);
+	int started;
+
+	while ((started = dio_clu_start_wb(cluster)) == -EBUSY) {
+		dio_wb_submit(wb);
+		wait_on_bit(&cluster->flags, DIO_CLU_MODIFY,
+			    TASK_UNINTERRUPTIBLE);
+	}
+	if (started)
+		dio_wb_add(wb, cluster);
 }
 
-static void dio_clu_release(struct dio_cluster *cluster)
+static void dio_commit_start_wb(struct dio_wb *wb, struct dio_cluster **clus,
+				int nr_clus)
 {
-	set_bit(DIO_CLU_RELS, &cluster->flags);
-	if (test_bit(DIO_CLU_DIRTY, &cluster->flags))
-		dio_clu_sync(cluster);
-	dio_clu_free(cluster);
+	int i;
+
+	for (i = 0; i < nr_clus; i++) {
+		trace_dio_clu_sync(clus[i]);
+		NKFS_BUG_ON(clus[i]->dev != wb->dev);
+		if (i && clus[i] == clus[i-1])
+			continue;
+		dio_wb_add_dirty(wb, clus[i]);
+	}
 }
 
-static void dio_clu_ref(struct dio_cluster *cluster)
+/*
+ * Write clusters of all requests of the batch, then flush device
+ * cache once for all of them. Requests can share clusters, cluster
+ * already added to unsubmitted write must not be waited for.
+ */
+static int dio_commit_batch(struct dio_dev *dev, struct list_head *batch)
 {
-	NKFS_BUG_ON(atomic_read(&cluster->ref) <= 0);
-	atomic_inc(&cluster->ref);
+	struct dio_commit *commit;
+	struct dio_cluster **clus;
+	struct dio_wb wb;
+	int nr_clus, err;
+
+	dio_wb_start(&wb, dev);
+	wb.poll = 1;
+	nr_clus = dio_commit_batch_clus(batch, &clus);
+	if (nr_clus > 0) {
+		dio_commit_start_wb(&wb, clus, nr_clus);
+		crt_kfree(clus);
+	} else if (nr_clus < 0) {
+		/* No memory, submit writes of previous requests first */
+		list_for_each_entry(commit, batch, list) {
+			dio_wb_submit(&wb);
+			dio_commit_start_wb(&wb, commit->clus,
+					    commit->nr_clus);
+		}
+	}
+	err = dio_wb_finish(&wb);
+	if (err)
+		return err;
+
+	err = blkdev_issue_flush(dev->bdev, GFP_NOIO, NULL);
+	if (err)
+		nkfs_error(err, "Can't flush dev %p", dev);
+
+	return err;
 }
 
-static void dio_clu_deref(struct dio_cluster *cluster)
+/*
+ * Make clusters durable. Concurrent callers queue their requests on
+ * dev->commit_list, the first one becomes leader and commits everything
+ * queued so far as one batch. Requests queued meanwhile are handed to
+ * the next leader, so single flush covers whole group of callers.
+ */
+static int dio_dev_commit(struct dio_dev *dev, struct dio_cluster **clus,
+			  int nr_clus)
 {
-	NKFS_BUG_ON(atomic_read(&cluster->ref) <= 0);
-	if (atomic_dec_and_test(&cluster->ref))
-		dio_clu_release(cluster);
+	struct dio_commit commit, *pos, *tmp;
+	unsigned int batch_us;
+	LIST_HEAD(batch);
+	int err;
+
+	memset(&commit, 0, sizeof(commit));
+	commit.clus = clus;
+	commit.nr_clus = nr_clus;
+	init_completion(&commit.comp);
+
+	spin_lock(&dev->commit_lock);
+	list_add_tail(&commit.list, &dev->commit_list);
+	if (dev->committing) {
+		spin_unlock(&dev->commit_lock);
+		wait_for_completion(&commit.comp);
+		if (commit.done)
+			return commit.err;
+		/* Leadership was handed to us */
+		spin_lock(&dev->commit_lock);
+	}
+	dev->committing = 1;
+	spin_unlock(&dev->commit_lock);
+
+	batch_us = READ_ONCE(dio_commit_batch_us);
+	if (batch_us)
+		usleep_range(batch_us, 2 * batch_us);
+
+	spin_lock(&dev->commit_lock);
+	list_splice_init(&dev->commit_list, &batch);
+	spin_unlock(&dev->commit_lock);
+
+	err = dio_commit_batch(dev, &batch);
+
+	list_for_each_entry_safe(pos, tmp, &batch, list) {
+		list_del_init(&pos->list);
+		pos->err = err;
+		pos->done = 1;
+		if (pos != &commit)
+			complete(&pos->comp);
+	}
+
+	spin_lock(&dev->commit_lock);
+	pos = list_first_entry_or_null(&dev->commit_list, struct dio_commit,
+				       list);
+	if (pos)
+		complete(&pos->comp);
+	else
+		dev->committing = 0;
+	spin_unlock(&dev->commit_lock);
+
+	return commit.err;
 }
 
-void dio_dev_ref(struct dio_dev *dev)
+/*
+ * Write dirty clusters of the same device, merging adjacent ones,
+ * and flush device cache. Array is sorted in place.
+ */
+int dio_clus_sync(struct dio_cluster **clus, int nr_clus)
 {
-	NKFS_BUG_ON(atomic_read(&dev->ref) <= 0);
-	atomic_inc(&dev->ref);
+	int err;
+
+	if (nr_clus <= 0)
+		return 0;
+
+	sort(clus, nr_clus, sizeof(struct dio_cluster *),
+	     dio_clu_cmp, dio_clu_ptr_swap);
+
+	err = dio_dev_commit(clus[0]->dev, clus, nr_clus);
+	if (err)
+		nkfs_error(err, "Can't sync %d clusters", nr_clus);
+
+	return err;
 }
 
-void dio_dev_deref(struct dio_dev *dev)
+int dio_clu_sync(struct dio_cluster *cluster)
 {
-	NKFS_BUG_ON(atomic_read(&dev->ref) <= 0);
-	if (atomic_dec_and_test(&dev->ref))
-		dio_dev_release(dev);
+	return dio_clus_sync(&cluster, 1);
 }
 
-static void dio_clu_age(struct dio_cluster *cluster)
+/*
+ * Write dirty clusters only in write-through mode, otherwise leave
+ * them to flusher and dio_dev_sync() at durability points.
+ */
+int dio_clu_commit(struct dio_cluster *cluster)
 {
-	down_read(&cluster->dev->age_rw_lock);
-	cluster->age = cluster->age >> 1;
-	up_read(&cluster->dev->age_rw_lock);
+	if (dio_writeback)
+		return 0;
+
+	return dio_clu_sync(cluster);
 }
 
-void dio_clu_sum(struct dio_cluster *cluster, struct csum *sum)
+int dio_clus_commit(struct dio_cluster **clus, int nr_clus)
+{
+	if (dio_writeback)
+		return 0;
+
+	return dio_clus_sync(clus, nr_clus);
+}
+
+static int dio_clu_expired(struct dio_cluster *cluster)
 {
-	dio_pages_sum(&cluster->pages, sum);
+	return dio_clu_age(cluster) >=
+	       msecs_to_jiffies(READ_ONCE(dio_dirty_expire_ms));
 }
 
-static void dio_clus_age(struct dio_dev *dev)
+/*
+ * Add dirty clusters of the shard to writeback in ascending order,
+ * if expired_only is set skip clusters dirtied recently.
+ */
+static void dio_shard_sync(struct dio_shard *shard, struct dio_wb *wb,
+			   int expired_only)
 {
 	struct dio_cluster *batch[16];
 	int nr_found;
 	unsigned long index, first_index = 0;
-	struct dio_cluster *node;
+	struct dio_cluster *cluster;
 
 	for (;;) {
 		rcu_read_lock();
-		nr_found = radix_tree_gang_lookup(&dev->clus_root,
-				(void **)batch, first_index, ARRAY_SIZE(batch));
+		nr_found = radix_tree_gang_lookup_tag(&shard->root,
+				(void **)batch, first_index, ARRAY_SIZE(batch),
+				DIO_TAG_DIRTY);
 		for (index = 0; index < nr_found; index++) {
-			node = batch[index];
-			dio_clu_ref(node);
-			if (node->index >= first_index)
-				first_index = node->index + 1;
+			cluster = batch[index];
+			if (cluster->index >= first_index)
+				first_index = cluster->index + 1;
+			if (!dio_clu_tryref(cluster))
+				batch[index] = NULL;
 		}
 		rcu_read_unlock();
 		if (nr_found == 0)
 			break;
 
 		for (index = 0; index < nr_found; index++) {
-			node = batch[index];
-			dio_clu_age(node);
-			dio_clu_deref(node);
+			cluster = batch[index];
+			if (!cluster)
+				continue;
+			if (expired_only && !dio_clu_expired(cluster)) {
+				dio_clu_deref(cluster);
+				continue;
+			}
+			if (!expired_only)
+				dio_wb_add_dirty(wb, cluster);
+			else if (dio_clu_start_wb(cluster) > 0)
+				dio_wb_add(wb, cluster); /* busy one waits */
+			dio_clu_deref(cluster);
 		}
 	}
 }
 
-static void dio_clus_age_work(struct work_struct *work)
+/*
+ * Write dirty clusters of the device. Shards cover interleaved ranges
+ * of DIO_SHARD_CLUS clusters, adjacent clusters within a range are
+ * merged and block layer plug sorts the rest.
+ */
+static int __dio_dev_sync(struct dio_dev *dev, int expired_only)
 {
-	struct dio_dev *dev, *next;
+	struct dio_wb wb;
+	int i, err;
 
-	mutex_lock(&dio_dev_list_lock);
-	list_for_each_entry_safe(dev, next, &dio_dev_list, list) {
-		dio_clus_age(dev);
-	}
-	mutex_unlock(&dio_dev_list_lock);
-	crt_kfree(work);
+	dio_wb_start(&wb, dev);
+	for (i = 0; i < DIO_NR_SHARDS; i++)
+		dio_shard_sync(&dev->shards[i], &wb, expired_only);
+	err = dio_wb_finish(&wb);
+	if (err)
+		nkfs_error(err, "Can't sync dev %p", dev);
+
+	return err;
 }
 
-static void dio_clus_shrink_work(struct work_struct *work)
+int dio_dev_sync(struct dio_dev *dev)
 {
-	struct dio_dev *dev, *next;
+	int err;
 
-	mutex_lock(&dio_dev_list_lock);
-	list_for_each_entry_safe(dev, next, &dio_dev_list, list) {
-		dio_clus_shrink(dev);
+	err = __dio_dev_sync(dev, 0);
+	if (err)
+		return err;
+
+	return dio_dev_commit(dev, NULL, 0);
+}
+
+/*
+ * Write-back mode flusher: write expired clusters every
+ * dio_flush_interval_ms, everything when dirty ratio is exceeded.
+ */
+static int dio_dev_flusher_routine(void *data)
+{
+	struct dio_dev *dev = data;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible_timeout(dev->flush_wait,
+			dio_dev_over_dirty(dev) || kthread_should_stop(),
+			msecs_to_jiffies(READ_ONCE(dio_flush_interval_ms)));
+		if (kthread_should_stop())
+			break;
+
+		if (atomic_long_read(&dev->nr_dirty) == 0)
+			continue;
+
+		__dio_dev_sync(dev, !dio_dev_over_dirty(dev));
 	}
-	mutex_unlock(&dio_dev_list_lock);
-	crt_kfree(work);
+
+	return 0;
+}
+
+static void dio_clu_free_desc(struct dio_cluster *cluster)
+{
+	kmem_cache_free(dio_clu_cachep, cluster);
 }
 
-static int dio_queue_work(work_func_t func)
+static void dio_clus_free_work_func(struct work_struct *work)
 {
-	struct work_struct *work = NULL;
+	struct dio_cluster *cluster, *next;
+	struct llist_node *list;
 
-	work = crt_kmalloc(sizeof(*work), GFP_ATOMIC);
-	if (!work) {
-		return -ENOMEM;
+	list = llist_del_all(&dio_clus_free_list);
+	llist_for_each_entry_safe(cluster, next, list, free_link) {
+		dio_buf_free_vmapped(cluster);
+		dio_clu_free_desc(cluster);
 	}
+}
 
-	INIT_WORK(work, func);
-	if (!queue_work(dio_wq, work)) {
-		crt_kfree(work);
-		return -ENOMEM;
+static void dio_clu_free_rcu(struct rcu_head *head)
+{
+	struct dio_cluster *cluster = container_of(head, struct dio_cluster,
+						   rcu);
+
+	if (test_bit(DIO_CLU_VMAP, &cluster->flags)) {
+		/* vunmap() can't be called from softirq */
+		if (llist_add(&cluster->free_link, &dio_clus_free_list))
+			schedule_work(&dio_clus_free_work);
+		return;
 	}
-	return 0;
+
+	dio_buf_free(cluster);
+	dio_clu_free_desc(cluster);
+}
+
+/*
+ * Wait until all clusters released so far are really freed.
+ */
+static void dio_clus_free_wait(void)
+{
+	rcu_barrier();
+	flush_work(&dio_clus_free_work);
+}
+
+static void dio_clu_free(struct dio_cluster *cluster)
+{
+	/* Lockless lookups could still look at the cluster */
+	call_rcu(&cluster->rcu, dio_clu_free_rcu);
+}
+
+/*
+ * Dirty clusters are written by eviction and dio_shard_release() while
+ * they are still referenced, ref can't be raised from 0 here since
+ * lockless lookups could take it. Cluster dirty at this point had its
+ * last write failed.
+ */
+static void dio_clu_release(struct dio_cluster *cluster)
+{
+	set_bit(DIO_CLU_RELS, &cluster->flags);
+	if (test_bit(DIO_CLU_DIRTY, &cluster->flags))
+		nkfs_error(-EIO, "cluster %llu dropped dirty",
+			   (unsigned long long)cluster->index);
+	dio_clu_free(cluster);
+}
+
+static void dio_clu_ref(struct dio_cluster *cluster)
+{
+	NKFS_BUG_ON(atomic_read(&cluster->ref) <= 0);
+	atomic_inc(&cluster->ref);
+}
+
+/*
+ * Take reference of cluster found by lockless lookup,
+ * fails if cluster is being released.
+ */
+static int dio_clu_tryref(struct dio_cluster *cluster)
+{
+	return atomic_inc_not_zero(&cluster->ref);
+}
+
+static void dio_clu_deref(struct dio_cluster *cluster)
+{
+	NKFS_BUG_ON(atomic_read(&cluster->ref) <= 0);
+	if (atomic_dec_and_test(&cluster->ref))
+		dio_clu_release(cluster);
+}
+
+void dio_dev_ref(struct dio_dev *dev)
+{
+	NKFS_BUG_ON(atomic_read(&dev->ref) <= 0);
+	atomic_inc(&dev->ref);
+}
+
+void dio_dev_deref(struct dio_dev *dev)
+{
+	NKFS_BUG_ON(atomic_read(&dev->ref) <= 0);
+	if (atomic_dec_and_test(&dev->ref))
+		dio_dev_release(dev);
+}
+
+void dio_clu_sum(struct dio_cluster *cluster, struct csum *sum)
+{
+	dio_clu_read_lock(cluster);
+	if (!dio_clu_sum_cached(cluster, sum))
+		__dio_clu_sum(cluster, sum, NULL, 0, 0);
+	dio_clu_read_unlock(cluster);
+}
+
+static unsigned long dio_shrink_count(struct shrinker *shrinker,
+				      struct shrink_control *sc)
+{
+	struct dio_dev *dev;
+	unsigned long count = 0, nr_min;
+
+	if (!mutex_trylock(&dio_dev_list_lock))
+		return 0;
+
+	list_for_each_entry(dev, &dio_dev_list, list) {
+		nr_min = dio_dev_min_clus(dev);
+		if (dev->nr_clus > nr_min)
+			count += dev->nr_clus - nr_min;
+	}
+	mutex_unlock(&dio_dev_list_lock);
+
+	return count;
 }
 
-static void dio_timer_callback(unsigned long data)
+static unsigned long dio_shrink_scan(struct shrinker *shrinker,
+				     struct shrink_control *sc)
 {
-	dio_queue_work(dio_clus_age_work);
-	dio_queue_work(dio_clus_shrink_work);
+	struct dio_dev *dev;
+	unsigned long freed = 0, nr_min, nr_target;
+
+	if (!mutex_trylock(&dio_dev_list_lock))
+		return SHRINK_STOP;
+
+	list_for_each_entry(dev, &dio_dev_list, list) {
+		if (freed >= sc->nr_to_scan)
+			break;
+
+		nr_min = dio_dev_min_clus(dev);
+		if (dev->nr_clus <= nr_min)
+			continue;
+
+		nr_target = dev->nr_clus - min(dev->nr_clus - nr_min,
+					       sc->nr_to_scan - freed);
+		freed += dio_dev_reclaim(dev, nr_target,
+					 2 * (dev->nr_clus - nr_target));
+	}
+	mutex_unlock(&dio_dev_list_lock);
 
-	mod_timer(&dio_timer,
-			jiffies +
-			msecs_to_jiffies(DIO_TIMER_TIMEOUT_MSECS));
+	return freed;
 }
 
+static struct shrinker dio_shrinker = {
+	.count_objects = dio_shrink_count,
+	.scan_objects = dio_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
 int dio_init(void)
 {
 	int err;
 
-	dio_wq = alloc_workqueue("dio_wq", WQ_UNBOUND, 1);
-	if (!dio_wq) {
+	BUILD_BUG_ON(DIO_CLU_NR_FLAGS > DIO_CLU_PAGE_SHIFT);
+	BUILD_BUG_ON(DIO_CLU_PAGE_SHIFT + DIO_CLU_MAX_PAGES > BITS_PER_LONG);
+	BUILD_BUG_ON(DIO_CLU_MAX_PAGES > 8 * sizeof(u16));
+	BUILD_BUG_ON(sizeof(struct dio_cluster) > 64);
+
+	dio_clu_cachep = kmem_cache_create("nkfs_dio_clu",
+					   sizeof(struct dio_cluster), 0,
+					   0, NULL);
+	if (!dio_clu_cachep)
+		return -ENOMEM;
+
+	dio_sum_cachep = kmem_cache_create("nkfs_dio_sum",
+					   sizeof(struct dio_clu_sum), 0,
+					   0, NULL);
+	if (!dio_sum_cachep) {
 		err = -ENOMEM;
-		goto fail;
+		goto out_clu_cache;
 	}
 
-	setup_timer(&dio_timer, dio_timer_callback, 0);
-	err = mod_timer(&dio_timer,
-			jiffies +
-			msecs_to_jiffies(DIO_TIMER_TIMEOUT_MSECS));
-	if (err) {
-		goto del_wq;
-	}
+	err = register_shrinker(&dio_shrinker);
+	if (err)
+		goto out_sum_cache;
 
+	nkfs_info("dio cluster descriptor %zu bytes, digest cache %zu bytes",
+		  sizeof(struct dio_cluster), sizeof(struct dio_clu_sum));
 	return 0;
 
-del_wq:
-	destroy_workqueue(dio_wq);
-fail:
+out_sum_cache:
+	kmem_cache_destroy(dio_sum_cachep);
+out_clu_cache:
+	kmem_cache_destroy(dio_clu_cachep);
 	return err;
 }
 
 void dio_finit(void)
 {
-	del_timer_sync(&dio_timer);
-	destroy_workqueue(dio_wq);
+	unregister_shrinker(&dio_shrinker);
+	dio_clus_free_wait();
+	kmem_cache_destroy(dio_sum_cachep);
+	kmem_cache_destroy(dio_clu_cachep);
 }
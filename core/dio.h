@@ -3,23 +3,129 @@
 
 #include <linux/radix-tree.h>
 #include <linux/rwsem.h>
+#include <linux/list.h>
+#include <linux/jiffies.h>
+#include <linux/rcupdate.h>
+#include <linux/mempool.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
+#include <linux/blkdev.h>
+#include <linux/cache.h>
+#include <linux/version.h>
 
 #include <crt/include/csum.h>
 
+/* Polled block I/O (REQ_HIPRI, blk_poll()) appeared in 4.4 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+#define DIO_BLK_POLL		1
+#else
+#define DIO_BLK_POLL		0
+typedef unsigned int blk_qc_t;
+#define BLK_QC_T_NONE		(-1U)
+#endif
+
+/* Default cache budget if dio_cache_max_mb isn't set */
+#define DIO_CACHE_RAM_PERCENT	25
+/* Default per device reserve kept under memory pressure */
+#define DIO_CACHE_MIN_MB	4
+#define DIO_DEV_MIN_CLUS	16
+
+#define DIO_GHOST_HASH_BITS	12
+/* Max count of remembered evicted indexes */
+#define DIO_GHOST_MAX		(4 << DIO_GHOST_HASH_BITS)
+/* Max count of cold/hot hand steps per reclaim call */
+#define DIO_CLOCK_SCAN_MAX	64
+/* References within this period after first access are not counted */
+#define DIO_CLU_CORREL_JIFFIES	(HZ/10)
+
+/* Write-back mode defaults, see dio_dev_flusher_routine() */
+#define DIO_DIRTY_RATIO		10
+#define DIO_DIRTY_EXPIRE_MS	5000
+#define DIO_FLUSH_INTERVAL_MS	1000
+
+struct dio_ghost {
+	struct hlist_node	hash_link;
+	struct list_head	list;
+	u64			index;
+};
+
+/* Cluster classes, each cached in its own pool of dio_dev */
+enum {
+	DIO_CLASS_META,	/* Btree nodes, inodes, bitmap and sum clusters */
+	DIO_CLASS_DATA,	/* Object data */
+	DIO_NR_CLASSES,
+};
+
+/* Default share of device cache budget for DIO_CLASS_META */
+#define DIO_META_PERCENT	25
+
+/*
+ * Cluster replacement state of one class, see dio_clock_reclaim().
+ * Protected by dio_dev->clock_lock.
+ */
+struct dio_pool {
+	struct list_head	clock_cold;
+	struct list_head	clock_hot;
+	unsigned long		nr_cold;
+	unsigned long		nr_hot;
+	unsigned long		cold_target;
+	unsigned long		nr_clus;	/* Resident clusters */
+	unsigned long		nr_max_clus;	/* Budget of the pool */
+	struct list_head	ghost_list;	/* Evicted cold indexes, FIFO */
+	unsigned long		nr_ghost;
+	struct hlist_head	ghost_hash[1 << DIO_GHOST_HASH_BITS];
+};
+
+/*
+ * Cluster index is split into DIO_NR_SHARDS radix trees, shard of
+ * cluster is chosen by range of DIO_SHARD_CLUS adjacent indexes, so
+ * merged I/O of adjacent clusters mostly stays within one shard.
+ */
+#define DIO_SHARD_BITS	4
+#define DIO_NR_SHARDS	(1 << DIO_SHARD_BITS)
+#define DIO_SHARD_SHIFT	6
+#define DIO_SHARD_CLUS	(1 << DIO_SHARD_SHIFT)
+
+struct dio_shard {
+	spinlock_t		lock;
+	struct radix_tree_root	root;
+} ____cacheline_aligned_in_smp;
+
 struct dio_dev {
 	atomic_t		ref;
-	spinlock_t		clus_lock;
-	struct radix_tree_root	clus_root;	/* Set of map nodes */
+	struct dio_shard	shards[DIO_NR_SHARDS];
+	int			node;	/* NUMA node of device queue */
+	int			poll;	/* Poll for sync metadata I/O */
 
 	unsigned long		clu_size;
+	unsigned int		clu_order;
+	mempool_t		*clu_pool;	/* Reserve of cluster buffers */
 	unsigned long		nr_clus;	/* Count of map nodes */
 	unsigned long		nr_max_clus;	/* Limit of map nodes */
 
 	/* Link to global list of different disk maps */
 	struct list_head	list;
-	/* Mutex to protect nodes ages update */
-	struct rw_semaphore	age_rw_lock;
 	struct block_device	*bdev;
+
+	spinlock_t		clock_lock;
+	struct dio_pool		pools[DIO_NR_CLASSES];
+
+	atomic_long_t		nr_sums;	/* Allocated digest caches */
+
+	/* Write-back mode state */
+	atomic_long_t		nr_dirty;
+	struct task_struct	*flusher;
+	wait_queue_head_t	flush_wait;
+
+	/* Group commit state, see dio_dev_commit() */
+	spinlock_t		commit_lock;
+	struct list_head	commit_list;
+	int			committing;
+
+	/* Ios holding clusters of device, see dio_dev_wait_ios() */
+	spinlock_t		io_lock;
+	unsigned long		nr_ios;
+	wait_queue_head_t	io_wait;
 };
 
 enum {
@@ -28,50 +134,116 @@ enum {
 	DIO_CLU_READ,
 	DIO_CLU_READ_START,
 	DIO_CLU_RELS,
+	DIO_CLU_WB,
+	DIO_CLU_REF,	/* Referenced since last clock hand pass */
+	DIO_CLU_HOT,	/* On dev->clock_hot list */
+	DIO_CLU_RA,	/* Populated by readahead, not accessed yet */
+	DIO_CLU_REMOVED,/* Deleted from shard tree */
+	DIO_CLU_READING,/* Read not finished, cleared by dio_clu_end_read() */
+	DIO_CLU_SYNC,	/* Bit lock of writers against dio_clu_start_wb() */
+	DIO_CLU_VMAP,	/* Buffer is mapped by vmap() */
+	DIO_CLU_LOCK_WAIT,/* Never set, wait key of dio_clu_read_lock() */
+	DIO_CLU_MODIFY,	/* Modified in place, see dio_clu_modify_begin() */
+	DIO_CLU_NR_FLAGS,
 };
 
+/* Radix tree tags of dio_shard->root */
+#define DIO_TAG_DIRTY	0
+
 #define DIO_CLU_MAX_PAGES 16
 
-struct dio_pages {
-	struct page	*pages[DIO_CLU_MAX_PAGES];
-	int		nr_pages;
-};
+/* Mask of dirty pages is kept in the upper bits of dio_cluster->flags */
+#define DIO_CLU_PAGE_SHIFT	16
+#define DIO_CLU_PAGES_MASK	\
+	(((1UL << DIO_CLU_MAX_PAGES) - 1) << DIO_CLU_PAGE_SHIFT)
+
+/* Count of cluster buffers reserved per device */
+#define DIO_CLU_POOL_MIN 16
+
+/* Cluster index is 32 bit, larger devices are refused */
+#define DIO_CLU_MAX_INDEX	U32_MAX
 
+/*
+ * Cluster descriptor, allocated from slab for every cached cluster, so
+ * it is kept small: state, dirty pages and lock wait keys are bits of
+ * flags, size and page array are derived from dev and buf. Digest
+ * cache of data cluster hangs off its first buffer page, see
+ * dio_clu_sum_peek(). It fits 64 bytes on 64-bit.
+ */
 struct dio_cluster {
+	unsigned long		flags;		/* DIO_CLU_* and dirty pages */
+	struct dio_dev		*dev;
+	char			*buf;		/* Whole cluster, contiguous */
+	union {
+		struct list_head	clock_list;
+		/* Cluster is off clock lists once released */
+		struct rcu_head		rcu;
+		struct llist_node	free_link;
+	};
 	atomic_t		ref;
 	atomic_t		pin_count;
-	struct dio_dev		*dev;
-	u64			index;
-	unsigned long		flags;
-	struct dio_pages	pages;
-	int			clu_size;
-	struct rw_semaphore	sync_rw_lock;
-	struct rw_semaphore	rw_lock;
-	u64			age;
-	struct completion	read_comp;
-	int			err;
+	atomic_t		lock;		/* Readers count, -1 if writer */
+	u32			index;
+	u16			wb_pages;	/* Mask of pages under WB */
+	u8			class;		/* DIO_CLASS_* */
+	s8			err;		/* Read error */
+	/*
+	 * Low 32 bits of jiffies of creation, first access after readahead
+	 * or first write, see dio_clu_age()
+	 */
+	u32			time;
 };
 
 enum {
 	DIO_IO_WAIT,
+	DIO_IO_POLL,	/* Submitted with REQ_HIPRI, see dio_poll_wait() */
 };
 
+/* Max count of adjacent clusters merged into single bio */
+#define DIO_IO_MAX_CLUS	8
+/* Max count of write bios in flight per writeback */
+#define DIO_WB_MAX_IOS	16
+
 struct dio_io {
 	atomic_t		ref;
+	struct dio_dev		*dev;	/* Set by the first cluster */
 	struct bio		*bio;
-	struct dio_cluster	*cluster;
+	struct dio_cluster	*clus[DIO_IO_MAX_CLUS];
+	int			nr_clus;
 	struct list_head	list;
 	unsigned long		flags;
 	unsigned long		rw;
 	unsigned long		bio_flags;
+	blk_qc_t		cookie;
 	struct completion	comp;
 	int			err;
 };
 
+/* Cache memory usage, see dio_dev_stats() */
+struct dio_dev_stats {
+	u64	nr_clus;	/* Cached clusters */
+	u64	buf_bytes;	/* Cluster buffers */
+	u64	desc_bytes;	/* Descriptors and digest caches */
+};
+
+/*
+ * Clusters read asynchronously, see dio_batch_add(). Array of cluster
+ * pointers is provided by caller.
+ */
+struct dio_batch {
+	struct dio_dev		*dev;
+	struct dio_cluster	**clus;
+	int			nr_clus;
+	int			max_clus;
+};
+
 int dio_init(void);
 void dio_finit(void);
 
-struct dio_cluster *dio_clu_get(struct dio_dev *dev, u64 index);
+struct dio_cluster *dio_clu_get(struct dio_dev *dev, u64 index, int class);
+
+struct dio_cluster *dio_clu_get_new(struct dio_dev *dev, u64 index,
+				    int class);
 
 void dio_clu_put(struct dio_cluster *cluster);
 
@@ -83,10 +255,46 @@ int dio_clu_write(struct dio_cluster *cluster,
 
 char *dio_clu_map(struct dio_cluster *cluster, unsigned long off);
 
+/*
+ * Writeback skips a cluster in the middle of modification only in the
+ * expired pass of the flusher, which promises no durability to anyone:
+ * the cluster stays dirty and is written by the next pass. Commits and
+ * full syncs wait for dio_clu_modify_end(), so their callers never see
+ * success for data that isn't on the disk. Modified clusters are pinned
+ * by the modifier, so reclaim doesn't see them at all.
+ */
+void dio_clu_modify_begin(struct dio_cluster *cluster);
+
+void dio_clu_modify_end(struct dio_cluster *cluster);
+
 int dio_clu_zero(struct dio_cluster *cluster);
 
 int dio_clu_sync(struct dio_cluster *cluster);
 
+int dio_clus_sync(struct dio_cluster **clus, int nr_clus);
+
+int dio_dev_sync(struct dio_dev *dev);
+
+int dio_clu_commit(struct dio_cluster *cluster);
+
+int dio_clus_commit(struct dio_cluster **clus, int nr_clus);
+
+void dio_clus_readahead(struct dio_dev *dev, u64 *indexes, int nr,
+	int class);
+
+int dio_dev_cached_indexes(struct dio_dev *dev, int class, u64 *indexes,
+	int max);
+
+void dio_dev_stats(struct dio_dev *dev, struct dio_dev_stats *stats);
+
+void dio_batch_start(struct dio_batch *batch, struct dio_dev *dev,
+	struct dio_cluster **clus, int max_clus);
+
+int dio_batch_add(struct dio_batch *batch, u64 *indexes, int nr,
+	int class);
+
+void dio_batch_end(struct dio_batch *batch);
+
 void dio_clu_write_lock(struct dio_cluster *cluster);
 
 void dio_clu_write_unlock(struct dio_cluster *cluster);
@@ -100,9 +308,15 @@ void dio_dev_deref(struct dio_dev *dev);
 
 void dio_clu_set_dirty(struct dio_cluster *cluster);
 
+void dio_clu_set_dirty_range(struct dio_cluster *cluster,
+	unsigned long off, unsigned long len);
+
 void dio_clu_sum(struct dio_cluster *cluster, struct csum *sum);
 
-struct dio_dev *dio_dev_create(struct block_device *bdev,
-	int clu_size, int nr_max_clus);
+int dio_clu_read_sum(struct dio_cluster *cluster,
+	void *buf, unsigned long len, unsigned long off, struct csum *sum);
+
+struct dio_dev *dio_dev_create(struct block_device *bdev, int clu_size,
+	int poll);
 
 #endif
@@ -32,6 +32,7 @@ static struct nkfs_inode *nkfs_inode_alloc(void)
 	memset(inode, 0, sizeof(*inode));
 	atomic_set(&inode->ref, 1);
 	init_rwsem(&inode->rw_sem);
+	spin_lock_init(&inode->ra_lock);
 	return inode;
 }
 
@@ -221,7 +222,7 @@ struct nkfs_inode *nkfs_inode_read(struct nkfs_sb *sb, u64 block)
 	inode->block = block;
 	inode->sb = sb;
 
-	clu = dio_clu_get(sb->ddev, block);
+	clu = dio_clu_get(sb->ddev, block, DIO_CLASS_META);
 	if (!clu) {
 		goto free_inode;
 	}
@@ -311,7 +312,7 @@ static int nkfs_inode_write(struct nkfs_inode *inode)
 	NKFS_BUG_ON(!inode->block);
 	NKFS_BUG_ON(!inode->sb);
 
-	clu = dio_clu_get(inode->sb->ddev, inode->block);
+	clu = dio_clu_get(inode->sb->ddev, inode->block, DIO_CLASS_META);
 	if (!clu) {
 		return -EIO;
 	}
@@ -328,7 +329,7 @@ static int nkfs_inode_write(struct nkfs_inode *inode)
 		goto cleanup;
 	}
 
-	err = dio_clu_sync(clu);
+	err = dio_clu_commit(clu);
 
 cleanup:
 	crt_kfree(idisk);
@@ -424,11 +425,12 @@ static int nkfs_inode_block_open_clus(struct nkfs_inode *inode,
 {
 	NKFS_BUG_ON(ib->clu || ib->sum_clu);
 
-	ib->clu = dio_clu_get(inode->sb->ddev, ib->block);
+	ib->clu = dio_clu_get(inode->sb->ddev, ib->block, DIO_CLASS_DATA);
 	if (!ib->clu)
 		return -EIO;
 
-	ib->sum_clu = dio_clu_get(inode->sb->ddev, ib->sum_block);
+	ib->sum_clu = dio_clu_get(inode->sb->ddev, ib->sum_block,
+				  DIO_CLASS_META);
 	if (!ib->sum_clu) {
 		dio_clu_put(ib->clu);
 		ib->clu = NULL;
@@ -454,7 +456,7 @@ static void nkfs_inode_block_zero(struct inode_block *ib)
 static int nkfs_inode_block_write(struct nkfs_inode *inode,
 		struct inode_block *ib)
 {
-	int err;
+	struct dio_cluster *clus[2];
 
 	NKFS_BUG_ON(!ib->clu || !ib->sum_clu);
 	trace_inode_write_block(inode, ib);
@@ -462,18 +464,15 @@ static int nkfs_inode_block_write(struct nkfs_inode *inode,
 	dio_clu_sum(ib->clu,
 		(struct csum *)dio_clu_map(ib->sum_clu, ib->sum_off));
 
-	dio_clu_set_dirty(ib->clu);
-	dio_clu_set_dirty(ib->sum_clu);
-
-	err = dio_clu_sync(ib->clu);
-	if (!err)
-		err = dio_clu_sync(ib->sum_clu);
+	dio_clu_set_dirty_range(ib->sum_clu, ib->sum_off, sizeof(struct csum));
 
-	return err;
+	clus[0] = ib->clu;
+	clus[1] = ib->sum_clu;
+	return dio_clus_commit(clus, ARRAY_SIZE(clus));
 }
 
 static int nkfs_inode_block_alloc(struct nkfs_inode *inode,
-	u64 vblock, struct inode_block *pib)
+	u64 vblock, struct inode_block *pib, struct nkfs_btree_trans *trans)
 {
 	int err;
 	struct inode_block ib;
@@ -494,7 +493,8 @@ static int nkfs_inode_block_alloc(struct nkfs_inode *inode,
 	nkfs_inode_block_to_sum_block(ib.vblock, inode->sb->bsize,
 		&ib.vsum_block, &ib.sum_off);
 
-	nkfs_btree_key_by_u64(ib.vsum_block, &key);
+	nkfs_btree_key_by_u64(inode->blocks_sum_tree, ib.vsum_block,
+		&key);
 	err = nkfs_btree_find_key(inode->blocks_sum_tree, &key,
 		(struct nkfs_btree_value *)&ib.sum_block);
 	if (err) {
@@ -505,9 +505,10 @@ static int nkfs_inode_block_alloc(struct nkfs_inode *inode,
 
 		sum_block_allocated = 1;
 
-		nkfs_btree_key_by_u64(ib.vsum_block, &key);
+		nkfs_btree_key_by_u64(inode->blocks_sum_tree, ib.vsum_block,
+			&key);
 		err = nkfs_btree_insert_key(inode->blocks_sum_tree, &key,
-			(struct nkfs_btree_value *)&ib.sum_block, 0);
+			(struct nkfs_btree_value *)&ib.sum_block, 0, trans);
 		if (err) {
 			goto fail;
 		}
@@ -521,9 +522,9 @@ static int nkfs_inode_block_alloc(struct nkfs_inode *inode,
 	}
 
 
-	nkfs_btree_key_by_u64(ib.vblock, &key);
+	nkfs_btree_key_by_u64(inode->blocks_tree, ib.vblock, &key);
 	err = nkfs_btree_insert_key(inode->blocks_tree, &key,
-		(struct nkfs_btree_value *)&ib.block, 0);
+		(struct nkfs_btree_value *)&ib.block, 0, trans);
 	if (err) {
 		goto fail;
 	}
@@ -533,7 +534,8 @@ static int nkfs_inode_block_alloc(struct nkfs_inode *inode,
 
 fail:
 	if (sum_block_inserted) {
-		nkfs_btree_key_by_u64(ib.vsum_block, &key);
+		nkfs_btree_key_by_u64(inode->blocks_sum_tree, ib.vsum_block,
+			&key);
 		nkfs_btree_delete_key(inode->blocks_sum_tree, &key);
 	}
 
@@ -551,7 +553,7 @@ nkfs_inode_block_erase(struct nkfs_inode *inode,
 {
 	struct nkfs_btree_key key;
 
-	nkfs_btree_key_by_u64(ib->vblock, &key);
+	nkfs_btree_key_by_u64(inode->blocks_tree, ib->vblock, &key);
 	nkfs_btree_delete_key(inode->blocks_tree, &key);
 
 	__nkfs_inode_block_free(inode, ib->block);
@@ -586,7 +588,7 @@ nkfs_inode_block_read(struct nkfs_inode *inode, u64 vblock,
 	nkfs_inode_block_zero(pib);
 
 	ib.vblock = vblock;
-	nkfs_btree_key_by_u64(ib.vblock, &key);
+	nkfs_btree_key_by_u64(inode->blocks_tree, ib.vblock, &key);
 	err = nkfs_btree_find_key(inode->blocks_tree, &key,
 		(struct nkfs_btree_value *)&ib.block);
 	if (err)
@@ -595,7 +597,8 @@ nkfs_inode_block_read(struct nkfs_inode *inode, u64 vblock,
 	nkfs_inode_block_to_sum_block(ib.vblock, inode->sb->bsize,
 		&ib.vsum_block, &ib.sum_off);
 
-	nkfs_btree_key_by_u64(ib.vsum_block, &key);
+	nkfs_btree_key_by_u64(inode->blocks_sum_tree, ib.vsum_block,
+		&key);
 	err = nkfs_btree_find_key(inode->blocks_sum_tree, &key,
 		(struct nkfs_btree_value *)&ib.sum_block);
 	if (err) {
@@ -615,7 +618,8 @@ fail:
 
 static int
 nkfs_inode_block_read_create(struct nkfs_inode *inode, u64 vblock,
-			     struct inode_block *pib)
+			     struct inode_block *pib,
+			     struct nkfs_btree_trans *trans)
 {
 	int err;
 	struct inode_block ib;
@@ -625,7 +629,7 @@ nkfs_inode_block_read_create(struct nkfs_inode *inode, u64 vblock,
 
 	err = nkfs_inode_block_read(inode, vblock, &ib);
 	if (err) {
-		err = nkfs_inode_block_alloc(inode, vblock, &ib);
+		err = nkfs_inode_block_alloc(inode, vblock, &ib, trans);
 		if (err) {
 			goto fail;
 		}
@@ -647,13 +651,212 @@ fail:
 	return err;
 }
 
+/*
+ * Add sum cluster of vblock unless it is the same as of previous block.
+ */
+static void
+nkfs_inode_blocks_lookup_sum(struct nkfs_inode *inode, u64 vb,
+			     u64 *prev_vsum_block, u64 *sums, int *pnr_sums)
+{
+	struct nkfs_btree_key key;
+	u64 block, vsum_block;
+	u32 sum_off;
+
+	nkfs_inode_block_to_sum_block(vb, inode->sb->bsize,
+		&vsum_block, &sum_off);
+	if (vsum_block == *prev_vsum_block)
+		return;
+
+	*prev_vsum_block = vsum_block;
+	nkfs_btree_key_by_u64(inode->blocks_sum_tree, vsum_block, &key);
+	if (!nkfs_btree_find_key(inode->blocks_sum_tree, &key,
+		(struct nkfs_btree_value *)&block))
+		sums[(*pnr_sums)++] = block;
+}
+
+/*
+ * Collect data clusters of nr blocks starting at vblock into blocks
+ * and their sum clusters into sums, both arrays have room for nr
+ * entries. Mapped blocks are walked by cursor of blocks tree, vblock
+ * keys are adjacent. Keys of trees of older images aren't ordered by
+ * vblock, there every block is looked up.
+ */
+static void
+nkfs_inode_blocks_lookup(struct nkfs_inode *inode, u64 vblock, u32 nr,
+			 u64 *blocks, int *pnr_blocks,
+			 u64 *sums, int *pnr_sums)
+{
+	struct nkfs_btree_cursor cur;
+	struct nkfs_btree_key key;
+	struct nkfs_btree_value value;
+	u64 vb, prev_vsum_block = U64_MAX;
+	int nr_blocks = 0, nr_sums = 0;
+	int err;
+
+	if (!nkfs_btree_u64_keys_ordered(inode->blocks_tree)) {
+		for (vb = vblock; vb < vblock + nr; vb++) {
+			nkfs_btree_key_by_u64(inode->blocks_tree, vb, &key);
+			if (nkfs_btree_find_key(inode->blocks_tree, &key,
+						&value))
+				continue;
+			blocks[nr_blocks++] = nkfs_btree_value_to_u64(&value);
+			nkfs_inode_blocks_lookup_sum(inode, vb,
+				&prev_vsum_block, sums, &nr_sums);
+		}
+		goto out;
+	}
+
+	err = nkfs_btree_cursor_open(&cur, inode->blocks_tree);
+	if (err)
+		goto out;
+
+	nkfs_btree_key_by_u64(inode->blocks_tree, vblock, &key);
+	err = nkfs_btree_cursor_seek(&cur, &key);
+	while (!err) {
+		nkfs_btree_cursor_get(&cur, &key, &value);
+		vb = nkfs_btree_key_to_u64(inode->blocks_tree, &key);
+		if (vb >= vblock + nr)
+			break;
+		blocks[nr_blocks++] = nkfs_btree_value_to_u64(&value);
+		nkfs_inode_blocks_lookup_sum(inode, vb, &prev_vsum_block,
+			sums, &nr_sums);
+
+		err = nkfs_btree_cursor_next(&cur);
+	}
+	nkfs_btree_cursor_close(&cur);
+
+out:
+	*pnr_blocks = nr_blocks;
+	*pnr_sums = nr_sums;
+}
+
+static void
+nkfs_inode_readahead_blocks(struct nkfs_inode *inode, u64 vblock, u32 nr)
+{
+	u64 *blocks;
+	int nr_blocks, nr_sums;
+
+	blocks = crt_kmalloc(2 * nr * sizeof(u64), GFP_NOIO);
+	if (!blocks)
+		return;
+
+	nkfs_inode_blocks_lookup(inode, vblock, nr, blocks, &nr_blocks,
+				 blocks + nr, &nr_sums);
+	dio_clus_readahead(inode->sb->ddev, blocks, nr_blocks,
+			   DIO_CLASS_DATA);
+	dio_clus_readahead(inode->sb->ddev, blocks + nr, nr_sums,
+			   DIO_CLASS_META);
+	crt_kfree(blocks);
+}
+
+/*
+ * Start reads of all data and sum clusters of [off, off + len) at once,
+ * so that single request keeps many reads in flight. Clusters stay
+ * pinned by the batch until nkfs_inode_read_batch_end().
+ */
+static struct dio_cluster **
+nkfs_inode_read_batch_start(struct nkfs_inode *inode, u64 off, u32 len,
+			    struct dio_batch *batch)
+{
+	struct dio_cluster **clus;
+	u64 vblock, last, *blocks;
+	int nr_blocks, nr_sums;
+	u32 nr;
+
+	if (len == 0)
+		return NULL;
+
+	vblock = nkfs_div(off, inode->sb->bsize);
+	last = nkfs_div(off + len - 1, inode->sb->bsize);
+	nr = min_t(u64, last - vblock + 1, NKFS_INODE_BATCH_MAX);
+
+	clus = crt_kmalloc(2 * nr * sizeof(*clus), GFP_NOIO);
+	if (!clus)
+		return NULL;
+
+	blocks = crt_kmalloc(2 * nr * sizeof(u64), GFP_NOIO);
+	if (!blocks) {
+		crt_kfree(clus);
+		return NULL;
+	}
+
+	nkfs_inode_blocks_lookup(inode, vblock, nr, blocks, &nr_blocks,
+				 blocks + nr, &nr_sums);
+	dio_batch_start(batch, inode->sb->ddev, clus, 2 * nr);
+	/* Errors are reported by reads of particular blocks */
+	dio_batch_add(batch, blocks, nr_blocks, DIO_CLASS_DATA);
+	dio_batch_add(batch, blocks + nr, nr_sums, DIO_CLASS_META);
+	crt_kfree(blocks);
+
+	return clus;
+}
+
+static void nkfs_inode_read_batch_end(struct dio_batch *batch,
+				      struct dio_cluster **clus)
+{
+	if (!clus)
+		return;
+
+	dio_batch_end(batch);
+	crt_kfree(clus);
+}
+
+/*
+ * Detect sequential reads and keep data clusters ahead of the reader.
+ * Window starts at NKFS_INODE_RA_MIN blocks and doubles up to
+ * NKFS_INODE_RA_MAX while access stays sequential. Next window is
+ * requested when reader consumed half of the current one.
+ */
+static void
+nkfs_inode_readahead(struct nkfs_inode *inode, u64 vblock, u64 size)
+{
+	u64 start, last;
+	u32 nr;
+
+	if (size == 0)
+		return;
+	last = nkfs_div(size - 1, inode->sb->bsize);
+
+	spin_lock(&inode->ra_lock);
+	if (vblock != inode->ra_next) {
+		inode->ra_next = vblock + 1;
+		inode->ra_end = vblock + 1;
+		inode->ra_size = 0;
+		spin_unlock(&inode->ra_lock);
+		return;
+	}
+	inode->ra_next = vblock + 1;
+
+	if (inode->ra_end > vblock + inode->ra_size / 2 ||
+	    inode->ra_end > last) {
+		spin_unlock(&inode->ra_lock);
+		return;
+	}
+
+	if (inode->ra_end <= vblock)
+		inode->ra_end = vblock + 1;
+	if (inode->ra_size == 0)
+		inode->ra_size = NKFS_INODE_RA_MIN;
+	else if (inode->ra_size < NKFS_INODE_RA_MAX)
+		inode->ra_size = min_t(u32, 2 * inode->ra_size,
+				       NKFS_INODE_RA_MAX);
+
+	start = inode->ra_end;
+	nr = min_t(u64, inode->ra_size, last - start + 1);
+	inode->ra_end = start + nr;
+	spin_unlock(&inode->ra_lock);
+
+	nkfs_inode_readahead_blocks(inode, start, nr);
+}
+
 static int
 nkfs_inode_read_block_buf(struct nkfs_inode *inode, u64 vblock, u32 off,
 			  void *buf, u32 len, u32 *pio_count, u32 *peof)
 {
 	int err;
 	struct inode_block ib;
-	u64 data_off;
+	struct csum sum;
+	u64 data_off, size;
 	u32 llen;
 
 	NKFS_BUG_ON(((u64)off + (u64)len) > inode->sb->bsize);
@@ -670,17 +873,17 @@ nkfs_inode_read_block_buf(struct nkfs_inode *inode, u64 vblock, u32 off,
 		*peof = 1;
 		return 0;
 	}
+	size = inode->size;
+	up_read(&inode->rw_sem);
+
+	if (off == 0)
+		nkfs_inode_readahead(inode, vblock, size);
 
 	err = nkfs_inode_block_read(inode, vblock, &ib);
 	if (err) {
 		return err;
 	}
 
-	err = nkfs_inode_block_check_sum(inode, &ib);
-	if (err) {
-		goto out;
-	}
-
 	down_read(&inode->rw_sem);
 	if ((data_off + len) >= inode->size) {
 		llen = inode->size - data_off;
@@ -690,11 +893,18 @@ nkfs_inode_read_block_buf(struct nkfs_inode *inode, u64 vblock, u32 off,
 	}
 	up_read(&inode->rw_sem);
 
-	err = dio_clu_read(ib.clu, buf, llen, off);
+	/* Data is verified and copied out by single pass */
+	err = dio_clu_read_sum(ib.clu, buf, llen, off, &sum);
 	if (err) {
 		goto out;
 	}
 
+	if (0 != memcmp(dio_clu_map(ib.sum_clu, ib.sum_off), &sum,
+			sizeof(sum))) {
+		err = -EINVAL;
+		goto out;
+	}
+
 	*pio_count = llen;
 	err = 0;
 out:
@@ -704,7 +914,8 @@ out:
 
 static int
 nkfs_inode_write_block_buf(struct nkfs_inode *inode, u64 vblock, u32 off,
-			   void *buf, u32 len, u32 *pio_count, int *peof)
+			   void *buf, u32 len, u32 *pio_count, int *peof,
+			   struct nkfs_btree_trans *trans)
 {
 	int err;
 	struct inode_block ib;
@@ -715,7 +926,7 @@ nkfs_inode_write_block_buf(struct nkfs_inode *inode, u64 vblock, u32 off,
 	*peof = 0;
 	*pio_count = 0;
 
-	err = nkfs_inode_block_read_create(inode, vblock, &ib);
+	err = nkfs_inode_block_read_create(inode, vblock, &ib, trans);
 	if (err) {
 		return err;
 	}
@@ -730,16 +941,11 @@ nkfs_inode_write_block_buf(struct nkfs_inode *inode, u64 vblock, u32 off,
 		goto out;
 	}
 
+	/* New size is written by nkfs_inode_io_pages() after mappings */
 	data_end = vblock*inode->sb->bsize + off + len;
 	down_write(&inode->rw_sem);
-	if (data_end > inode->size) {
+	if (data_end > inode->size)
 		nkfs_inode_set_size(inode, data_end);
-		err = nkfs_inode_write_dirty(inode);
-		if (err) {
-			up_write(&inode->rw_sem);
-			goto out;
-		}
-	}
 	up_write(&inode->rw_sem);
 
 	*pio_count = len;
@@ -751,7 +957,8 @@ out:
 
 static int nkfs_inode_io_buf(struct nkfs_inode *inode, u64 off,
 			     void *buf, u32 len, int write,
-			     u32 *pio_count, int *peof)
+			     u32 *pio_count, int *peof,
+			     struct nkfs_btree_trans *trans)
 {
 	int err;
 	u64 vblock = nkfs_div(off, inode->sb->bsize);
@@ -769,7 +976,8 @@ static int nkfs_inode_io_buf(struct nkfs_inode *inode, u64 off,
 		if (write) {
 			err = nkfs_inode_write_block_buf(inode, vblock, loff,
 							 pos, llen,
-							 &io_count, &eof);
+							 &io_count, &eof,
+							 trans);
 		} else {
 			err = nkfs_inode_read_block_buf(inode, vblock, loff,
 							pos, llen,
@@ -798,12 +1006,21 @@ int nkfs_inode_io_pages(struct nkfs_inode *inode, u64 off, u32 pg_off, u32 len,
 			struct page **pages, int nr_pages, int write,
 			u32 *pio_count)
 {
-	int err;
+	int err, err2;
 	int i;
 	void *buf;
 	u32 llen;
 	u32 io_count, io_count_sum;
 	int eof;
+	struct dio_batch batch;
+	struct dio_cluster **batch_clus = NULL;
+	struct nkfs_btree_trans trans;
+
+	/* Mappings of new blocks of request are written by one commit */
+	nkfs_btree_trans_init(&trans);
+	if (!write)
+		batch_clus = nkfs_inode_read_batch_start(inode, off, len,
+							 &batch);
 
 	io_count_sum = 0;
 	i = 0;
@@ -817,7 +1034,7 @@ int nkfs_inode_io_pages(struct nkfs_inode *inode, u64 off, u32 pg_off, u32 len,
 				(PAGE_SIZE - pg_off) : len;
 		err = nkfs_inode_io_buf(inode, off,
 					(void *)((unsigned long)buf + pg_off),
-					llen, write, &io_count, &eof);
+					llen, write, &io_count, &eof, &trans);
 		kunmap(pages[i]);
 		if (err)
 			goto fail;
@@ -832,8 +1049,18 @@ int nkfs_inode_io_pages(struct nkfs_inode *inode, u64 off, u32 pg_off, u32 len,
 	}
 
 	*pio_count = io_count_sum;
-	return 0;
+	err = 0;
 fail:
+	err2 = nkfs_btree_trans_commit(&trans);
+	if (!err2 && write) {
+		/* Size must not cover blocks which mappings are not on disk */
+		down_write(&inode->rw_sem);
+		err2 = nkfs_inode_write_dirty(inode);
+		up_write(&inode->rw_sem);
+	}
+	if (!err)
+		err = err2;
+	nkfs_inode_read_batch_end(&batch, batch_clus);
 	return err;
 }
 
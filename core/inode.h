@@ -2,6 +2,7 @@
 #define __NKFS_CORE_INODE_H__
 
 #include <linux/atomic.h>
+#include <linux/spinlock.h>
 #include <include/nkfs_obj_id.h>
 
 #include "super.h"
@@ -25,9 +26,20 @@ struct nkfs_inode {
 	struct nkfs_btree	*blocks_sum_tree;
 	struct nkfs_sb		*sb;
 	u32			dirty;
+	/* Sequential read detection and readahead window */
+	spinlock_t		ra_lock;
+	u64			ra_next;	/* Expected next vblock */
+	u64			ra_end;		/* First vblock not read ahead */
+	u32			ra_size;	/* Last window size in blocks */
 	u32			sig2;
 };
 
+/* Readahead window limits in blocks */
+#define NKFS_INODE_RA_MIN	4
+#define NKFS_INODE_RA_MAX	32
+/* Max count of blocks read in parallel for single request */
+#define NKFS_INODE_BATCH_MAX	64
+
 struct inode_block {
 	u64			vblock;
 	u64			block;
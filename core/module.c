@@ -48,7 +48,8 @@ static long nkfs_ioctl(struct file *file, unsigned int code, unsigned long arg)
 	switch (code) {
 	case IOCTL_NKFS_DEV_ADD:
 		err = nkfs_dev_add(cmd->u.dev_add.dev_name,
-				   cmd->u.dev_add.format);
+				   cmd->u.dev_add.format,
+				   cmd->u.dev_add.poll);
 		break;
 	case IOCTL_NKFS_DEV_REMOVE:
 		err = nkfs_dev_remove(cmd->u.dev_remove.dev_name);
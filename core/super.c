@@ -8,11 +8,23 @@
 
 #include <crt/include/crt.h>
 #include <linux/fs.h>
+#include <linux/module.h>
 
 static DECLARE_RWSEM(sb_list_lock);
 static LIST_HEAD(sb_list);
 
+static bool cache_warmup = true;
+module_param(cache_warmup, bool, 0644);
+MODULE_PARM_DESC(cache_warmup,
+	"Save cached block list at device stop and prefetch it at load");
+
+static int btree_load_test;
+module_param(btree_load_test, int, 0644);
+MODULE_PARM_DESC(btree_load_test,
+	"Count of keys of btree bulk load test run at format, 0 disables");
+
 static int nkfs_sb_sync(struct nkfs_sb *sb);
+static void nkfs_sb_warm_save(struct nkfs_sb *sb);
 
 static void nkfs_sb_release(struct nkfs_sb *sb)
 {
@@ -37,6 +49,7 @@ void nkfs_sb_stop(struct nkfs_sb *sb)
 		nkfs_btree_stop(sb->inodes_tree);
 
 	NKFS_BUG_ON(sb->inodes_active);
+	nkfs_sb_warm_save(sb);
 	nkfs_sb_sync(sb);
 }
 
@@ -217,7 +230,7 @@ static int nkfs_sb_gen_header(struct nkfs_sb *sb,
 
 
 	sb->magic = NKFS_IMAGE_MAGIC;
-	sb->version = NKFS_IMAGE_VER_1;
+	sb->version = NKFS_IMAGE_VER_3;
 	sb->size = size;
 	sb->bsize = bsize;
 
@@ -288,7 +301,12 @@ static int nkfs_sb_sync(struct nkfs_sb *sb)
 	struct nkfs_image_header header;
 	int err;
 
-	clu = dio_clu_get(sb->ddev, 0);
+	/* Flush everything the header refers to before the header itself */
+	err = dio_dev_sync(sb->ddev);
+	if (err)
+		return err;
+
+	clu = dio_clu_get(sb->ddev, 0, DIO_CLASS_META);
 	if (!clu) {
 		return -EIO;
 	}
@@ -310,6 +328,126 @@ out:
 	return err;
 }
 
+static void nkfs_image_warm_sum(struct nkfs_image_warm *warm, u32 nr,
+	struct csum *sum)
+{
+	struct csum_ctx ctx;
+
+	csum_reset(&ctx);
+	csum_update(&ctx, warm, offsetof(struct nkfs_image_warm, sum));
+	csum_update(&ctx, warm->blocks, nr * sizeof(warm->blocks[0]));
+	csum_digest(&ctx, sum);
+}
+
+static u32 nkfs_sb_warm_max(struct nkfs_sb *sb)
+{
+	if (sb->bsize <= NKFS_IMAGE_WARM_OFF + sizeof(struct nkfs_image_warm))
+		return 0;
+
+	return (sb->bsize - NKFS_IMAGE_WARM_OFF -
+		sizeof(struct nkfs_image_warm)) / sizeof(__be64);
+}
+
+/*
+ * Save indexes of cached blocks into header block, metadata first,
+ * header itself is written by following nkfs_sb_sync().
+ */
+static void nkfs_sb_warm_save(struct nkfs_sb *sb)
+{
+	struct nkfs_image_warm *warm;
+	struct dio_cluster *clu;
+	u64 *blocks;
+	u32 max, nr_meta, nr_data, i;
+
+	max = nkfs_sb_warm_max(sb);
+	if (!cache_warmup || !max)
+		return;
+
+	clu = dio_clu_get(sb->ddev, 0, DIO_CLASS_META);
+	if (!clu)
+		return;
+
+	/* Writeback must not catch the list half written */
+	dio_clu_modify_begin(clu);
+	dio_clu_write_lock(clu);
+	warm = (struct nkfs_image_warm *)dio_clu_map(clu,
+						     NKFS_IMAGE_WARM_OFF);
+	blocks = (u64 *)warm->blocks;
+	nr_meta = dio_dev_cached_indexes(sb->ddev, DIO_CLASS_META,
+					 blocks, max);
+	nr_data = dio_dev_cached_indexes(sb->ddev, DIO_CLASS_DATA,
+					 blocks + nr_meta, max - nr_meta);
+	for (i = 0; i < nr_meta + nr_data; i++)
+		warm->blocks[i] = cpu_to_be64(blocks[i]);
+
+	warm->sig = cpu_to_be32(NKFS_IMAGE_WARM_SIG);
+	warm->nr_meta = cpu_to_be32(nr_meta);
+	warm->nr_data = cpu_to_be32(nr_data);
+	warm->pad = 0;
+	nkfs_image_warm_sum(warm, nr_meta + nr_data, &warm->sum);
+	dio_clu_write_unlock(clu);
+	dio_clu_modify_end(clu);
+	dio_clu_put(clu);
+
+	nkfs_info("sb 0x%p saved %u meta %u data blocks for warm-up",
+		sb, nr_meta, nr_data);
+}
+
+/*
+ * Prefetch blocks saved by nkfs_sb_warm_save() by large merged reads,
+ * reads are only submitted and not waited for.
+ */
+static void nkfs_sb_warm_load(struct nkfs_sb *sb, struct dio_cluster *clu)
+{
+	struct nkfs_image_warm *warm;
+	struct csum sum;
+	u64 *blocks = NULL;
+	u32 max, nr_meta = 0, nr_data = 0, i;
+
+	max = nkfs_sb_warm_max(sb);
+	if (!cache_warmup || !max)
+		return;
+
+	dio_clu_read_lock(clu);
+	warm = (struct nkfs_image_warm *)dio_clu_map(clu,
+						     NKFS_IMAGE_WARM_OFF);
+	if (be32_to_cpu(warm->sig) != NKFS_IMAGE_WARM_SIG)
+		goto unlock;
+
+	nr_meta = be32_to_cpu(warm->nr_meta);
+	nr_data = be32_to_cpu(warm->nr_data);
+	if (nr_meta > max || nr_data > (max - nr_meta) ||
+	    (nr_meta + nr_data) == 0)
+		goto unlock;
+
+	nkfs_image_warm_sum(warm, nr_meta + nr_data, &sum);
+	if (0 != memcmp(&warm->sum, &sum, sizeof(sum)))
+		goto unlock;
+
+	blocks = crt_kmalloc((nr_meta + nr_data) * sizeof(u64), GFP_NOIO);
+	if (!blocks)
+		goto unlock;
+
+	for (i = 0; i < nr_meta + nr_data; i++) {
+		blocks[i] = be64_to_cpu(warm->blocks[i]);
+		if (blocks[i] >= sb->nr_blocks)
+			blocks[i] = 0;
+	}
+unlock:
+	dio_clu_read_unlock(clu);
+
+	if (!blocks)
+		return;
+
+	dio_clus_readahead(sb->ddev, blocks, nr_meta, DIO_CLASS_META);
+	dio_clus_readahead(sb->ddev, blocks + nr_meta, nr_data,
+			   DIO_CLASS_DATA);
+	crt_kfree(blocks);
+
+	nkfs_info("sb 0x%p warm-up %u meta %u data blocks",
+		sb, nr_meta, nr_data);
+}
+
 static int nkfs_sb_check(struct nkfs_sb *sb)
 {
 	int err;
@@ -319,8 +457,23 @@ static int nkfs_sb_check(struct nkfs_sb *sb)
 		goto out;
 	}
 
-	if (sb->version != NKFS_IMAGE_VER_1) {
+	/*
+	 * Btree nodes of NKFS_IMAGE_VER_1 have key pages written over child
+	 * pages, links of interior nodes are lost, nothing to convert from.
+	 */
+	if (sb->version == NKFS_IMAGE_VER_1) {
+		err = -EINVAL;
+		nkfs_error(err, "image version %u btree nodes are incomplete, "
+			   "copy objects out and format device again",
+			   sb->version);
+		goto out;
+	}
+
+	/* Trees of NKFS_IMAGE_VER_2 keep u64 keys in host order */
+	if (sb->version != NKFS_IMAGE_VER_2 &&
+	    sb->version != NKFS_IMAGE_VER_3) {
 		err = -EINVAL;
+		nkfs_error(err, "unsupported image version %u", sb->version);
 		goto out;
 	}
 
@@ -408,7 +561,7 @@ int nkfs_sb_format(struct nkfs_dev *dev, struct nkfs_sb **psb)
 
 	nkfs_info("sb format dev 0x%p %s", dev, dev->dev_name);
 
-	clu = dio_clu_get(dev->ddev, 0);
+	clu = dio_clu_get(dev->ddev, 0, DIO_CLASS_META);
 	if (!clu) {
 		err = -EIO;
 		goto out;
@@ -439,6 +592,12 @@ int nkfs_sb_format(struct nkfs_dev *dev, struct nkfs_sb **psb)
 
 	sb->inodes_tree_block = nkfs_btree_root_block(sb->inodes_tree);
 
+	if (btree_load_test > 0) {
+		err = nkfs_btree_load_test(sb, btree_load_test);
+		if (err)
+			goto del_sb;
+	}
+
 	dio_clu_zero(clu);
 	nkfs_sb_fill_header(sb, &header);
 
@@ -473,7 +632,7 @@ int nkfs_sb_load(struct nkfs_dev *dev, struct nkfs_sb **psb)
 
 	nkfs_info("sb load dev 0x%p %s", dev, dev->dev_name);
 
-	clu = dio_clu_get(dev->ddev, 0);
+	clu = dio_clu_get(dev->ddev, 0, DIO_CLASS_META);
 	if (!clu) {
 		err = -EIO;
 		goto out;
@@ -505,6 +664,8 @@ int nkfs_sb_load(struct nkfs_dev *dev, struct nkfs_sb **psb)
 		goto free_sb;
 	}
 
+	nkfs_sb_warm_load(sb, clu);
+
 	*psb = sb;
 	err = 0;
 	goto free_clu;
@@ -588,7 +749,7 @@ static int nkfs_sb_create_obj(struct nkfs_sb *sb,
 
 	err = nkfs_btree_insert_key(sb->inodes_tree,
 			(struct nkfs_btree_key *)&inode->ino,
-			(struct nkfs_btree_value *)&inode->block, 0);
+			(struct nkfs_btree_value *)&inode->block, 0, NULL);
 	if (err) {
 		nkfs_inode_delete(inode);
 		goto out;
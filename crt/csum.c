@@ -14,6 +14,14 @@ void csum_update(struct csum_ctx *ctx, const void *input, size_t len)
 }
 EXPORT_SYMBOL(csum_update);
 
+void csum_copy_update(struct csum_ctx *ctx, void *dst, const void *src,
+		      size_t len)
+{
+	if (XXH64_update_copy(&ctx->state, dst, src, len))
+		CRT_BUG();
+}
+EXPORT_SYMBOL(csum_copy_update);
+
 void csum_digest(struct csum_ctx *ctx, struct csum *sum)
 {
 	sum->val = XXH64_digest(&ctx->state);
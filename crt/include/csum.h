@@ -13,6 +13,8 @@ struct csum_ctx {
 
 void csum_reset(struct csum_ctx *ctx);
 void csum_update(struct csum_ctx *ctx, const void *input, size_t len);
+void csum_copy_update(struct csum_ctx *ctx, void *dst, const void *src,
+		      size_t len);
 void csum_digest(struct csum_ctx *ctx, struct csum *sum);
 u64 csum_u64(struct csum *sum);
 
@@ -129,6 +129,7 @@ unsigned int  XXH32_digest (const XXH32_state_t* statePtr);
 
 XXH_errorcode      XXH64_reset  (XXH64_state_t* statePtr, unsigned long long seed);
 XXH_errorcode      XXH64_update (XXH64_state_t* statePtr, const void* input, size_t length);
+XXH_errorcode      XXH64_update_copy (XXH64_state_t* statePtr, void* dst, const void* src, size_t length);
 unsigned long long XXH64_digest (const XXH64_state_t* statePtr);
 
 /*
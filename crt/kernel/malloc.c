@@ -41,6 +41,17 @@ void *crt_kmalloc(size_t size, gfp_t flags)
 }
 EXPORT_SYMBOL(crt_kmalloc);
 
+void *crt_kmalloc_node(size_t size, gfp_t flags, int node)
+{
+#ifdef __MALLOC_CHECKER__
+	/* Checker doesn't track placement */
+	return malloc_checker_kmalloc(size, flags);
+#else
+	return kmalloc_node(size, flags, node);
+#endif
+}
+EXPORT_SYMBOL(crt_kmalloc_node);
+
 void *crt_kcalloc(size_t n, size_t size, gfp_t flags)
 {
 #ifdef __MALLOC_CHECKER__
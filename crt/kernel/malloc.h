@@ -5,6 +5,8 @@
 
 void *crt_kmalloc(size_t size, gfp_t flags);
 
+void *crt_kmalloc_node(size_t size, gfp_t flags, int node);
+
 void *crt_kcalloc(size_t n, size_t size, gfp_t flags);
 
 void crt_kfree(void *ptr);
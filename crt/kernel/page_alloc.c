@@ -27,6 +27,17 @@ struct page *crt_alloc_page(gfp_t flags)
 }
 EXPORT_SYMBOL(crt_alloc_page);
 
+struct page *crt_alloc_page_node(gfp_t flags, int node)
+{
+#ifdef __PAGE_CHECKER__
+	/* Checker doesn't track placement */
+	return page_checker_alloc_page(flags);
+#else
+	return alloc_pages_node(node, flags, 0);
+#endif
+}
+EXPORT_SYMBOL(crt_alloc_page_node);
+
 void crt_free_page(struct page *page)
 {
 #ifdef __PAGE_CHECKER__
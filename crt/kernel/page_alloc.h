@@ -4,6 +4,7 @@
 #include <linux/gfp.h>
 
 struct page *crt_alloc_page(gfp_t flags);
+struct page *crt_alloc_page_node(gfp_t flags, int node);
 void crt_free_page(struct page *page);
 
 int crt_page_alloc_init(void);
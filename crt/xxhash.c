@@ -835,6 +835,87 @@ XXH_errorcode XXH64_update(XXH64_state_t* state_in, const void* input,
         return XXH64_update_endian(state_in, input, len, XXH_bigEndian);
 }
 
+// Copy input to dst and hash it in the same pass : every input word is
+// loaded once, stored to dst and mixed into the state from the register.
+#define XXH64_COPY_ROUND(v)                                   \
+    do {                                                      \
+        U64 w = A64(p);                                       \
+        A64(d) = w;                                           \
+        if (endian != XXH_littleEndian) w = XXH_swap64(w);    \
+        v += w * PRIME64_2;                                   \
+        v = XXH_rotl64(v, 31);                                \
+        v *= PRIME64_1;                                       \
+        p += 8;                                               \
+        d += 8;                                               \
+    } while (0)
+
+FORCE_INLINE XXH_errorcode XXH64_update_copy_endian (XXH64_state_t* state_in,
+			void* dst, const void* src, size_t len,
+			XXH_endianess endian)
+{
+    XXH_istate64_t * state = (XXH_istate64_t *) state_in;
+    const BYTE* p = (const BYTE*)src;
+    BYTE* d = (BYTE*)dst;
+    const BYTE* const bEnd = p + len;
+
+    if (state->memsize)   // complete stripe left from previous update
+    {
+        size_t head = 32 - state->memsize;
+
+        if (head > len)
+            head = len;
+        XXH_memcpy(d, p, head);
+        XXH64_update_endian(state_in, d, head, endian);
+        p += head;
+        d += head;
+    }
+
+    if (p+32 <= bEnd)
+    {
+        const BYTE* const limit = bEnd - 32;
+        const BYTE* const start = p;
+        U64 v1 = state->v1;
+        U64 v2 = state->v2;
+        U64 v3 = state->v3;
+        U64 v4 = state->v4;
+
+        do
+        {
+            XXH64_COPY_ROUND(v1);
+            XXH64_COPY_ROUND(v2);
+            XXH64_COPY_ROUND(v3);
+            XXH64_COPY_ROUND(v4);
+        } while (p<=limit);
+
+        state->v1 = v1;
+        state->v2 = v2;
+        state->v3 = v3;
+        state->v4 = v4;
+        state->total_len += p - start;
+    }
+
+    if (p < bEnd)   // tail is kept in state buffer
+    {
+        XXH_memcpy(d, p, bEnd-p);
+        XXH64_update_endian(state_in, d, bEnd-p, endian);
+    }
+
+    return XXH_OK;
+}
+
+XXH_errorcode XXH64_update_copy(XXH64_state_t* state_in, void* dst,
+				const void* src, size_t len)
+{
+    XXH_endianess endian_detected = (XXH_endianess)XXH_CPU_LITTLE_ENDIAN;
+
+    if ((endian_detected==XXH_littleEndian) || XXH_FORCE_NATIVE_FORMAT)
+        return XXH64_update_copy_endian(state_in, dst, src, len,
+					XXH_littleEndian);
+    else
+        return XXH64_update_copy_endian(state_in, dst, src, len,
+					XXH_bigEndian);
+}
+
 FORCE_INLINE U64 XXH64_digest_endian(const XXH64_state_t* state_in,
 				     XXH_endianess endian)
 {
@@ -16,7 +16,7 @@ static int nkfs_ctl_open(int *fd)
 	return 0;
 }
 
-int nkfs_dev_add(const char *dev_name, int format)
+int nkfs_dev_add(const char *dev_name, int format, int poll)
 {
 	int err = -EINVAL;
 	struct nkfs_ctl cmd;
@@ -31,6 +31,7 @@ int nkfs_dev_add(const char *dev_name, int format)
 		"%s", dev_name);
 
 	cmd.u.dev_add.format = format;
+	cmd.u.dev_add.poll = poll;
 	err = ioctl(fd, IOCTL_NKFS_DEV_ADD, &cmd);
 	if (err)
 		goto out;
@@ -16,7 +16,7 @@
 #include <include/nkfs_const.h>
 #include <crt/include/crt.h>
 
-int nkfs_dev_add(const char *dev_name, int format);
+int nkfs_dev_add(const char *dev_name, int format, int poll);
 int nkfs_dev_rem(const char *dev_name);
 
 int nkfs_dev_query(const char *dev_name,
@@ -15,7 +15,8 @@ static void usage(char *program)
 {
 
 #define USAGE_S								\
-"Usage: %s [-d device] [-f format] [-b bind ip] [-e ext ip] [-p port]"	\
+"Usage: %s [-d device] [-f format] [-P poll] [-b bind ip] [-e ext ip]"	\
+" [-p port]"								\
 " command{dev_add, dev_rem, dev_query, srv_start, srv_stop,"		\
 " neigh_add, neigh_remove, neigh_info}\n"
 
@@ -48,6 +49,21 @@ static int output_dev_info(struct nkfs_dev_info *info)
 		(unsigned long long)info->inodes_tree_block);
 	printf("bm_block : %llu\n", (unsigned long long)info->bm_block);
 	printf("bm_blocks : %llu\n", (unsigned long long)info->bm_blocks);
+	printf("cache_clus : %llu\n", (unsigned long long)info->cache_clus);
+	printf("cache_size : %llu\n", (unsigned long long)info->cache_size);
+	printf("cache_desc_size : %llu\n",
+		(unsigned long long)info->cache_desc_size);
+	if (info->cache_size)
+		printf("cache_desc_per_gb : %llu\n",
+			(unsigned long long)(info->cache_desc_size *
+			(1ULL << 30) / info->cache_size));
+	printf("btree_nodes : %llu\n", (unsigned long long)info->btree_nodes);
+	printf("btree_cached_nodes : %llu\n",
+		(unsigned long long)info->btree_cached_nodes);
+	printf("btree_node_hits : %llu\n",
+		(unsigned long long)info->btree_node_hits);
+	printf("btree_node_misses : %llu\n",
+		(unsigned long long)info->btree_node_misses);
 	crt_free(hex_sb_id);
 	return 0;
 }
@@ -74,7 +90,7 @@ static int output_neigh_info(struct nkfs_neigh_info *neigh)
 }
 
 static int do_cmd(char *prog, char *cmd, char *bind_ip_s, char *ext_ip_s,
-		  int port, char *dev_name, int format)
+		  int port, char *dev_name, int format, int poll)
 {
 	int err;
 	if (cmd_equal(cmd, "dev_add")) {
@@ -83,7 +99,7 @@ static int do_cmd(char *prog, char *cmd, char *bind_ip_s, char *ext_ip_s,
 			usage(prog);
 			return -EINVAL;
 		}
-		err = nkfs_dev_add(dev_name, format);
+		err = nkfs_dev_add(dev_name, format, poll);
 		if (err) {
 			printf("cant add device %s err %d\n", dev_name, err);
 		}
@@ -266,6 +282,7 @@ int main(int argc, char *argv[])
 {
 	int err = -EINVAL;
 	int format = 0;
+	int poll = 0;
 	int opt;
 	char *dev_name = NULL;
 	char *cmd = NULL;
@@ -276,11 +293,14 @@ int main(int argc, char *argv[])
 
 	prepare_logging();
 
-	while ((opt = getopt(argc, argv, "b:e:p:fd:")) != -1) {
+	while ((opt = getopt(argc, argv, "b:e:p:fPd:")) != -1) {
 		switch (opt) {
 			case 'f':
 				format = 1;
 				break;
+			case 'P':
+				poll = 1;
+				break;
 			case 'd':
 				dev_name = optarg;
 				break;
@@ -307,6 +327,6 @@ int main(int argc, char *argv[])
 
 	cmd = argv[optind];
 	err = do_cmd(prog, cmd, bind_ip_s, ext_ip_s, port,
-		dev_name, format);
+		dev_name, format, poll);
 	return err;
 }
@@ -19,6 +19,7 @@ struct nkfs_ctl {
 		struct {
 			char dev_name[NKFS_NAME_MAX_SZ];
 			int format;
+			int poll;
 		} dev_add;
 		struct {
 			char dev_name[NKFS_NAME_MAX_SZ];
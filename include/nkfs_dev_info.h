@@ -21,6 +21,14 @@ struct nkfs_dev_info {
 	u32			bsize;
 	unsigned int		major;
 	unsigned int		minor;
+	u64			cache_clus;
+	u64			cache_size;
+	u64			cache_desc_size;
+	/* Btree node cache, shared by all devices */
+	u64			btree_nodes;
+	u64			btree_cached_nodes;
+	u64			btree_node_hits;
+	u64			btree_node_misses;
 };
 
 #pragma pack(pop)
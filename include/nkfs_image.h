@@ -25,9 +25,20 @@
 #define NKFS_IMAGE_MAGIC	0x3EFFBDAE
 #define NKFS_IMAGE_SIG		0xBEDABEDA
 #define NKFS_IMAGE_VER_1	1
+/* Btree node keeps all NKFS_BTREE_KEY_PAGES, digest of on-disk bytes */
+#define NKFS_IMAGE_VER_2	2
+/*
+ * u64 btree keys are big-endian, see nkfs_btree_key_by_u64(). Images of
+ * NKFS_IMAGE_VER_2 are still used with host order keys.
+ */
+#define NKFS_IMAGE_VER_3	3
 
 #define NKFS_IMAGE_BM_BLOCK	1
 
+/* Cache warm-up list lives in header block after the header */
+#define NKFS_IMAGE_WARM_OFF	4096
+#define NKFS_IMAGE_WARM_SIG	0xCAC4EBED
+
 /* Do not change if you do not know about B-tree */
 #define NKFS_BTREE_T		896
 #define NKFS_BTREE_KEY_PAGES	7
@@ -95,7 +106,7 @@ _Static_assert(sizeof(struct nkfs_btree_header_page) == PAGE_SIZE,
 
 struct nkfs_btree_node_disk {
 	struct nkfs_btree_header_page	header;
-	struct nkfs_btree_key_page	keys[NKFS_BTREE_VALUE_PAGES];
+	struct nkfs_btree_key_page	keys[NKFS_BTREE_KEY_PAGES];
 	struct nkfs_btree_child_page	children[NKFS_BTREE_CHILD_PAGES];
 	struct nkfs_btree_value_page	values[NKFS_BTREE_VALUE_PAGES];
 };
@@ -112,7 +123,7 @@ struct nkfs_inode_disk {
 
 struct nkfs_image_header {
 	__be32			magic; /* = NKFS_IMAGE_MAGIC */
-	__be32			version; /* = NKFS_IMAGE_VER1 */
+	__be32			version; /* = NKFS_IMAGE_VER_3 */
 	struct nkfs_obj_id	id;	/* image unique id */
 	__be64			size; /*size of image in bytes includes header*/
 	__be64			bm_block; /*first blocks bitmap's block */
@@ -124,9 +135,18 @@ struct nkfs_image_header {
 	__be32			sig; /* = NKFS_IMAGE_SIG */
 };
 
+struct nkfs_image_warm {
+	__be32			sig; /* = NKFS_IMAGE_WARM_SIG */
+	__be32			nr_meta; /* metadata blocks, go first */
+	__be32			nr_data; /* data blocks */
+	__be32			pad;
+	struct csum		sum; /* sum of [sig ... pad] and blocks */
+	__be64			blocks[0]; /* cached blocks, hot first */
+};
+
 #pragma pack(pop)
 
-_Static_assert(sizeof(struct nkfs_btree_node_disk) <= NKFS_BLOCK_SIZE,
+_Static_assert(sizeof(struct nkfs_btree_node_disk) == NKFS_BLOCK_SIZE,
 	"size is not correct");
 _Static_assert(sizeof(struct nkfs_inode_disk) <= NKFS_BLOCK_SIZE,
 	"incorrect sizes");
@@ -0,0 +1,33 @@
+#!/bin/bash
+# Measure memory taken by dio cluster descriptors per GB of cached
+# clusters: fill cache of device with puts and gets, then read cache
+# counters of nkfs_ctl dev_query.
+#
+# usage: scripts/dio_mem.sh [device] [nr files] [file size KB]
+. scripts/common.sh
+
+DEV=${1:-/dev/loop10}
+NR_FILES=${2:-1000}
+FILE_KB=${3:-256}
+IP=127.0.0.1
+PORT=9111
+TMP=$(mktemp -d)
+
+exec dd if=/dev/urandom of=$TMP/file bs=1K count=$FILE_KB
+exec insmod bin/nkfs_crt.ko
+exec insmod bin/nkfs.ko
+exec bin/nkfs_ctl dev_add -d $DEV -f || exit 1
+exec bin/nkfs_ctl srv_start -b $IP -e $IP -p $PORT || exit 1
+
+for i in $(seq $NR_FILES); do
+	id=$(bin/nkfs_client put -f $TMP/file -s $IP -p $PORT)
+	bin/nkfs_client get -i $id -f $TMP/out -s $IP -p $PORT
+done
+
+bin/nkfs_ctl dev_query -d $DEV | grep "^cache_"
+
+exec bin/nkfs_ctl srv_stop -b $IP -p $PORT
+exec bin/nkfs_ctl dev_rem -d $DEV
+exec rmmod nkfs
+exec rmmod nkfs_crt
+rm -rf $TMP
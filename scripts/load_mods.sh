@@ -2,4 +2,4 @@
 . scripts/common.sh
 log "load modules"
 exec insmod bin/nkfs_crt.ko
-exec insmod bin/nkfs.ko
+exec insmod bin/nkfs.ko "$@"
@@ -0,0 +1,78 @@
+#!/bin/bash
+# Compare put/get latency of device added with interrupt completion and
+# with polled completion (nkfs_ctl dev_add -P) on null_blk with poll
+# queues. Cache is kept small so metadata reads miss and reach device.
+# Latency includes nkfs_client startup, compare modes with each other.
+#
+# usage: scripts/poll_bench.sh [nr files] [file size KB]
+. scripts/common.sh
+
+NR_FILES=${1:-200}
+FILE_KB=${2:-4}
+CACHE_MB=${CACHE_MB:-8}
+NULLB_PARAMS=${NULLB_PARAMS:-"nr_devices=1 queue_mode=2 gb=4 bs=4096 \
+memory_backed=1 poll_queues=2"}
+DEV=/dev/nullb0
+IP=127.0.0.1
+PORT=9111
+TMP=$(mktemp -d)
+
+function stats {
+	sort -n $1 | awk -v name=$2 '{ v[NR] = $1; s += $1 }
+		END { printf("%s: n %d avg %d us p50 %d us p99 %d us\n",
+			name, NR, s / NR, v[int(NR * 0.5) + 1],
+			v[int(NR * 0.99) + 1]) }'
+}
+
+function bench {
+	local mode=$1
+	local flags=$2
+	local i start end
+
+	exec bin/nkfs_ctl dev_add -d $DEV -f $flags || return 1
+	exec bin/nkfs_ctl srv_start -b $IP -e $IP -p $PORT || return 1
+
+	rm -f $TMP/ids $TMP/put.$mode $TMP/get.$mode
+	for i in $(seq $NR_FILES); do
+		start=$(date +%s%N)
+		bin/nkfs_client put -f $TMP/file -s $IP -p $PORT >> $TMP/ids
+		end=$(date +%s%N)
+		echo $(( (end - start) / 1000 )) >> $TMP/put.$mode
+	done
+
+	# Drop cached clusters so gets go to device
+	exec bin/nkfs_ctl srv_stop -b $IP -p $PORT
+	exec bin/nkfs_ctl dev_rem -d $DEV
+	exec bin/nkfs_ctl dev_add -d $DEV $flags || return 1
+	exec bin/nkfs_ctl srv_start -b $IP -e $IP -p $PORT || return 1
+
+	while read id; do
+		start=$(date +%s%N)
+		bin/nkfs_client get -i $id -f $TMP/out -s $IP -p $PORT
+		end=$(date +%s%N)
+		echo $(( (end - start) / 1000 )) >> $TMP/get.$mode
+	done < $TMP/ids
+
+	exec bin/nkfs_ctl srv_stop -b $IP -p $PORT
+	exec bin/nkfs_ctl dev_rem -d $DEV
+}
+
+log "poll bench files $NR_FILES size ${FILE_KB}KB"
+exec dd if=/dev/urandom of=$TMP/file bs=1K count=$FILE_KB
+exec modprobe null_blk $NULLB_PARAMS || exit 1
+exec insmod bin/nkfs_crt.ko
+exec insmod bin/nkfs.ko dio_cache_max_mb=$CACHE_MB dio_cache_min_mb=1
+
+bench irq ""
+bench poll "-P"
+
+exec rmmod nkfs
+exec rmmod nkfs_crt
+exec rmmod null_blk
+
+for op in put get; do
+	for mode in irq poll; do
+		[ -s $TMP/$op.$mode ] && stats $TMP/$op.$mode "$op $mode"
+	done
+done
+rm -rf $TMP
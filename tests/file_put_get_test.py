@@ -55,6 +55,8 @@ class FilePutGetTest(NkfsTest):
 		for p in proc_list:
 			log.info("process %s exit with code: %d" % (p.name, p.exitcode))
 
+		self.cold_get()
+
 		self.env.query_devs()
 
 		res = self.check_file_hash()
@@ -64,6 +66,17 @@ class FilePutGetTest(NkfsTest):
 		else:
 			self.set_passed()
 
+	def cold_get(self):
+		obj_ids = []
+		file_names = self.gen_tmp_files()
+		for f in file_names:
+			obj_ids.append(self.get_client().put_file(os.path.join(self.in_dir, f)))
+
+		self.env.readd_devs()
+
+		for obj_id, f in zip(obj_ids, file_names):
+			self.get_client().get_file(obj_id, os.path.join(self.out_dir, f))
+
 	def gen_tmp_files(self):
 		tmp_filenames = []
 		for f in xrange(0, self.file_count):
@@ -90,7 +103,7 @@ class FilePutGetTest(NkfsTest):
 			while len(buf) > 0:
 				hasher.update(buf)
 				buf = afile.read(block_size)
-		return buf
+		return hasher.hexdigest()
 
 	def check_file_hash(self):
 		broken_files = []
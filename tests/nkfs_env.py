@@ -18,6 +18,7 @@ log = logging.getLogger('main')
 
 LOOP_DEVS = {"/dev/loop10" : "loop10_file", "/dev/loop11" : "loop11_file", "/dev/loop12" : "loop12_file"}
 PORT = 9111
+BTREE_LOAD_TEST_KEYS = 100000
 
 def drop_caches():
 	for i in xrange(2):
@@ -84,7 +85,8 @@ class NkfsLocalLoopEnv(DsEnv):
 
 	def prepare(self):
 		if self.load_mods:
-			cmd.exec_cmd2("cd " + settings.PROJ_DIR + " && scripts/load_mods.sh", throw = True, elog = log)
+			# devices are formatted below, each runs btree bulk load test
+			cmd.exec_cmd2("cd " + settings.PROJ_DIR + " && scripts/load_mods.sh btree_load_test=" + str(BTREE_LOAD_TEST_KEYS), throw = True, elog = log)
 
 		if self.trace:
 			self.prepare_trace()
@@ -106,6 +108,13 @@ class NkfsLocalLoopEnv(DsEnv):
 		for d in self.devs:
 			c.query_dev(d)
 
+	def readd_devs(self):
+		# devices come back with empty caches
+		c = self.get_client()
+		for d in self.devs:
+			c.rem_dev(d)
+			c.add_dev(d)
+
 	def cleanup(self):
 		c = self.get_client()
 		for bind_ip, _, port in self.srvs: